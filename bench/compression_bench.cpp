@@ -0,0 +1,170 @@
+/*
+ * compression_bench.cpp
+ *
+ *  Created on: 09.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+/**
+ * Replays the packets of a pcap capture through every payload codec and
+ * level and prints the compression ratio against the CPU time. Each packet
+ * is compressed as one CMD_SEND payload, every compressed one is checked to
+ * decompress to the original. Capture the tun device of the tunnel
+ * (tcpdump -i tun0 -w <File>), so the packets are what the codecs get.
+ *
+ * Usage: compression_bench <Capture> [<Dictionary>]
+ */
+
+#include "compression.h"
+
+#include <Poco/Timestamp.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace Poco;
+
+static const uint32_t PCAP_MAGIC = 0xA1B2C3D4;
+static const uint32_t PCAP_MAGIC_NSEC = 0xA1B23C4D;
+static const uint32_t PCAP_HEADER_SIZE = 24;
+static const uint32_t PCAP_RECORD_SIZE = 16;
+
+static const int LZ_LEVELS[] = { 1, 2, 4, 8, 16, 32 };
+
+//------------------------------------------------------------------------------
+static uint32_t load32(const uint8_t *p, bool swap)
+{
+    return swap ? (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3]
+                : (uint32_t(p[3]) << 24) | (uint32_t(p[2]) << 16) | (uint32_t(p[1]) << 8) | p[0];
+}
+
+//------------------------------------------------------------------------------
+static bool loadCapture(const std::string &path, std::vector<std::vector<uint8_t> > &packets)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if(!file || data.size() < PCAP_HEADER_SIZE)
+    {
+        fprintf(stderr, "Cannot read %s\n", path.c_str());
+        return false;
+    }
+
+    bool swap = false;
+    uint32_t magic = load32(data.data(), false);
+    if(magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC)
+    {
+        swap = true;
+        magic = load32(data.data(), true);
+        if(magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC)
+        {
+            fprintf(stderr, "%s is no pcap file\n", path.c_str());
+            return false;
+        }
+    }
+
+    for(size_t offset = PCAP_HEADER_SIZE; offset + PCAP_RECORD_SIZE <= data.size();)
+    {
+        uint32_t size = load32(&data[offset + 8], swap);
+        offset += PCAP_RECORD_SIZE;
+        if(size > data.size() - offset)
+        {
+            fprintf(stderr, "%s is truncated\n", path.c_str());
+            break;
+        }
+
+        packets.push_back(std::vector<uint8_t>(data.begin() + offset, data.begin() + offset + size));
+        offset += size;
+    }
+    return !packets.empty();
+}
+
+//------------------------------------------------------------------------------
+static bool bench(const std::vector<std::vector<uint8_t> > &packets, const std::string &dict,
+                  Compression::Codec codec, const char *name, int level)
+{
+    Compression compressor;
+    Compression decompressor;
+    if(!dict.empty() && (!compressor.loadDictionary(dict) || !decompressor.loadDictionary(dict)))
+    {
+        return false;
+    }
+    compressor.setCodec(codec, level);
+
+    std::vector<std::vector<uint8_t> > out(packets.size());
+    std::vector<bool> compressed(packets.size());
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint32_t skipped = 0;
+
+    // The frames are timed as a whole, single ones are below the resolution
+    Timestamp start;
+    for(size_t i = 0; i < packets.size(); i++)
+    {
+        compressed[i] = compressor.compress(packets[i].data(), packets[i].size(), out[i]);
+    }
+    Timestamp::TimeDiff compress_usecs = start.elapsed();
+
+    start.update();
+    std::vector<uint8_t> plain;
+    bool ok = true;
+    for(size_t i = 0; i < packets.size(); i++)
+    {
+        if(compressed[i])
+        {
+            ok = decompressor.decompress(out[i].data(), out[i].size(), plain) && plain == packets[i] && ok;
+        }
+    }
+    Timestamp::TimeDiff decompress_usecs = start.elapsed();
+
+    for(size_t i = 0; i < packets.size(); i++)
+    {
+        bytes_in += packets[i].size();
+        bytes_out += compressed[i] ? out[i].size() : packets[i].size();
+        skipped += compressed[i] ? 0 : 1;
+    }
+
+    double kbytes = bytes_in / 1024.0;
+    printf("%-8s %5d  %6.3f  %7.1f%%  %9.2f  %9.2f%s\n", name, level, double(bytes_out) / bytes_in,
+           100.0 * skipped / packets.size(), compress_usecs / kbytes, decompress_usecs / kbytes,
+           ok ? "" : "  MISMATCH");
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <Capture> [<Dictionary>]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::vector<uint8_t> > packets;
+    if(!loadCapture(argv[1], packets))
+    {
+        return 1;
+    }
+    std::string dict = argc > 2 ? argv[2] : "";
+
+    uint64_t bytes = 0;
+    for(size_t i = 0; i < packets.size(); i++)
+    {
+        bytes += packets[i].size();
+    }
+    printf("%zu packets, %llu bytes%s%s\n\n", packets.size(), (unsigned long long)bytes,
+           dict.empty() ? "" : ", dictionary ", dict.c_str());
+    printf("codec    level   ratio  skipped  comp us/KB  dec us/KB\n");
+
+    bool ok = true;
+    for(uint32_t i = 0; i < sizeof(LZ_LEVELS) / sizeof(LZ_LEVELS[0]); i++)
+    {
+        ok = bench(packets, dict, Compression::CODEC_LZ, "lz", LZ_LEVELS[i]) && ok;
+    }
+    for(int level = 1; level <= 9; level++)
+    {
+        ok = bench(packets, dict, Compression::CODEC_DEFLATE, "deflate", level) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+/*
+ * crc_bench.cpp
+ *
+ *  Created on: 09.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+/**
+ * Checks that the CRC-32C kernel selected for this CPU and the portable
+ * slice-by-8 and bytewise kernels agree, then times them on frame sized
+ * buffers.
+ *
+ * Usage: crc_bench [<MB per size>]
+ */
+
+#include "crc.h"
+
+#include <Poco/Timestamp.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace Poco;
+
+static const uint32_t CHECK_VALUE = 0xE3069283;     // CRC-32C of "123456789"
+static const uint32_t MAX_CHECK_SIZE = 1024;
+static const uint32_t SIZES[] = { 16, 64, 256, 1500, 4096 };
+static const uint32_t BUFFER_SIZE = 4096;
+
+// Keeps the timed loops from being optimized away
+static volatile uint32_t sink;
+
+typedef uint32_t (*Kernel)(const uint8_t *data, uint32_t size);
+
+//------------------------------------------------------------------------------
+static uint32_t bytewise(const uint8_t *data, uint32_t size)
+{
+    return ~Crc::crc32cBytewise(0xFFFFFFFF, data, size);
+}
+
+//------------------------------------------------------------------------------
+static uint32_t slice8(const uint8_t *data, uint32_t size)
+{
+    return ~Crc::crc32cSlice8(0xFFFFFFFF, data, size);
+}
+
+//------------------------------------------------------------------------------
+// Every length up to MAX_CHECK_SIZE at every alignment of a word
+static bool check(const std::vector<uint8_t> &buffer)
+{
+    const uint8_t *digits = reinterpret_cast<const uint8_t *>("123456789");
+    if(bytewise(digits, 9) != CHECK_VALUE || slice8(digits, 9) != CHECK_VALUE
+       || Crc::crc32c(digits, 9) != CHECK_VALUE)
+    {
+        printf("Check value mismatch: bytewise %08X, slice-by-8 %08X, %s %08X\n", bytewise(digits, 9),
+               slice8(digits, 9), Crc::kernel(), Crc::crc32c(digits, 9));
+        return false;
+    }
+
+    for(uint32_t offset = 0; offset < 8; offset++)
+    {
+        for(uint32_t size = 0; size <= MAX_CHECK_SIZE; size++)
+        {
+            const uint8_t *data = buffer.data() + offset;
+            uint32_t expected = bytewise(data, size);
+            if(slice8(data, size) != expected || Crc::crc32c(data, size) != expected)
+            {
+                printf("Mismatch at offset %u, %u bytes: bytewise %08X, slice-by-8 %08X, %s %08X\n", offset, size,
+                       expected, slice8(data, size), Crc::kernel(), Crc::crc32c(data, size));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static double rate(Kernel kernel, const std::vector<uint8_t> &buffer, uint32_t size, uint64_t total)
+{
+    uint64_t rounds = total / size + 1;
+    uint32_t sum = 0;
+
+    Timestamp start;
+    for(uint64_t i = 0; i < rounds; i++)
+    {
+        sum += kernel(buffer.data(), size);
+    }
+    Timestamp::TimeDiff usecs = start.elapsed();
+    sink = sum;
+
+    return usecs > 0 ? double(rounds) * size / usecs : 0;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    uint64_t total = (argc > 1 ? strtoull(argv[1], nullptr, 0) : 64) * 1024 * 1024;
+    if(total == 0)
+    {
+        fprintf(stderr, "Usage: %s [<MB per size>]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> buffer(BUFFER_SIZE);
+    srand(1);
+    for(size_t i = 0; i < buffer.size(); i++)
+    {
+        buffer[i] = rand();
+    }
+
+    printf("Selected kernel: %s\n", Crc::kernel());
+    if(!check(buffer))
+    {
+        return 1;
+    }
+    printf("Kernels agree on %u lengths at 8 alignments\n\n", MAX_CHECK_SIZE + 1);
+
+    printf("  size   bytewise  slice-by-8  %10s  (MB/s)\n", Crc::kernel());
+    for(uint32_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); i++)
+    {
+        printf("%6u  %9.0f  %10.0f  %10.0f\n", SIZES[i], rate(bytewise, buffer, SIZES[i], total),
+               rate(slice8, buffer, SIZES[i], total), rate(Crc::crc32c, buffer, SIZES[i], total));
+    }
+    return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * serial_bench.cpp
+ *
+ *  Created on: 09.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+/**
+ * Compares the epoll and io_uring backends on a pty pair. The Serial port
+ * runs with the defaults of the tunnel on the slave side and echoes what it
+ * reads, the master side measures the round trip of single frames and the
+ * throughput of a continuous stream.
+ *
+ * Usage: serial_bench [<Pings> [<Bytes> [<Frame size>]]]
+ */
+
+#include "serial.h"
+
+#include <Poco/Runnable.h>
+#include <Poco/RunnableAdapter.h>
+#include <Poco/Thread.h>
+#include <Poco/Timestamp.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace Poco;
+
+static const uint32_t BAUDRATE = 115200;
+static const uint32_t URING_ENTRIES = 64;
+static const int READ_TIMEOUT = 1000;
+
+class Echo : public Serial::Listener
+{
+    protected:
+        Serial &serial_;
+
+    public:
+        uint64_t bytes_;
+        uint32_t closed_;
+
+        Echo(Serial &serial) : serial_(serial), bytes_(0), closed_(0) {}
+
+        void dataReceived(uint8_t *buffer, uint32_t length)
+        {
+            bytes_ += length;
+            serial_.send(buffer, length);
+            serial_.flush();
+        }
+
+        void portClosed()
+        {
+            closed_++;
+        }
+};
+
+class Writer : public Runnable
+{
+    protected:
+        int fd_;
+        uint64_t total_;
+        uint32_t frame_size_;
+
+    public:
+        Writer(int fd, uint64_t total, uint32_t frame_size) : fd_(fd), total_(total), frame_size_(frame_size) {}
+
+        void run()
+        {
+            std::vector<uint8_t> frame(frame_size_);
+            for(uint64_t sent = 0; sent < total_;)
+            {
+                uint32_t size = total_ - sent < frame_size_ ? uint32_t(total_ - sent) : frame_size_;
+                for(uint32_t i = 0; i < size; i++)
+                {
+                    frame[i] = uint8_t(sent + i);
+                }
+
+                ssize_t len = write(fd_, frame.data(), size);
+                if(len < 0 && errno != EINTR)
+                {
+                    perror("Writing to the pty failed");
+                    return;
+                }
+                sent += len > 0 ? len : 0;
+            }
+        }
+};
+
+//------------------------------------------------------------------------------
+// Reads exactly size bytes, false on a timeout or error
+static bool readAll(int fd, uint8_t *data, uint32_t size)
+{
+    for(uint32_t done = 0; done < size;)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if(poll(&pfd, 1, READ_TIMEOUT) <= 0)
+        {
+            return false;
+        }
+
+        ssize_t len = read(fd, data + done, size - done);
+        if(len <= 0)
+        {
+            if(len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        done += len;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static bool bench(bool uring, uint32_t pings, uint64_t total, uint32_t frame_size)
+{
+    const char *name = uring ? "io_uring" : "epoll";
+
+    int master, slave;
+    char device[64];
+    struct termios tty;
+    cfmakeraw(&tty);
+    if(openpty(&master, &slave, device, &tty, nullptr) < 0)
+    {
+        perror("Cannot open a pty");
+        return false;
+    }
+
+    Reactor reactor;
+    if(uring && !reactor.enableUring(URING_ENTRIES))
+    {
+        printf("%-8s  not supported by the kernel\n", name);
+        ::close(master);
+        ::close(slave);
+        return true;
+    }
+
+    Serial serial;
+    Echo echo(serial);
+    serial.setListener(&echo);
+    if(!serial.open(device, BAUDRATE))
+    {
+        ::close(master);
+        ::close(slave);
+        return false;
+    }
+    // The port keeps the slave open
+    ::close(slave);
+    serial.attach(&reactor);
+
+    RunnableAdapter<Reactor> loop(reactor, &Reactor::run);
+    Thread thread;
+    thread.start(loop);
+
+    bool ok = true;
+
+    // Round trip of single frames
+    std::vector<long> rtts;
+    std::vector<uint8_t> out(frame_size);
+    std::vector<uint8_t> in(frame_size);
+    for(uint32_t i = 0; ok && i < pings; i++)
+    {
+        memset(out.data(), uint8_t(i), out.size());
+        Timestamp sent;
+        ok = write(master, out.data(), out.size()) == ssize_t(out.size())
+             && readAll(master, in.data(), in.size()) && in == out;
+        rtts.push_back(long(sent.elapsed()));
+    }
+
+    // Continuous stream, written and read back at the same time
+    double rate = 0;
+    if(ok)
+    {
+        Writer writer(master, total, frame_size);
+        Thread writer_thread;
+        Timestamp start;
+        writer_thread.start(writer);
+
+        std::vector<uint8_t> buffer(4096);
+        for(uint64_t done = 0; ok && done < total;)
+        {
+            uint32_t size = total - done < buffer.size() ? uint32_t(total - done) : buffer.size();
+            ok = readAll(master, buffer.data(), size);
+            for(uint32_t i = 0; ok && i < size; i++)
+            {
+                ok = buffer[i] == uint8_t(done + i);
+            }
+            done += size;
+        }
+        writer_thread.join();
+        rate = ok ? total / double(start.elapsed()) : 0;
+    }
+
+    reactor.stop();
+    thread.join();
+    serial.close();
+    ::close(master);
+
+    if(!ok || echo.closed_ > 0)
+    {
+        printf("%-8s  failed after %llu bytes%s\n", name, (unsigned long long)echo.bytes_,
+               echo.closed_ > 0 ? ", port closed" : "");
+        return false;
+    }
+
+    std::sort(rtts.begin(), rtts.end());
+    printf("%-8s  rtt median %5ld us  p99 %5ld us  max %6ld us  echo %7.2f MB/s\n", name,
+           rtts[rtts.size() / 2], rtts[rtts.size() * 99 / 100], rtts.back(), rate);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    uint32_t pings = argc > 1 ? strtoul(argv[1], nullptr, 0) : 2000;
+    uint64_t total = argc > 2 ? strtoull(argv[2], nullptr, 0) : 16 * 1024 * 1024;
+    uint32_t frame_size = argc > 3 ? strtoul(argv[3], nullptr, 0) : 64;
+    if(pings == 0 || frame_size == 0 || frame_size > Serial::MAX_QUEUED)
+    {
+        fprintf(stderr, "Usage: %s [<Pings> [<Bytes> [<Frame size>]]]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%u pings, %llu bytes echoed, %u byte frames, %u baud\n", pings, (unsigned long long)total,
+           frame_size, BAUDRATE);
+
+    bool ok = bench(false, pings, total, frame_size);
+    ok = bench(true, pings, total, frame_size) && ok;
+    return ok ? 0 : 1;
+}
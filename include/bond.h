@@ -0,0 +1,158 @@
+/*
+ * bond.h
+ *
+ *  Created on: 09.05.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include "protocol.h"
+#include "reactor.h"
+#include "serial.h"
+
+#include <Poco/Logger.h>
+#include <Poco/Timestamp.h>
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Bundles one or more serial links behind one tunnel.
+ *
+ * With a single link packets are passed through unchanged. With more links
+ * every packet gets a 3 byte bond header in front: the 2 byte bond sequence
+ * number and the distance to the previous packet of the same flow bucket (0 if
+ * there is none within the last 255 packets). The scheduler picks a link per
+ * packet and the receiver only keeps the packets of one flow in order, so a
+ * packet lost or dropped on the way just stalls its own flow. A missing
+ * predecessor is skipped after REORDER_TIMEOUT ms; if it arrives after that
+ * it is passed on late instead of being dropped. Both sides have to use more
+ * than one link.
+ */
+class Bond : public Protocol::Listener, public Reactor::Handler
+{
+    public:
+        enum Schedule
+        {
+            SCHEDULE_FLOW,      // Packets of one flow always use the same link
+            SCHEDULE_CAPACITY   // Least queued data relative to the measured link rate
+        };
+
+        static const uint32_t HEADER_SIZE = 3;
+        static const uint32_t FLOW_BUCKETS = 256;
+        static const uint32_t MAX_DISTANCE = 255;
+        static const uint32_t REORDER_WINDOW = 1024;
+        static const uint32_t REORDER_TIMEOUT = 100;
+        static const uint32_t STALE_LIMIT = 16;
+        static const uint32_t RATE_INTERVAL = 100;
+
+    protected:
+        struct Link
+        {
+            std::string device;
+            Serial *serial;
+            Protocol *protocol;
+            bool up;
+            uint64_t bytes_sent;
+            uint32_t rate;
+        };
+
+        enum SlotState
+        {
+            SLOT_EMPTY,
+            SLOT_MISSING,       // Not received yet, a successor waits for it
+            SLOT_HELD,          // Received, waits for its predecessor
+            SLOT_DELIVERED
+        };
+
+        struct Slot
+        {
+            SlotState state;
+            uint16_t seq;
+            bool has_successor;
+            uint16_t successor;
+            std::vector<uint8_t> data;
+            Poco::Timestamp received;
+        };
+
+        Poco::Logger &logger_;
+        Reactor *reactor_;
+        Protocol::Listener *listener_;
+        Schedule schedule_;
+
+        std::vector<Link> links_;
+        Poco::Timestamp rate_sampled_;
+
+        // Link the last packet was refused by, the tunnel waits on space_fd_
+        int blocked_link_;
+        int watched_fd_;
+        int space_fd_;
+
+        uint16_t tx_seq_;
+        bool tx_used_[FLOW_BUCKETS];
+        uint16_t tx_last_[FLOW_BUCKETS];
+        std::vector<uint8_t> tx_scratch_;
+
+        // Reordering of received packets, everything before rx_base_ counts
+        // as delivered
+        bool rx_synced_;
+        uint16_t rx_base_;
+        uint16_t rx_highest_;
+        uint32_t rx_held_;
+        uint32_t rx_stale_;
+        Slot reorder_[REORDER_WINDOW];
+        Reactor::Timer timer_;
+
+    public:
+        Bond();
+        virtual ~Bond();
+
+        void setListener(Protocol::Listener *listener);
+        void setSchedule(Schedule schedule);
+        static Schedule parseSchedule(const std::string &name);
+
+        /**
+         * Opens the serial device, see Serial::setLowLatency() and
+         * Serial::setReadTiming() for the other parameters.
+         */
+        bool addLink(const std::string &device, uint32_t baudrate, bool low_latency = true, uint8_t vmin = 0,
+                     uint8_t vtime = 0);
+        uint32_t getLinkCount() const;
+        Protocol *getProtocol(uint32_t index);
+
+        void start(Reactor *reactor);
+        void close();
+
+        /**
+         * Sends the packet over one of the links. flow is a hash of the
+         * packet's flow, see flowHash(). Returns false if the selected link
+         * is full, see Protocol::sendData().
+         */
+        bool sendData(const uint8_t *data, uint32_t size, uint32_t flow, Classifier::Class cls);
+
+        /**
+         * Largest packet every link sends in one frame, 0 is no limit.
+         */
+        uint32_t getMtu() const;
+        bool waitTxSpace();
+        int getTxSpaceFd() const;
+
+        static uint32_t flowHash(const uint8_t *packet, uint32_t size);
+
+        virtual void onPacketReceived(const uint8_t *data, uint32_t size);
+        virtual void onPortClosed(Protocol *protocol);
+        virtual void onLinkReady(Protocol *protocol);
+        virtual void onEvent(int fd, uint32_t events);
+
+    protected:
+        int selectLink(uint32_t flow, uint32_t size);
+        void updateRates();
+        void deliver(const uint8_t *data, uint32_t size);
+        void release(uint16_t seq);
+        void advance(uint16_t base);
+        void resync(uint16_t seq);
+        void skipGap();
+        void signalSpace();
+};
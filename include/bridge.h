@@ -0,0 +1,146 @@
+/*
+ * bridge.h
+ *
+ *  Created on: 12.06.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <Poco/Logger.h>
+#include <Poco/Timestamp.h>
+
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Layer 2 side of the TAP mode, keeps broadcasts and Ethernet headers off
+ * the RF link.
+ *
+ * ARP/ND proxy: neighbours on the far side are learned from the ARP packets
+ * and neighbor solicitations/advertisements received over the link. An ARP
+ * request or neighbor solicitation from the local side for a known neighbour
+ * is answered locally. Only misses are forwarded, the same miss at most once
+ * every REQUEST_INTERVAL ms.
+ *
+ * Header elision works like HeaderCompression: unicast frames get a context
+ * per destination, source and EtherType. The first frame of a context (and
+ * every REFRESH_INTERVAL frames after that) is sent as LEARN frame with the
+ * full header, the others only carry the context id and a check byte of the
+ * header instead of its 14 bytes. A receiver without the context drops the
+ * frame and returns a feedback packet, which makes the sender learn it again.
+ * Until the LEARN frame arrives, the request is repeated at most every
+ * FEEDBACK_INTERVAL ms.
+ */
+class Bridge
+{
+    public:
+        static const uint32_t HEADER_SIZE = 14;
+        static const uint32_t MAX_OVERHEAD = 2;
+        static const uint32_t MAX_CONTEXTS = 64;
+        static const uint32_t REFRESH_INTERVAL = 128;
+        static const uint32_t MAX_NEIGHBOURS = 64;
+        static const uint32_t NEIGHBOUR_TIMEOUT = 300;
+        static const uint32_t MAX_REQUESTS = 16;
+        static const uint32_t REQUEST_INTERVAL = 1000;
+        static const uint32_t FEEDBACK_INTERVAL = 1000;
+
+        enum PacketType
+        {
+            TYPE_FULL     = 0xB0,
+            TYPE_LEARN    = 0xB1,
+            TYPE_ELIDED   = 0xB2,
+            TYPE_FEEDBACK = 0xB8
+        };
+
+    protected:
+        struct Context
+        {
+            bool valid;
+            uint8_t header[HEADER_SIZE];
+            uint32_t packets;
+            uint32_t last_used;
+            bool requested;
+            Poco::Timestamp requested_at;
+        };
+
+        // Addresses are IPv4 or IPv6, ip_len tells them apart
+        struct Neighbour
+        {
+            bool valid;
+            uint8_t ip[16];
+            uint32_t ip_len;
+            uint8_t mac[6];
+            Poco::Timestamp seen;
+        };
+
+        struct Request
+        {
+            bool valid;
+            uint8_t ip[16];
+            uint32_t ip_len;
+            Poco::Timestamp sent;
+        };
+
+        Poco::Logger &logger_;
+
+        Context tx_[MAX_CONTEXTS];
+        Context rx_[MAX_CONTEXTS];
+        uint32_t clock_;
+
+        Neighbour neighbours_[MAX_NEIGHBOURS];
+        Request requests_[MAX_REQUESTS];
+        uint32_t answered_;
+        uint32_t suppressed_;
+
+    public:
+        Bridge();
+        virtual ~Bridge();
+
+        void reset();
+
+        /**
+         * Checks a frame from the tap device. Returns false if it is not to
+         * be sent, the answer for the tap device is then stored in reply (or
+         * reply is empty, if a repeated request was dropped).
+         */
+        bool filter(const uint8_t *frame, uint32_t size, std::vector<uint8_t> &reply);
+
+        /**
+         * Elides the Ethernet header into out, which must hold size +
+         * MAX_OVERHEAD bytes. Returns the size of the packet to send.
+         */
+        uint32_t compress(const uint8_t *frame, uint32_t size, uint8_t *out);
+
+        /**
+         * Restores the frame into out and learns the neighbours in it.
+         * Returns the size of the frame or 0 if nothing has to be written to
+         * the tap device. If the peer has to be notified, the feedback packet
+         * is stored in feedback.
+         */
+        uint32_t decompress(const uint8_t *data, uint32_t size, uint8_t *out, uint32_t max_len,
+                            std::vector<uint8_t> &feedback);
+
+        /**
+         * The feedback packet could not be sent, the next frame for the
+         * context asks again.
+         */
+        void feedbackDropped(const std::vector<uint8_t> &feedback);
+
+        /**
+         * Offset of the IP header in the frame, 0 if it carries none.
+         */
+        static uint32_t ipOffset(const uint8_t *frame, uint32_t size);
+
+    protected:
+        static uint8_t check(const uint8_t *header);
+
+        Context *lookup(const uint8_t *header, uint8_t &cid);
+        void learn(const uint8_t *frame, uint32_t size);
+        void addNeighbour(const uint8_t *ip, uint32_t ip_len, const uint8_t *mac);
+        const Neighbour *findNeighbour(const uint8_t *ip, uint32_t ip_len) const;
+        bool repeated(const uint8_t *ip, uint32_t ip_len);
+
+        void answerArp(const uint8_t *frame, const Neighbour &neighbour, std::vector<uint8_t> &reply) const;
+        void answerNs(const uint8_t *frame, const Neighbour &neighbour, std::vector<uint8_t> &reply) const;
+};
@@ -0,0 +1,69 @@
+/*
+ * classifier.h
+ *
+ *  Created on: 15.05.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Sorts IP packets into the priority classes of the TX scheduler.
+ *
+ * Rules given with addRule() are checked first, in the order they were
+ * added, then the DSCP of the packet and at last the built-in port rules.
+ * A rule has the form <match>=<class>, match is one of dscp:<value>,
+ * tcp:<port>, udp:<port> (source or destination port), icmp or proto:<number>.
+ * The DSCP alone never selects the control class, only a rule can.
+ */
+class Classifier
+{
+    public:
+        enum Class
+        {
+            CLASS_CONTROL = 0,  // Always sent first
+            CLASS_INTERACTIVE,
+            CLASS_DEFAULT,
+            CLASS_BULK,
+            CLASS_COUNT
+        };
+
+    protected:
+        enum Match
+        {
+            MATCH_DSCP,
+            MATCH_PROTOCOL,
+            MATCH_PORT
+        };
+
+        struct Rule
+        {
+            Match match;
+            uint8_t protocol;
+            uint16_t value;
+            Class cls;
+        };
+
+        std::vector<Rule> rules_;
+
+    public:
+        Classifier();
+        virtual ~Classifier();
+
+        /**
+         * Throws Poco::InvalidArgumentException if the rule cannot be parsed.
+         */
+        void addRule(const std::string &rule);
+
+        Class classify(const uint8_t *packet, uint32_t size) const;
+
+        static Class parseClass(const std::string &name);
+        static std::string className(Class cls);
+
+    protected:
+        static Class classifyDscp(uint8_t dscp);
+};
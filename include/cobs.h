@@ -0,0 +1,42 @@
+/*
+ * cobs.h
+ *
+ *  Created on: 05.06.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Consistent Overhead Byte Stuffing. An encoded frame contains no zero byte,
+ * so a zero byte after every frame delimits it and the receiver resynchronizes
+ * at the next delimiter after any error. The overhead is one byte per 254
+ * bytes plus the delimiter.
+ *
+ * Runs are found with memchr and copied with memcpy, both vectorized by the C
+ * library, so the cost per byte stays close to a plain copy.
+ */
+class Cobs
+{
+    public:
+        static const uint8_t DELIMITER = 0;
+
+        /**
+         * Largest encoded size of size bytes, without the delimiter.
+         */
+        static uint32_t maxEncodedSize(uint32_t size);
+
+        /**
+         * Encodes size bytes to dst, which must hold maxEncodedSize(size)
+         * bytes. Returns the encoded size, the delimiter is not appended.
+         */
+        static uint32_t encode(const uint8_t *src, uint32_t size, uint8_t *dst);
+
+        /**
+         * Decodes a frame without its delimiter to dst, which must hold size
+         * bytes. dst may be src, the frame is then decoded in place. Returns
+         * the decoded size or -1, if the frame is invalid.
+         */
+        static int32_t decode(const uint8_t *src, uint32_t size, uint8_t *dst);
+};
@@ -0,0 +1,122 @@
+/*
+ * compression.h
+ *
+ *  Created on: 21.03.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <Poco/Logger.h>
+#include <Poco/Runnable.h>
+#include <Poco/Thread.h>
+
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Payload compression for CMD_SEND frames.
+ *
+ * Compressed payloads start with the codec byte (bit 7 set if the dictionary was
+ * used, followed by the dictionary id), so the receiver only needs the same
+ * dictionary, not the same codec settings.
+ *
+ * With a training file set, the sent payloads are collected until TRAIN_SIZE
+ * bytes are reached. The dictionary is then trained and written in a
+ * background thread, the reactor only copies the payloads.
+ */
+class Compression : public Poco::Runnable
+{
+    public:
+        enum Codec
+        {
+            CODEC_NONE    = 0,
+            CODEC_LZ      = 1,
+            CODEC_DEFLATE = 2
+        };
+
+        static const uint8_t  DICT_FLAG = 0x80;
+        static const uint32_t MAX_DICT_SIZE = 32 * 1024;
+        static const uint32_t TRAIN_SIZE = 512 * 1024;
+
+    protected:
+        struct Stats
+        {
+            uint64_t frames;
+            uint64_t skipped;
+            uint64_t bytes_in;
+            uint64_t bytes_out;
+            uint64_t usecs;
+        };
+
+        Poco::Logger &logger_;
+
+        Codec codec_;
+        int level_;
+
+        std::vector<uint8_t> dict_;
+        uint8_t dict_id_;
+
+        // Samples back to back, sample_ends_ holds the end offset of each one
+        std::string train_file_;
+        std::vector<uint8_t> samples_;
+        std::vector<uint32_t> sample_ends_;
+
+        // Owned by the training thread while it runs
+        Poco::Thread trainer_;
+        std::string train_path_;
+        std::vector<uint8_t> train_data_;
+        std::vector<uint32_t> train_ends_;
+
+        std::vector<uint8_t> window_;
+        std::vector<uint8_t> rx_window_;
+        std::vector<int32_t> head_;
+        std::vector<int32_t> chain_;
+
+        z_stream deflate_;
+        z_stream inflate_;
+        bool deflate_init_;
+
+        Stats stats_[3];
+
+    public:
+        Compression();
+        virtual ~Compression();
+
+        static Codec parseCodec(const std::string &name);
+
+        void setCodec(Codec codec, int level);
+        Codec getCodec() const;
+
+        bool loadDictionary(const std::string &path);
+        void setTrainingFile(const std::string &path);
+
+        /**
+         * Compresses data into out. Returns false, if the payload did not get
+         * smaller and should be sent uncompressed.
+         */
+        bool compress(const uint8_t *data, uint32_t size, std::vector<uint8_t> &out);
+        bool decompress(const uint8_t *data, uint32_t size, std::vector<uint8_t> &out);
+
+        void logStats();
+
+        static std::vector<uint8_t> train(const std::vector<uint8_t> &data, const std::vector<uint32_t> &ends,
+                                          uint32_t dict_size);
+
+        /**
+         * Body of the training thread, trains the dictionary and writes it.
+         */
+        void run();
+
+    protected:
+        void addSample(const uint8_t *data, uint32_t size);
+
+        uint32_t lzCompress(const uint8_t *data, uint32_t size, bool use_dict, uint8_t *out, uint32_t max_len);
+        bool lzDecompress(const uint8_t *data, uint32_t size, bool use_dict, std::vector<uint8_t> &out);
+
+        uint32_t deflateCompress(const uint8_t *data, uint32_t size, bool use_dict, uint8_t *out, uint32_t max_len);
+        bool deflateDecompress(const uint8_t *data, uint32_t size, bool use_dict, std::vector<uint8_t> &out);
+};
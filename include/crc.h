@@ -0,0 +1,46 @@
+/*
+ * crc.h
+ *
+ *  Created on: 16.04.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <string>
+
+#include <stdint.h>
+
+class Crc
+{
+    public:
+        enum Type
+        {
+            CRC_XOR8 = 0,   // legacy one byte checksum in the header
+            CRC_16,         // CRC-16/CCITT-FALSE trailer
+            CRC_32C         // CRC-32C (Castagnoli) trailer
+        };
+
+        static Type parseType(const std::string &name);
+        static std::string typeName(Type type);
+
+        /**
+         * Size of the trailer appended to the frame.
+         */
+        static uint32_t trailerSize(Type type);
+
+        static uint16_t crc16(const uint8_t *data, uint32_t size);
+        static uint32_t crc32c(const uint8_t *data, uint32_t size);
+
+        static uint32_t compute(Type type, const uint8_t *data, uint32_t size);
+
+        /**
+         * Name of the CRC-32C kernel selected for this CPU.
+         */
+        static const char *kernel();
+
+        // Portable kernels, also used as fallback of the hardware ones
+        static uint16_t crc16Bytewise(uint16_t crc, const uint8_t *data, uint32_t size);
+        static uint16_t crc16Slice8(uint16_t crc, const uint8_t *data, uint32_t size);
+        static uint32_t crc32cBytewise(uint32_t crc, const uint8_t *data, uint32_t size);
+        static uint32_t crc32cSlice8(uint32_t crc, const uint8_t *data, uint32_t size);
+};
@@ -0,0 +1,161 @@
+/*
+ * fec.h
+ *
+ *  Created on: 29.05.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include "frame.h"
+#include "frame_pool.h"
+
+#include <Poco/Logger.h>
+#include <Poco/Timestamp.h>
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Forward error correction across groups of frames.
+ *
+ * The sender adds parity frames to every group of up to K data frames, so
+ * the receiver can rebuild as many lost or corrupted data frames of the
+ * group as parity frames arrived, without a round trip. FEC_XOR adds one
+ * XOR parity frame, FEC_RS adds R Reed-Solomon parity frames (Cauchy matrix
+ * over GF(256)).
+ *
+ * Frames of a group carry FLAG_FEC and a 3 byte trailer: group number, index
+ * and for parity frames (index with the PARITY bit) the number of data frames
+ * in the group. The code protects command, flags, sequence number and
+ * payload of the data frames. A group that does not fill up is closed after
+ * FLUSH_DELAY ms.
+ *
+ * The receiver reports the loss rate it saw before correction every
+ * REPORT_INTERVAL data frames. With setAdaptive() the sender sizes the
+ * redundancy to it: more parity frames with FEC_RS, smaller groups with
+ * FEC_XOR, up to the configured values.
+ */
+class Fec
+{
+    public:
+        enum Type
+        {
+            FEC_NONE = 0,
+            FEC_XOR,
+            FEC_RS
+        };
+
+        static const uint32_t TRAILER_SIZE = 3;
+        static const uint32_t MAX_GROUP = 32;
+        static const uint32_t MAX_PARITY = 8;
+        static const uint32_t FLUSH_DELAY = 50;
+        static const uint32_t REPORT_INTERVAL = 64;
+        static const uint8_t PARITY = 0x80;
+
+    protected:
+        // Length, command, flags and sequence number in front of the payload
+        static const uint32_t UNIT_HEADER = 5;
+        static const uint32_t RX_GROUPS = 4;
+
+        struct Group
+        {
+            bool used;
+            uint8_t id;
+            uint32_t count;
+            uint32_t present;
+            uint32_t parity;
+            bool counted;
+            std::vector<uint8_t> units[MAX_GROUP];
+            std::vector<uint8_t> parities[MAX_PARITY];
+        };
+
+        Poco::Logger &logger_;
+        Type type_;
+        uint32_t max_group_;
+        uint32_t max_parity_;
+        uint32_t group_size_;
+        uint32_t parity_count_;
+        bool adaptive_;
+
+        // Sender: the group being filled
+        uint8_t tx_group_;
+        uint32_t tx_count_;
+        std::vector<uint8_t> tx_units_[MAX_GROUP];
+        Poco::Timestamp tx_started_;
+        double tx_loss_;
+
+        // Receiver
+        Group rx_groups_[RX_GROUPS];
+        std::vector<uint32_t> rebuilt_;
+        uint32_t rx_frames_;
+        uint32_t rx_lost_;
+        uint32_t rx_lost_total_;
+        uint32_t rx_rebuilt_total_;
+
+    public:
+        Fec();
+        virtual ~Fec();
+
+        /**
+         * group_size data frames get parity parity frames, FEC_XOR always
+         * uses one.
+         */
+        void setType(Type type, uint32_t group_size, uint32_t parity);
+        void setAdaptive(bool adaptive);
+        bool isEnabled() const;
+
+        /**
+         * Payload bytes a data frame has to leave free, so its parity
+         * frames are no larger than the frame limit.
+         */
+        uint32_t getOverhead() const;
+
+        static Type parseType(const std::string &name);
+        static std::string typeName(Type type);
+
+        /**
+         * Sender: adds the data frame to the open group and appends the
+         * trailer, call before it is sent the first time.
+         */
+        void protect(Frame *f);
+        bool groupFull() const;
+
+        /**
+         * ms until the open group has to be closed, -1 if there is none.
+         */
+        long flushDelay() const;
+
+        /**
+         * Closes the open group and appends its parity frames.
+         */
+        void finishGroup(FramePool &pool, std::vector<Frame *> &parity);
+        void handleReport(const Frame::View &view);
+
+        /**
+         * Receiver: strips the trailer off a FLAG_FEC frame. Returns true for
+         * a data frame, which is then processed like any other frame.
+         */
+        bool receive(Frame::View &view);
+
+        /**
+         * Data frames rebuilt by the last receive(), valid until the next.
+         */
+        bool getRebuilt(Frame::View &view);
+
+        /**
+         * Loss report for the sender, when one is due.
+         */
+        bool getReport(std::vector<uint8_t> &report);
+
+        uint32_t getLost() const;
+        uint32_t getRebuiltCount() const;
+
+    protected:
+        uint8_t coefficient(uint32_t row, uint32_t index) const;
+        Group *findGroup(uint8_t id);
+        void countLoss(Group &group);
+        void decode(Group &group);
+        void adapt();
+};
@@ -6,13 +6,20 @@
  */
 #pragma once
 
+#include "crc.h"
+
 #include <vector>
 #include <sstream>
+#include <cstring>
 
 #include <stdint.h>
 
+class FramePool;
+
 class Frame
 {
+    friend class FramePool;
+
     public:
         enum Command
         {
@@ -30,7 +37,36 @@ class Frame
         {
             FLAG_NONE = 0x0,
             FLAG_ACK  = 0x1,
-            FLAG_NAK  = 0x2
+            FLAG_NAK  = 0x2,
+            FLAG_SEQ  = 0x4,    // header carries a sequence number byte
+            FLAG_AGGREGATE = 0x8, // payload holds several length-prefixed packets
+            FLAG_COMPRESSED = 0x10, // payload is compressed, see Compression
+            FLAG_FEC = 0x20,    // frame of an FEC group, carries a trailer, see Fec
+            FLAG_FRAGMENT = 0x40 // part of a frame above the RF MTU, see Protocol::setMtu()
+        };
+
+        static const uint32_t HEADER_SIZE = 5;
+        static const uint32_t HEADROOM = 8;
+
+        // Compact header: first byte has COMPACT set, command in the low
+        // bits (COMPACT_ESCAPE: command and high flags in the next byte)
+        // and the low flags above, then a varint length, crc and sequence
+        static const uint8_t COMPACT = 0x80;
+        static const uint8_t COMPACT_ESCAPE = 0x07;
+        static const uint32_t MAX_COMPACT_HEADER = 7;
+
+        // parse() result for bytes that cannot start a frame
+        static const uint32_t INVALID = 0xFFFFFFFF;
+
+        // Decoded frame pointing into a receive buffer
+        struct View
+        {
+            Command  command;
+            Flags    flags;
+            uint16_t length;
+            uint8_t  crc;
+            uint8_t  sequence;
+            const uint8_t *payload;
         };
 
     protected:
@@ -38,6 +74,10 @@ class Frame
         Flags    flags;
         uint16_t length;
         uint8_t  crc;
+        uint8_t  sequence;
+        bool     pooled;
+
+        // Payload behind HEADROOM bytes, so the header can be serialized in place
         std::vector<uint8_t> data;
 
     public:
@@ -45,7 +85,10 @@ class Frame
             command(cmd),
             flags(FLAG_NONE),
             length(0),
-            crc(0)
+            crc(0),
+            sequence(0),
+            pooled(false),
+            data(HEADROOM)
         {
         }
 
@@ -73,11 +116,36 @@ class Frame
             return flags;
         }
 
+        void setSequence(uint8_t seq)
+        {
+            sequence = seq;
+        }
+
+        uint8_t getSequence() const
+        {
+            return sequence;
+        }
+
         uint32_t getLength() const
         {
             return length;
         }
 
+        uint32_t getHeaderSize(bool compact = false) const
+        {
+            uint32_t size = HEADER_SIZE;
+            if(compact)
+            {
+                size = 3 + ((flags & 0xF0) ? 1 : 0) + ((length >= 0x80) ? 1 : 0) + ((length >= 0x4000) ? 1 : 0);
+            }
+            return (flags & FLAG_SEQ) ? size + 1 : size;
+        }
+
+        uint32_t getSize() const
+        {
+            return getHeaderSize() + length;
+        }
+
         uint8_t getChecksum() const
         {
             return crc;
@@ -85,58 +153,279 @@ class Frame
 
         void setData(const uint8_t *buffer, uint32_t len)
         {
-            data.assign(buffer, buffer + len);
-            length = data.size();
+            data.resize(HEADROOM + len);
+            memcpy(data.data() + HEADROOM, buffer, len);
+            length = len;
+        }
+
+        void reserve(uint32_t len)
+        {
+            data.reserve(HEADROOM + len);
+        }
+
+        void appendData(const uint8_t *buffer, uint32_t len)
+        {
+            data.resize(HEADROOM + length);
+            data.insert(data.end(), buffer, buffer + len);
+            length = data.size() - HEADROOM;
         }
 
         std::vector<uint8_t> getData() const
         {
-            return data;
+            return std::vector<uint8_t>(data.begin() + HEADROOM, data.begin() + HEADROOM + length);
+        }
+
+        const uint8_t *getPayload() const
+        {
+            return data.data() + HEADROOM;
         }
 
-        void serialize(std::vector<uint8_t> &buffer)
+        void serialize(std::vector<uint8_t> &buffer, Crc::Type type = Crc::CRC_XOR8, bool compact = false)
         {
-            buffer.push_back(uint8_t(command));
-            buffer.push_back(uint8_t(flags));
-            buffer.push_back(length & 0xFF);
-            buffer.push_back((length >> 8) & 0xFF);
-            buffer.push_back(0);
-            buffer.insert(buffer.end(), data.begin(), data.end());
+            uint32_t size;
+            const uint8_t *frame = serialize(size, type, compact);
+            buffer.insert(buffer.end(), frame, frame + size);
+        }
+
+        /**
+         * Writes the header in front of the payload (and the CRC behind it)
+         * and returns the start of the serialized frame.
+         *
+         * With CRC_XOR8 the checksum byte covers the whole frame. Otherwise it
+         * only covers the header, so a broken length is detected before the
+         * payload arrives, and the CRC trailer covers header and payload.
+         *
+         * The compact header (only if the peer supports it) takes 3 instead
+         * of 5 bytes for frames below 128 bytes.
+         */
+        const uint8_t *serialize(uint32_t &size, Crc::Type type = Crc::CRC_XOR8, bool compact = false)
+        {
+            uint32_t header = getHeaderSize(compact);
+            uint32_t trailer = Crc::trailerSize(type);
+
+            data.resize(HEADROOM + length + trailer);
+            uint8_t *buffer = data.data() + HEADROOM - header;
+            uint32_t pos;
+
+            if(compact)
+            {
+                pos = 0;
+                if(flags & 0xF0)
+                {
+                    buffer[pos++] = COMPACT | ((flags & 0x0F) << 3) | COMPACT_ESCAPE;
+                    buffer[pos++] = (flags & 0xF0) | uint8_t(command);
+                }
+                else
+                {
+                    buffer[pos++] = COMPACT | ((flags & 0x0F) << 3) | uint8_t(command);
+                }
+                for(uint32_t value = length; ; value >>= 7)
+                {
+                    buffer[pos++] = (value & 0x7F) | ((value >= 0x80) ? 0x80 : 0);
+                    if(value < 0x80)
+                    {
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                buffer[0] = uint8_t(command);
+                buffer[1] = uint8_t(flags);
+                buffer[2] = length & 0xFF;
+                buffer[3] = (length >> 8) & 0xFF;
+                pos = 4;
+            }
+
+            uint32_t crc_pos = pos;
+            buffer[pos++] = 0;
+            if(flags & FLAG_SEQ)
+            {
+                buffer[pos++] = sequence;
+            }
+
+            size = header + length;
 
             uint8_t crc = 0;
-            for(std::vector<uint8_t>::const_iterator it = buffer.begin(); it != buffer.end(); it++)
+            for(uint32_t i = 0; i < ((type == Crc::CRC_XOR8) ? size : header); i++)
+            {
+                crc ^= buffer[i];
+            }
+            buffer[crc_pos] = crc;
+
+            if(trailer > 0)
             {
-                crc ^= *it;
+                uint32_t value = Crc::compute(type, buffer, size);
+                for(uint32_t i = 0; i < trailer; i++)
+                {
+                    buffer[size++] = (value >> (8 * i)) & 0xFF;
+                }
             }
 
-            buffer[4] = crc;
+            return buffer;
         }
 
         std::string toString() const
         {
             std::stringstream ss;
             ss << "Command: " << command << ", Flags: " << flags << ", Length: " << length;
+            if(flags & FLAG_SEQ)
+            {
+                ss << ", Seq: " << uint32_t(sequence);
+            }
             return ss.str();
         }
 
-        static Frame *deserialize(const uint8_t *data, uint32_t size)
+        /**
+         * Decodes the header at data in either layout, they are told apart
+         * by the COMPACT bit. Returns the header size, 0 if it is not
+         * complete or INVALID for a varint longer than 16 bit.
+         */
+        static uint32_t parseHeader(const uint8_t *data, uint32_t size, View &view)
         {
-            if(size < 4)
+            if(size == 0)
             {
-                return nullptr;
+                return 0;
+            }
+
+            uint32_t pos;
+            if(data[0] & COMPACT)
+            {
+                uint32_t flag = (data[0] >> 3) & 0x0F;
+                uint32_t cmd = data[0] & COMPACT_ESCAPE;
+                pos = 1;
+                if(cmd == COMPACT_ESCAPE)
+                {
+                    if(size < 2)
+                    {
+                        return 0;
+                    }
+                    flag |= data[1] & 0xF0;
+                    cmd = data[1] & 0x0F;
+                    pos = 2;
+                }
+
+                uint32_t len = 0;
+                for(uint32_t shift = 0; ; shift += 7)
+                {
+                    if(shift > 14)
+                    {
+                        return INVALID;
+                    }
+                    if(pos >= size)
+                    {
+                        return 0;
+                    }
+                    len |= uint32_t(data[pos] & 0x7F) << shift;
+                    if((data[pos++] & 0x80) == 0)
+                    {
+                        break;
+                    }
+                }
+                if(len > 0xFFFF)
+                {
+                    return INVALID;
+                }
+
+                view.command = Command(cmd);
+                view.flags = Flags(flag);
+                view.length = len;
+            }
+            else
+            {
+                if(size < HEADER_SIZE - 1)
+                {
+                    return 0;
+                }
+                view.command = Command(data[0]);
+                view.flags = Flags(data[1]);
+                view.length = data[2] | (data[3] << 8);
+                pos = HEADER_SIZE - 1;
             }
 
-            uint32_t len = data[2] | (data[3] << 8);
-            if(size < (len + 5))
+            uint32_t header = pos + ((view.flags & FLAG_SEQ) ? 2 : 1);
+            if(size < header)
+            {
+                return 0;
+            }
+            view.crc = data[pos];
+            view.sequence = (view.flags & FLAG_SEQ) ? data[pos + 1] : 0;
+            view.payload = data + header;
+            return header;
+        }
+
+        /**
+         * Decodes the frame at data without copying. Returns the size of the
+         * serialized frame, which is larger than size while the frame is not
+         * complete yet, 0 if even the header is missing or INVALID if the
+         * header cannot be decoded.
+         */
+        static uint32_t parse(const uint8_t *data, uint32_t size, View &view, Crc::Type type = Crc::CRC_XOR8)
+        {
+            uint32_t header = parseHeader(data, size, view);
+            if(header == 0 || header == INVALID)
+            {
+                return header;
+            }
+
+            return header + view.length + Crc::trailerSize(type);
+        }
+
+        /**
+         * Checks the header checksum of a CRC protected frame. The legacy
+         * checksum covers the whole frame and is not checked.
+         */
+        static bool checkHeader(const uint8_t *data, Crc::Type type)
+        {
+            if(type == Crc::CRC_XOR8)
+            {
+                return true;
+            }
+
+            // Only called after parse() found a complete header
+            View view;
+            uint32_t header = parseHeader(data, MAX_COMPACT_HEADER, view);
+            uint8_t crc = 0;
+            for(uint32_t i = 0; i < header; i++)
+            {
+                crc ^= data[i];
+            }
+            return crc == 0;
+        }
+
+        /**
+         * Checks the CRC trailer of a complete serialized frame.
+         */
+        static bool checkCrc(const uint8_t *data, uint32_t size, Crc::Type type)
+        {
+            uint32_t trailer = Crc::trailerSize(type);
+            if(trailer == 0)
+            {
+                return true;
+            }
+
+            uint32_t value = 0;
+            for(uint32_t i = 0; i < trailer; i++)
+            {
+                value |= uint32_t(data[size - trailer + i]) << (8 * i);
+            }
+            return Crc::compute(type, data, size - trailer) == value;
+        }
+
+        static Frame *deserialize(const uint8_t *data, uint32_t size, Crc::Type type = Crc::CRC_XOR8)
+        {
+            View view;
+            uint32_t len = parse(data, size, view, type);
+            if(len == 0 || size < len)
             {
                 return nullptr;
             }
 
-            Frame *frame = new Frame(Command(data[0]));
-            frame->flags = Flags(data[1]);
-            frame->length = len;
-            frame->crc = data[4];
-            frame->data.assign(data + 5, data + len + 5);
+            Frame *frame = new Frame(view.command);
+            frame->flags = view.flags;
+            frame->crc = view.crc;
+            frame->sequence = view.sequence;
+            frame->setData(view.payload, view.length);
 
             return frame;
         }
@@ -0,0 +1,44 @@
+/*
+ * frame_pool.h
+ *
+ *  Created on: 02.04.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include "frame.h"
+
+#include <vector>
+
+/**
+ * Preallocated frames for the TX path. Frames keep their buffer capacity while
+ * they are in the pool, so taking and returning them does not touch the heap.
+ * If the pool runs dry, a heap frame is handed out and counted as exhaustion.
+ * Only used from the reactor thread.
+ */
+class FramePool
+{
+    protected:
+        std::vector<Frame *> frames_;
+        std::vector<Frame *> free_;
+        uint32_t capacity_;
+
+        uint32_t in_use_;
+        uint32_t high_water_;
+        uint32_t exhausted_;
+
+    public:
+        FramePool(uint32_t count, uint32_t capacity);
+        virtual ~FramePool();
+
+        void resize(uint32_t count, uint32_t capacity);
+
+        Frame *acquire(Frame::Command cmd);
+        void release(Frame *f);
+
+        uint32_t getSize() const;
+        uint32_t getCapacity() const;
+        uint32_t getInUse() const;
+        uint32_t getHighWater() const;
+        uint32_t getExhausted() const;
+};
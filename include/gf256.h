@@ -0,0 +1,34 @@
+/*
+ * gf256.h
+ *
+ *  Created on: 29.05.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Arithmetic in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D)
+ * for the Reed-Solomon erasure code of Fec.
+ */
+class Gf256
+{
+    public:
+        static uint8_t mul(uint8_t a, uint8_t b);
+        static uint8_t div(uint8_t a, uint8_t b);
+        static uint8_t inv(uint8_t a);
+
+        /**
+         * dst[i] ^= c * src[i], the hot loop of encoding and decoding.
+         */
+        static void mulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t size);
+
+        /**
+         * Name of the mulAdd kernel selected for this CPU.
+         */
+        static const char *kernel();
+
+        // Portable kernel, also used for the tail of the vector ones
+        static void mulAddTable(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t size);
+};
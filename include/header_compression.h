@@ -0,0 +1,123 @@
+/*
+ * header_compression.h
+ *
+ *  Created on: 14.03.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <Poco/Logger.h>
+#include <Poco/Timestamp.h>
+
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * ROHC like compression of IPv4/IPv6 + UDP/TCP headers.
+ *
+ * Both ends keep a table of per flow contexts. The first packet of a flow (and
+ * every REFRESH_INTERVAL packets after that) is sent as IR packet carrying the
+ * full header. All other packets only carry the fields that differ from the
+ * header of the last IR packet, sequence numbers as deltas and a CRC over the
+ * original header. The context is only changed by IR packets, so packets lost
+ * or dropped by the queue after compression don't affect the ones after them.
+ *
+ * The low bits of the packet type hold the generation of the context, which is
+ * counted up with every IR packet. A CO packet for another generation than the
+ * one the receiver has (the IR packet got lost) or a CRC mismatch make the
+ * decompressor drop the packet and return a feedback packet, which forces the
+ * compressor on the other side to send an IR packet again. Until the IR packet
+ * arrives, the request is repeated at most every FEEDBACK_INTERVAL ms.
+ *
+ * Packets which can't be compressed are sent as they are. They are detected by
+ * the IP version in the first nibble.
+ */
+class HeaderCompression
+{
+    public:
+        static const uint32_t MAX_CONTEXTS = 64;
+        static const uint32_t MAX_HEADER = 40 + 60;
+        static const uint32_t KEY_SIZE = 40;
+        static const uint32_t REFRESH_INTERVAL = 128;
+        static const uint32_t MAX_OVERHEAD = 2;
+        static const uint8_t  GENERATION_MASK = 0x07;
+        static const uint32_t FEEDBACK_INTERVAL = 1000;
+
+        enum PacketType
+        {
+            TYPE_CO       = 0xE0,
+            TYPE_IR       = 0xF0,
+            TYPE_FEEDBACK = 0xF8
+        };
+
+        enum ChangeMask
+        {
+            MASK_IPID    = 0x01,
+            MASK_TOS_TTL = 0x02,
+            MASK_SEQ     = 0x04,
+            MASK_ACK     = 0x08,
+            MASK_WINDOW  = 0x10,
+            MASK_FLAGS   = 0x20,
+            MASK_OPTIONS = 0x40,
+            MASK_URGENT  = 0x80
+        };
+
+    protected:
+        struct Context
+        {
+            bool valid;
+            uint8_t key[KEY_SIZE];
+            uint32_t key_len;
+            uint8_t header[MAX_HEADER];
+            uint32_t header_len;
+            uint32_t ip_len;
+            uint8_t protocol;
+            uint8_t generation;
+            uint32_t packets;
+            uint32_t last_used;
+            bool requested;
+            Poco::Timestamp requested_at;
+        };
+
+        Poco::Logger &logger_;
+
+        Context tx_[MAX_CONTEXTS];
+        Context rx_[MAX_CONTEXTS];
+        uint32_t clock_;
+
+    public:
+        HeaderCompression();
+        virtual ~HeaderCompression();
+
+        void reset();
+
+        /**
+         * Compresses the packet into out, which must hold size + MAX_OVERHEAD
+         * bytes. Returns the size of the compressed packet.
+         */
+        uint32_t compress(const uint8_t *packet, uint32_t size, uint8_t *out);
+
+        /**
+         * Restores the original packet into out. Returns the size of the
+         * packet or 0 if nothing has to be written to the tun device. If the
+         * peer has to be notified, the feedback packet is stored in feedback.
+         */
+        uint32_t decompress(const uint8_t *data, uint32_t size, uint8_t *out, uint32_t max_len,
+                            std::vector<uint8_t> &feedback);
+
+        /**
+         * The feedback packet could not be sent, the next packet for the
+         * context asks again.
+         */
+        void feedbackDropped(const std::vector<uint8_t> &feedback);
+
+    protected:
+        static uint32_t parse(const uint8_t *packet, uint32_t size, uint32_t &ip_len, uint8_t &protocol);
+        static uint32_t flowKey(const uint8_t *packet, uint32_t ip_len, uint8_t protocol, uint8_t *key);
+        static int32_t rebuild(const Context &ctx, uint8_t mask, const uint8_t *fields, uint32_t size,
+                               uint32_t payload, uint8_t *header, uint32_t &header_len);
+
+        Context *lookup(const uint8_t *key, uint32_t key_len, uint8_t &cid);
+        void update(Context &ctx, const uint8_t *header, uint32_t header_len);
+};
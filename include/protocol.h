@@ -8,50 +8,366 @@
 
 #include "frame.h"
 #include "serial.h"
-#include "blocking_queue.h"
+#include "tx_scheduler.h"
+#include "classifier.h"
+#include "compression.h"
+#include "frame_pool.h"
+#include "ring_buffer.h"
+#include "reactor.h"
+#include "shaper.h"
+#include "fec.h"
+#include "cobs.h"
 
 #include <Poco/Logger.h>
-#include <Poco/Runnable.h>
+#include <Poco/Timestamp.h>
 
+#include <deque>
 #include <vector>
 
-class Protocol : public Poco::Runnable, public Serial::Listener
+class Protocol : public Serial::Listener, public Reactor::Handler
 {
     public:
         class Listener
         {
             public:
-                virtual void onFrameReceived(Frame *f) = 0;
+                /**
+                 * A received packet, data points into the receive buffer
+                 * and is only valid during the call.
+                 */
+                virtual void onPacketReceived(const uint8_t *data, uint32_t size) = 0;
+                virtual void onPortClosed(Protocol *protocol) {}
+
+                /**
+                 * The handshake is done, the link limits are known.
+                 */
+                virtual void onLinkReady(Protocol *protocol) {}
         };
 
+        static const uint32_t MAX_WINDOW = 32;
+        // Retransmission timeout before the first RTT sample and its limits
+        static const uint32_t RETRANSMIT_TIMEOUT = 1000;
+        static const uint32_t MIN_RTO = 50;
+        static const uint32_t MAX_RTO = 10000;
+        static const uint32_t MAX_RETRIES = 3;
+        static const uint32_t MAX_AGGREGATE = 0xFFFF;
+        static const uint32_t MAX_PAYLOAD = 4096;
+        static const uint32_t POOL_SIZE = 128;
+        static const uint32_t TX_QUEUE_SIZE = 64;
+        static const uint32_t RX_BUFFER_SIZE = 128 * 1024;
+
+        // Fragments: frame id, index (LAST_FRAGMENT set on the last one) and
+        // offset (16 bit) in front of the payload
+        static const uint32_t FRAGMENT_HEADER = 4;
+        static const uint32_t MAX_FRAGMENTS = 64;
+        static const uint8_t LAST_FRAGMENT = 0x80;
+        static const uint32_t MIN_MTU = 32;
+        static const uint32_t REASSEMBLY_SLOTS = 4;
+        static const uint32_t REASSEMBLY_TIMEOUT = 2000;
+
+        // CMD_GET_VERSION payload: major, minor, capabilities, max frame
+        // length (16 bit), window size, max baud rate (32 bit, 0 = any)
+        static const uint32_t VERSION_SIZE = 10;
+        static const uint8_t CAP_COMPACT_HEADER = 0x01;
+        static const uint8_t CAP_COBS = 0x02;
+        static const uint8_t CAP_CRC16 = 0x04;
+        static const uint8_t CAP_CRC32C = 0x08;
+
+        static const uint32_t HANDSHAKE_TIMEOUT = 500;
+        static const uint32_t HANDSHAKE_RETRIES = 3;
+
     protected:
+        enum Handshake
+        {
+            HS_RESET,
+            HS_VERSION,
+            HS_ADDRESS,
+            HS_DONE
+        };
+
+        struct TxSlot
+        {
+            Frame *frame;
+            Poco::Timestamp sent;
+            uint32_t retries;
+            bool resent;
+
+            // tx_bytes_ after the frame was written and the bytes not known
+            // to be received by then, the frame included
+            uint64_t bytes;
+            uint32_t inflight;
+        };
+
+        struct Reassembly
+        {
+            bool used;
+            uint8_t id;
+            uint64_t received;
+            uint32_t count;
+            uint32_t size;
+            Poco::Timestamp started;
+            std::vector<uint8_t> data;
+        };
+
         Poco::Logger &logger_;
-        Poco::Thread *thread_;
         Serial *serial_;
+        Reactor *reactor_;
+        Reactor::Timer timer_;
 
-        std::vector<uint8_t> buffer_;
-        BlockingQueue<Frame *> tx_buffer_;
+        // Frames from the tun device, one queue per priority class
+        TxScheduler tx_queue_;
+        uint64_t tx_bytes_;
+        uint64_t tx_acked_bytes_;
+        bool tx_blocked_;
+        Shaper shaper_;
 
         Listener *listener_;
 
-        Poco::Mutex mutex_;
-        Poco::Condition cond_;
+        // Stop-and-wait: the last frame has not been acknowledged yet
+        bool ack_pending_;
+        Frame *ack_frame_;
+        uint32_t ack_retries_;
+        bool ack_resent_;
+        Poco::Timestamp ack_sent_;
+        uint32_t ack_inflight_;
+        uint32_t tx_fast_retransmits_;
+
+        // Round trip estimate (RFC 6298) in us, srtt_ < 0 until the first
+        // sample, and the resulting retransmission timeout in ms
+        Poco::Timestamp::TimeDiff srtt_;
+        Poco::Timestamp::TimeDiff rttvar_;
+        long rto_;
+        uint32_t max_retries_;
+
+        // Sliding window state, window_size_ == 0 selects stop-and-wait
+        uint32_t window_size_;
+        uint8_t tx_base_;
+        uint8_t tx_next_;
+        TxSlot tx_window_[256];
+
+        uint8_t rx_next_;
+        uint32_t rx_mask_;
+
+        // Aggregation of small packets into one CMD_SEND frame
+        uint32_t aggregate_size_;
+        uint32_t aggregate_delay_;
+        Frame *pending_;
+        bool holding_;
+        Poco::Timestamp hold_start_;
+
+        Compression *compression_;
+        std::vector<uint8_t> scratch_;
+
+        // Frames above the RF MTU are sent as fragments, back to back. A
+        // frame the receiver could not complete within REASSEMBLY_TIMEOUT ms
+        // is dropped by the timer, together with its buffer.
+        uint32_t mtu_;
+        uint8_t tx_fragment_id_;
+        std::deque<Frame *> tx_fragments_;
+        Reassembly rx_reassembly_[REASSEMBLY_SLOTS];
+        uint32_t rx_incomplete_;
+
+        Fec fec_;
+        std::vector<Frame *> fec_parity_;
+
+        FramePool pool_;
+
+        // Receive path, the port reads into the ring buffer and frames are
+        // parsed (and COBS decoded) in place, the listener gets the payload
+        // from there
+        RingBuffer rx_buffer_;
+        uint32_t rx_need_;
+        uint32_t rx_crc_errors_;
+        uint32_t rx_naks_;
+        Crc::Type crc_;
+        std::vector<uint8_t> rx_scratch_;
+
+        // Compact headers are used once the peer announced support for them
+        bool compact_;
+        bool tx_compact_;
+
+        // Startup handshake with the dongle, no data is sent before HS_DONE.
+        // It may replace the configured CRC and framing.
+        bool handshake_enabled_;
+        Handshake handshake_;
+        uint32_t handshake_retries_;
+        Poco::Timestamp handshake_sent_;
+        bool address_set_;
+        uint16_t address_;
+        uint32_t peer_max_frame_;
+        uint32_t peer_max_baud_;
+        Crc::Type crc_config_;
+        bool cobs_config_;
+
+        // COBS framing, rx_scanned_ bytes of the buffer hold no delimiter
+        bool cobs_;
+        std::vector<uint8_t> tx_encoded_;
+        uint32_t rx_scanned_;
 
     public:
         Protocol(Serial *serial);
         virtual ~Protocol();
 
         void setListener(Protocol::Listener *listener);
+        void setWindowSize(uint32_t size);
+        void setAggregation(uint32_t size, uint32_t delay);
+        void setCompression(Compression *compression);
+        void setCrc(Crc::Type type);
+
+        /**
+         * Delimits frames with COBS instead of relying on the length field
+         * alone, so the receiver resynchronizes at the next frame after any
+         * error, see Cobs. Has to match the dongle.
+         */
+        void setCobs(bool enable);
+
+        /**
+         * Asks the peer for its version on start and switches to the compact
+         * frame header if it supports it, see Frame::serialize().
+         */
+        void setCompactHeader(bool enable);
+
+        /**
+         * Resets the dongle on start, queries its capabilities and then uses
+         * the best CRC, framing, header and window both sides support. Data
+         * waits until the handshake is done. Steps old firmware does not
+         * answer are skipped after HANDSHAKE_RETRIES.
+         */
+        void setHandshake(bool enable);
+
+        /**
+         * RF address sent with CMD_SET_ADDRESS during the handshake.
+         */
+        void setAddress(uint16_t address);
+        bool isReady() const;
+
+        /**
+         * Largest frame payload the dongle sends over the air, 0 is no limit.
+         * Larger frames are split into fragments, which the receiver puts
+         * back together. Both sides need the same setting.
+         */
+        void setMtu(uint32_t mtu);
+
+        /**
+         * The frame payload limit in effect, the configured one or the one
+         * reported by the dongle, whichever is lower. 0 is no limit.
+         */
+        uint32_t getMtu() const;
+
+        /**
+         * Largest packet sent in one frame without fragmenting, 0 is no
+         * limit.
+         */
+        uint32_t getPayloadLimit() const;
+
+        /**
+         * Limits reported by the dongle, 0 if not known.
+         */
+        uint32_t getPeerMaxFrame() const;
+        uint32_t getPeerMaxBaud() const;
+
+        /**
+         * Sends parity frames with every group of group_size frames, see Fec.
+         * Gaps are then left to FEC and the retransmission timeout instead of
+         * being NAKed. Both sides need the same setting.
+         */
+        void setFec(Fec::Type type, uint32_t group_size, uint32_t parity, bool adaptive);
+
+        /**
+         * Retransmissions of a frame before it is dropped.
+         */
+        void setMaxRetries(uint32_t retries);
+        void setPoolSize(uint32_t count);
         void reset();
+        void start(Reactor *reactor);
         void close();
 
-        void sendData(const uint8_t *data, uint32_t size);
+        void setClassWeight(Classifier::Class cls, uint32_t weight);
+
+        /**
+         * Tunes the queue management to the serial link, see
+         * TxScheduler::setLinkRate().
+         */
+        void setLinkRate(uint32_t bytes_per_second);
+
+        /**
+         * Paces the frames to the RF data rate of the dongle in bytes per
+         * second and adapts to its failure reports, see Shaper. 0 sends as
+         * fast as the serial port allows.
+         */
+        void setRfRate(uint32_t bytes_per_second);
+
+        /**
+         * Queues a packet for sending in the given priority class, flow is a
+         * hash of the packet's flow. Returns false, if the send queue is
+         * full. The caller should wait for getTxSpaceFd() to become readable
+         * when waitTxSpace() returns true before sending more data.
+         */
+        bool sendData(const uint8_t *data, uint32_t size, Classifier::Class cls = Classifier::CLASS_DEFAULT,
+                      uint32_t flow = 0);
+        bool waitTxSpace();
+        int getTxSpaceFd() const;
+
+        /**
+         * Bytes waiting in the send queue and bytes written to the serial
+         * port so far, for scheduling across bonded links.
+         */
+        uint32_t getQueued() const;
+        uint64_t getBytesSent() const;
+
+        /**
+         * Frames queued and dropped (pushed out of the full queue or by
+         * CoDel) per class.
+         */
+        uint32_t getQueueDepth(Classifier::Class cls) const;
+        uint32_t getQueueDrops(Classifier::Class cls) const;
 
         void addData(const uint8_t *data, uint32_t size);
-        Frame *getFrame();
+        bool getFrame(Frame::View &view);
 
+        virtual uint8_t *getReceiveBuffer(uint32_t &size);
         virtual void dataReceived(uint8_t *buffer, uint32_t length);
         virtual void portClosed();
-        void run();
+        virtual void writeReady();
+        virtual void onEvent(int fd, uint32_t events);
+
+    protected:
+        bool getCobsFrame(Frame::View &view);
+        Frame *takeFrame();
+        Frame *aggregate(Frame *f);
+        void compress(Frame *f);
+        void fragment(Frame *f);
+        void reassemble(const Frame::View &view);
+        Reassembly *findReassembly(uint8_t id);
+        long reassemblyExpired();
+        void deliver(const Frame::View &view);
+        void handleFrame(const Frame::View &view);
+        void handleVersion(const Frame::View &view);
+        void handleHandshake(const Frame::View &view);
+        void sendHandshake();
+        long handshakeExpired();
+        void capabilities(uint8_t *version) const;
+        void negotiate(const uint8_t *version, uint32_t size);
+        void linkReady();
+        void receiveFec(Frame::View &view);
+        void sendParity();
+
+        void transmit(Frame *f);
+        void pump();
+
+        uint32_t inFlight() const;
+        void sampleRtt(Poco::Timestamp::TimeDiff rtt, uint32_t inflight);
+        void backoff();
+        long ackExpired();
+        long retransmitExpired();
+        void handleAck(const Frame::View &view);
+        void fastRetransmit(uint8_t seq);
+        bool handleSequenced(const Frame::View &view);
+        void corrupted(const Frame::View &view);
+
+        /**
+         * Acknowledges the received frames, nak asks for frame rx_next_+i
+         * again for every bit i set.
+         */
+        void sendAck(uint32_t nak);
 
 };
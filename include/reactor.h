@@ -0,0 +1,97 @@
+/*
+ * reactor.h
+ *
+ *  Created on: 24.04.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include "uring.h"
+
+#include <Poco/Logger.h>
+
+#include <vector>
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/**
+ * Single threaded epoll event loop. Handlers are called on the thread that
+ * runs the loop, so they can use each other without locking. stop() may be
+ * called from any thread or a signal handler.
+ *
+ * With the io_uring backend the loop waits in io_uring_enter instead. The
+ * epoll set is then watched by a poll operation on the ring, so fd handlers
+ * keep working, while handlers that use getUring() queue their reads and
+ * writes, which are submitted in one batch per loop iteration.
+ */
+class Reactor : public Uring::Completion
+{
+    public:
+        class Handler
+        {
+            public:
+                virtual void onEvent(int fd, uint32_t events) = 0;
+        };
+
+        /**
+         * One-shot timer based on a timerfd.
+         */
+        class Timer
+        {
+            protected:
+                int fd_;
+
+            public:
+                Timer();
+                virtual ~Timer();
+
+                int getFd() const;
+
+                /**
+                 * Fires once after timeout ms, a negative timeout stops the timer.
+                 */
+                void start(long timeout);
+                void stop();
+
+                /**
+                 * Acknowledges the expiry, call when the fd became readable.
+                 */
+                void clear();
+        };
+
+    protected:
+        static const uint32_t MAX_EVENTS = 16;
+
+        Poco::Logger &logger_;
+        int epoll_fd_;
+        int stop_fd_;
+        volatile bool running_;
+
+        std::vector<Handler *> handlers_;
+
+        Uring *uring_;
+
+    public:
+        Reactor();
+        virtual ~Reactor();
+
+        /**
+         * Switches to the io_uring backend, returns false if the kernel does
+         * not support it. Has to be called before anything is attached.
+         */
+        bool enableUring(uint32_t entries);
+        Uring *getUring() const;
+
+        void add(int fd, uint32_t events, Handler *handler);
+        void modify(int fd, uint32_t events);
+        void remove(int fd);
+
+        void run();
+        void stop();
+
+        virtual void onComplete(int32_t result, uint32_t tag);
+
+    protected:
+        bool dispatch(int timeout);
+};
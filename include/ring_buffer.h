@@ -0,0 +1,41 @@
+/*
+ * ring_buffer.h
+ *
+ *  Created on: 09.04.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Circular byte buffer. The memory is mapped twice back to back, so readable
+ * and writable regions are always contiguous, even across the wrap around.
+ * Data is never moved, consuming only advances the read position.
+ */
+class RingBuffer
+{
+    protected:
+        uint8_t *buffer_;
+        uint32_t capacity_;
+        uint64_t head_;
+        uint64_t tail_;
+
+    public:
+        RingBuffer(uint32_t capacity);
+        virtual ~RingBuffer();
+
+        void clear();
+
+        uint32_t capacity() const;
+        uint32_t size() const;
+        uint32_t available() const;
+
+        const uint8_t *readPtr() const;
+        uint8_t *readPtr();
+        void consume(uint32_t size);
+
+        uint8_t *writePtr();
+        void commit(uint32_t size);
+        bool write(const uint8_t *data, uint32_t size);
+};
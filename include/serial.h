@@ -6,14 +6,14 @@
  */
 #pragma once
 
+#include "reactor.h"
+
 #include <Poco/Logger.h>
-#include <Poco/Runnable.h>
-#include <Poco/Thread.h>
 
 #include <string>
 #include <vector>
 
-class Serial : public Poco::Runnable
+class Serial : public Reactor::Handler, public Uring::Completion
 {
     public:
         class Listener
@@ -21,28 +21,110 @@ class Serial : public Poco::Runnable
             public:
                 virtual void dataReceived(uint8_t *buffer, uint32_t length) = 0;
                 virtual void portClosed() = 0;
+
+                /**
+                 * Lets the port read into the listener's buffer directly,
+                 * dataReceived() is then called with it. nullptr uses the
+                 * buffer of the port.
+                 */
+                virtual uint8_t *getReceiveBuffer(uint32_t &size) { return nullptr; }
+
+                /**
+                 * A write that had to wait for the port has finished.
+                 */
+                virtual void writeReady() {}
         };
 
     protected:
+        static const uint32_t BUFFER_SIZE = 2048;
+        // Largest deviation of the applied baud rate, 1/MAX_BAUD_ERROR
+        static const uint32_t MAX_BAUD_ERROR = 33;
+
+        enum Tag
+        {
+            TAG_READ,
+            TAG_WRITE
+        };
+
         Poco::Logger &logger_;
         int fd_;
-        bool running_;
-        Poco::Thread *thread_;
+        Reactor *reactor_;
 
         Listener *listener_;
 
+        // io_uring backend: one read is always posted
+        Uring *uring_;
+        uint8_t rx_[BUFFER_SIZE];
+        uint8_t *rx_target_;
+
+        // Frames are collected in tx_pending_ until flush() or FLUSH_SIZE and
+        // while the previous write is still in flight. With epoll a write
+        // the port cannot take waits for EPOLLOUT.
+        std::vector<uint8_t> tx_pending_;
+        std::vector<uint8_t> tx_inflight_;
+        uint32_t tx_offset_;
+        bool tx_waiting_;
+        uint64_t tx_writes_;
+        uint64_t tx_bytes_;
+
+        uint32_t baudrate_;
+        bool low_latency_;
+        uint8_t vmin_;
+        uint8_t vtime_;
+
     public:
+        static const uint32_t FLUSH_SIZE = 1024;
+        static const uint32_t MAX_QUEUED = 4096;
+
         Serial();
         virtual ~Serial();
         void setListener(Serial::Listener *listener);
 
         int getFd() const;
-        bool open(const std::string &device, int baudrate);
+
+        /**
+         * ASYNC_LOW_LATENCY of the driver, on by default. Applied by open().
+         */
+        void setLowLatency(bool enable);
+
+        /**
+         * VMIN/VTIME of the port, applied by open(). The default 0/0 returns
+         * every read immediately, larger values delay small frames. The
+         * io_uring backend raises VMIN 0 to 1, its reads block.
+         */
+        void setReadTiming(uint8_t vmin, uint8_t vtime);
+
+        /**
+         * Opens the port at any rate the driver supports (termios2/BOTHER).
+         * Fails if the driver applies a rate more than 3% off.
+         */
+        bool open(const std::string &device, uint32_t baudrate);
+
+        /**
+         * Baud rate actually applied by the driver.
+         */
+        uint32_t getBaudrate() const;
         void close();
+        /**
+         * Queues data for writing, it is written by flush() or when
+         * FLUSH_SIZE bytes are queued. Nothing is dropped, callers should
+         * stop sending while getQueued() exceeds MAX_QUEUED and continue on
+         * Listener::writeReady().
+         */
         int32_t send(const std::vector<uint8_t> &data);
         int32_t send(const uint8_t *data, uint32_t size);
+        void flush();
+        uint32_t getQueued() const;
         std::vector<uint8_t> receive();
         uint32_t receive(uint8_t *data, uint32_t max_len);
 
-        void run();
+        void attach(Reactor *reactor);
+        virtual void onEvent(int fd, uint32_t events);
+        virtual void onComplete(int32_t result, uint32_t tag);
+
+    protected:
+        uint8_t *receiveBuffer(uint32_t &size);
+        void received(int32_t len);
+        void writeInflight();
+        void written();
 };
@@ -0,0 +1,97 @@
+/*
+ * shaper.h
+ *
+ *  Created on: 22.05.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <Poco/Logger.h>
+#include <Poco/Timestamp.h>
+
+#include <stdint.h>
+
+/**
+ * Token bucket that paces frames to the rate the radio can carry.
+ *
+ * A frame may be sent as soon as the bucket is not in debt, its size is
+ * taken afterwards, so frames of any size pass without knowing the size in
+ * advance. The rate starts at the configured RF data rate and adapts:
+ * CMD_RF_FAILURE frames and ACK timeouts (counted separately) cut it by
+ * DECREASE, a queueing delay well above the smallest one seen within
+ * MIN_RTT_WINDOW ms (the dongle's buffer is filling) by DELAY_DECREASE, at
+ * most once per HOLDOFF ms. The queueing delay is the round trip minus the
+ * time the RF link needs for the bytes that were in flight when the frame
+ * was sent, so a full window of bulk data does not count as delay. After
+ * PROBE_INTERVAL ms without a cut the rate is raised by 1/PROBE_STEPS of the
+ * configured rate again, up to the configured rate.
+ */
+class Shaper
+{
+    public:
+        static const uint32_t BURST = 50;           // ms of data that may be sent at once after idle
+        static const uint32_t MIN_BURST = 256;      // bytes
+        static const uint32_t HOLDOFF = 500;
+        static const uint32_t PROBE_INTERVAL = 1000;
+        static const uint32_t PROBE_STEPS = 20;
+        static const uint32_t MIN_FRACTION = 16;    // lowest rate is max_rate / MIN_FRACTION
+        static const uint32_t DELAY_SLACK = 50;     // ms above twice the smallest round trip
+        static const uint32_t MIN_RTT_WINDOW = 10000;
+
+        static constexpr double DECREASE = 0.7;
+        static constexpr double DELAY_DECREASE = 0.9;
+
+    protected:
+        Poco::Logger &logger_;
+
+        uint32_t max_rate_;
+        double rate_;
+        double tokens_;
+        Poco::Timestamp updated_;
+
+        Poco::Timestamp last_decrease_;
+        Poco::Timestamp clean_since_;
+        Poco::Timestamp::TimeDiff min_rtt_;
+        Poco::Timestamp min_rtt_since_;
+
+        uint32_t failures_;
+        uint32_t timeouts_;
+
+    public:
+        Shaper();
+        virtual ~Shaper();
+
+        /**
+         * RF data rate in bytes per second, 0 switches shaping off.
+         */
+        void setRate(uint32_t bytes_per_second);
+        bool isEnabled() const;
+        uint32_t getRate() const;
+        uint32_t getFailures() const;
+        uint32_t getTimeouts() const;
+
+        /**
+         * Time in ms until the next frame may be sent, 0 if it may be sent now.
+         */
+        long delay();
+        void consume(uint32_t bytes);
+
+        /**
+         * The dongle reported an RF failure.
+         */
+        void onFailure();
+
+        /**
+         * A frame was not acknowledged in time.
+         */
+        void onTimeout();
+        /**
+         * Round trip of a frame, inflight is the number of bytes sent but
+         * not acknowledged when it was written, the frame included.
+         */
+        void onAck(Poco::Timestamp::TimeDiff rtt, uint32_t inflight);
+
+    protected:
+        void refill();
+        void decrease(double factor, const char *reason);
+};
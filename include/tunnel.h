@@ -8,36 +8,108 @@
 
 #include "serial.h"
 #include "protocol.h"
+#include "bond.h"
+#include "classifier.h"
+#include "header_compression.h"
+#include "bridge.h"
+#include "reactor.h"
 
 #include <Poco/Util/ServerApplication.h>
 #include <Poco/Logger.h>
 
+#include <deque>
 #include <string>
 
-class Tunnel : public Poco::Util::ServerApplication, public Protocol::Listener
+class Tunnel : public Poco::Util::ServerApplication, public Protocol::Listener, public Reactor::Handler,
+               public Uring::Completion
 {
     private:
         static const std::string DEVICE;
+        static const uint32_t BUFFER_SIZE = 2048;
+        static const uint32_t TUN_READS = 8;
+        static const uint32_t TUN_WRITES = 16;
+        static const uint32_t URING_ENTRIES = 64;
+        static const uint32_t TAG_WRITE = 0x100;
+        // The tun MTU is only lowered to the RF limit, down to the IPv6
+        // minimum, smaller packets than that are fragmented by Protocol
+        static const uint32_t MIN_MTU = 1280;
+        static const uint32_t DEFAULT_MTU = 1500;
+
+        struct Packet
+        {
+            uint8_t buffer[BUFFER_SIZE];
+            uint8_t compressed[BUFFER_SIZE + HeaderCompression::MAX_OVERHEAD + Bridge::MAX_OVERHEAD];
+            const uint8_t *data;
+            uint32_t size;
+            uint32_t flow;
+            Classifier::Class cls;
+        };
 
     protected:
         Poco::Logger *logger_;
         bool help_;
 
-        Protocol *protocol_;
-        Serial *serial_;
-        std::string dev_;
+        Bond *bond_;
+        Bond::Schedule schedule_;
+        Classifier classifier_;
+        std::vector<uint32_t> weights_;
+        HeaderCompression *header_compression_;
+
+        // TAP mode: Ethernet frames instead of IP packets
+        Bridge *bridge_;
+        std::vector<uint8_t> tap_reply_;
+        Compression *compression_;
+        std::vector<std::string> devices_;
+        uint32_t baudrate_;
+        bool low_latency_;
+        uint8_t vmin_;
+        uint8_t vtime_;
+        uint32_t window_;
+        uint32_t retries_;
+        uint32_t aggregate_;
+        uint32_t aggregate_delay_;
+        uint32_t pool_size_;
+        uint32_t rf_rate_;
+        uint32_t rf_mtu_;
+        Crc::Type crc_;
+        bool cobs_;
+        bool compact_;
+        bool handshake_;
+        int32_t address_;
+        Fec::Type fec_;
+        uint32_t fec_group_;
+        uint32_t fec_parity_;
+        bool fec_adaptive_;
 
         std::string interface_;
         int tun_fd_;
 
-        bool terminate_;
+        Reactor reactor_;
+        bool uring_;
+        bool fixed_buffers_;
+
+        // Packets read from tun. With io_uring a read is posted for every
+        // packet buffer, which is not held_ waiting for space in the send
+        // queue. With epoll only the first one is used.
+        Packet rx_[TUN_READS];
+        std::deque<uint32_t> held_;
+        bool blocked_;
+
+        // io_uring writes to tun in flight. Received packets are copied (or
+        // header decompressed) straight into the buffer of their write, with
+        // epoll they are written from the receive buffer of the link.
+        std::vector<uint8_t> tx_[TUN_WRITES];
+        std::vector<uint32_t> tx_free_;
 
     public:
         Tunnel();
         virtual ~Tunnel();
 
         void terminate();
-        virtual void onFrameReceived(Frame *f);
+        virtual void onPacketReceived(const uint8_t *data, uint32_t size);
+        virtual void onLinkReady(Protocol *protocol);
+        virtual void onEvent(int fd, uint32_t events);
+        virtual void onComplete(int32_t result, uint32_t tag);
 
     protected:
         virtual void initialize(Poco::Util::Application &app);
@@ -49,6 +121,13 @@ class Tunnel : public Poco::Util::ServerApplication, public Protocol::Listener
 
     private:
         int open(const std::string &name, int flags);
+        void updateMtu();
+        void readTun();
+        void postRead(uint32_t index);
+        void receivePacket(uint32_t index, uint32_t size);
+        void flushPackets();
+        uint8_t *tunBuffer();
+        void writeTun(const uint8_t *data, uint32_t size);
 
         std::string memdump(const uint8_t *data, uint32_t size) const;
 
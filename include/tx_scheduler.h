@@ -0,0 +1,161 @@
+/*
+ * tx_scheduler.h
+ *
+ *  Created on: 15.05.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include "classifier.h"
+#include "frame.h"
+#include "frame_pool.h"
+
+#include <Poco/Timestamp.h>
+
+#include <deque>
+
+#include <stdint.h>
+
+/**
+ * Send queue with priority classes and FQ-CoDel inside every class.
+ *
+ * CLASS_CONTROL is served with strict priority, the other classes share the
+ * link by deficit round robin in proportion to their weight. Within a class
+ * packets are hashed by flow into FLOWS queues, which take turns by deficit
+ * round robin as well; a flow that just became active is served before the
+ * ones with a backlog (RFC 8290). Each flow queue runs CoDel (RFC 8289): once
+ * packets stayed longer than target in the queue for a whole interval, the
+ * queue drops packets at dequeue at an increasing rate until the sojourn
+ * time is below target again. Target and interval follow the link rate, see
+ * setLinkRate(). Control packets are never dropped by CoDel.
+ *
+ * The queue holds at most limit frames. When it is full, a packet pushes out
+ * the oldest frame of the longest flow of the lowest class that has one
+ * queued, if that class is lower than its own or the flow is longer than
+ * its own flow. Otherwise put() refuses the packet and the caller has to
+ * wait for spaceFd() after waitSpace() returned true.
+ */
+class TxScheduler
+{
+    public:
+        // Bytes a class with weight 1 may send per round
+        static const uint32_t QUANTUM = 256;
+        static const uint32_t FLOWS = 32;
+        static const uint32_t FLOW_QUANTUM = 300;
+        static const uint32_t MTU = 1500;
+
+        // CoDel defaults from RFC 8289, raised for slow links
+        static const uint32_t TARGET = 5;
+        static const uint32_t INTERVAL = 100;
+
+    protected:
+        struct Packet
+        {
+            Frame *frame;
+            Poco::Timestamp::TimeVal enqueued;
+        };
+
+        struct Flow
+        {
+            std::deque<Packet> packets;
+            uint32_t bytes;
+            int32_t deficit;
+            bool active;
+
+            // CoDel state
+            bool dropping;
+            uint32_t count;
+            uint32_t last_count;
+            Poco::Timestamp::TimeVal first_above;
+            Poco::Timestamp::TimeVal drop_next;
+        };
+
+        struct Queue
+        {
+            Flow flows[FLOWS];
+            std::deque<uint32_t> new_flows;
+            std::deque<uint32_t> old_flows;
+
+            uint32_t size;
+            uint32_t weight;
+            int32_t deficit;
+            uint32_t high_water;
+            uint32_t drops;
+            uint32_t codel_drops;
+        };
+
+        FramePool &pool_;
+        uint32_t limit_;
+        uint32_t size_;
+        uint32_t bytes_;
+
+        Queue queues_[Classifier::CLASS_COUNT];
+        uint32_t current_;
+
+        // CoDel parameters in us
+        Poco::Timestamp::TimeVal target_;
+        Poco::Timestamp::TimeVal interval_;
+
+        int space_fd_;
+        bool blocked_;
+
+    public:
+        TxScheduler(FramePool &pool, uint32_t limit);
+        virtual ~TxScheduler();
+
+        void setWeight(Classifier::Class cls, uint32_t weight);
+
+        /**
+         * Sets the CoDel target to the time one MTU takes on the link, but
+         * at least TARGET ms, and the interval to ten times that, but at
+         * least INTERVAL ms.
+         */
+        void setLinkRate(uint32_t bytes_per_second);
+        uint32_t getTarget() const;
+        uint32_t getInterval() const;
+
+        /**
+         * Takes ownership of f, returns false if it was refused. flow is a
+         * hash of the packet's flow.
+         */
+        bool put(Frame *f, Classifier::Class cls, uint32_t flow);
+
+        /**
+         * Returns the next frame to send, nullptr if the queue is empty.
+         */
+        Frame *take();
+        void clear();
+
+        bool waitSpace();
+        int spaceFd() const;
+
+        uint32_t size() const;
+        bool full() const;
+
+        /**
+         * Queued payload bytes, including the two byte length of each
+         * packet in an aggregated frame.
+         */
+        uint32_t getBytes() const;
+
+        uint32_t getDepth(Classifier::Class cls) const;
+        uint32_t getHighWater(Classifier::Class cls) const;
+
+        /**
+         * Frames pushed out of a full queue and frames dropped by CoDel.
+         */
+        uint32_t getDrops(Classifier::Class cls) const;
+        uint32_t getCodelDrops(Classifier::Class cls) const;
+
+    protected:
+        Frame *takeClass(Queue &queue, bool codel);
+        Frame *takeFlow(Queue &queue, Flow &flow, bool codel);
+        bool shouldDrop(Flow &flow, const Packet &packet, Poco::Timestamp::TimeVal now);
+        Poco::Timestamp::TimeVal controlLaw(Poco::Timestamp::TimeVal t, uint32_t count) const;
+
+        Packet pop(Queue &queue, Flow &flow);
+        void drop(Queue &queue, const Packet &packet);
+        void resetFlow(Flow &flow);
+        void pushOut(Queue &queue);
+        uint32_t longestFlow(const Queue &queue) const;
+};
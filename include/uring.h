@@ -0,0 +1,96 @@
+/*
+ * uring.h
+ *
+ *  Created on: 02.05.2021
+ *      Author: DI Andreas Auer
+ */
+#pragma once
+
+#include <Poco/Logger.h>
+
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Minimal io_uring wrapper on top of the raw system calls.
+ *
+ * Operations are only queued by read(), write() and poll(); they are handed
+ * to the kernel in one batch by submit(), which also waits for completions.
+ * complete() then calls the Completion of every finished operation with its
+ * result and the tag given when it was queued.
+ */
+class Uring
+{
+    public:
+        class Completion
+        {
+            public:
+                virtual void onComplete(int32_t result, uint32_t tag) = 0;
+        };
+
+    protected:
+        struct Operation
+        {
+            Completion *completion;
+            uint32_t tag;
+            uint32_t next_free;
+        };
+
+        Poco::Logger &logger_;
+        int fd_;
+        uint32_t entries_;
+
+        void *sq_ring_;
+        size_t sq_ring_size_;
+        void *cq_ring_;
+        size_t cq_ring_size_;
+        struct io_uring_sqe *sqes_;
+
+        uint32_t *sq_head_;
+        uint32_t *sq_tail_;
+        uint32_t *sq_mask_;
+        uint32_t *sq_array_;
+        uint32_t *cq_head_;
+        uint32_t *cq_tail_;
+        uint32_t *cq_mask_;
+        struct io_uring_cqe *cqes_;
+
+        // Local tail, published to the kernel by submit()
+        uint32_t sq_pending_;
+
+        std::vector<Operation> ops_;
+        uint32_t free_op_;
+
+    public:
+        /**
+         * Throws Poco::SystemException if io_uring is not available.
+         */
+        Uring(uint32_t entries);
+        virtual ~Uring();
+
+        /**
+         * Registers buffers for read(..., index) with a fixed buffer index.
+         */
+        bool registerBuffers(const struct iovec *buffers, uint32_t count);
+
+        /**
+         * A non-negative index selects a registered buffer.
+         */
+        bool read(int fd, uint8_t *buffer, uint32_t size, int index, Completion *completion, uint32_t tag);
+        bool write(int fd, const uint8_t *buffer, uint32_t size, Completion *completion, uint32_t tag);
+        bool poll(int fd, uint32_t events, Completion *completion, uint32_t tag);
+
+        /**
+         * Submits all queued operations and waits for at least wait
+         * completions. Returns false if the ring failed.
+         */
+        bool submit(uint32_t wait);
+        uint32_t complete();
+
+    protected:
+        struct io_uring_sqe *getSqe(Completion *completion, uint32_t tag);
+        void unmap();
+};
@@ -0,0 +1,632 @@
+/*
+ * bond.cpp
+ *
+ *  Created on: 09.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "bond.h"
+
+#include <Poco/Exception.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace Poco;
+
+//------------------------------------------------------------------------------
+Bond::Bond() :
+    logger_(Logger::get("Bond")),
+    reactor_(nullptr),
+    listener_(nullptr),
+    schedule_(SCHEDULE_FLOW),
+    blocked_link_(-1),
+    watched_fd_(-1),
+    space_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    tx_seq_(0),
+    rx_synced_(false),
+    rx_base_(0),
+    rx_highest_(0),
+    rx_held_(0),
+    rx_stale_(0)
+{
+    if(space_fd_ < 0)
+    {
+        throw SystemException("Cannot create bond eventfd");
+    }
+
+    for(uint32_t i = 0; i < FLOW_BUCKETS; i++)
+    {
+        tx_used_[i] = false;
+        tx_last_[i] = 0;
+    }
+
+    for(uint32_t i = 0; i < REORDER_WINDOW; i++)
+    {
+        reorder_[i].state = SLOT_EMPTY;
+        reorder_[i].seq = 0;
+        reorder_[i].has_successor = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+Bond::~Bond()
+{
+    for(uint32_t i = 0; i < links_.size(); i++)
+    {
+        delete links_[i].protocol;
+        delete links_[i].serial;
+    }
+    ::close(space_fd_);
+}
+
+//------------------------------------------------------------------------------
+void Bond::setListener(Protocol::Listener *listener)
+{
+    listener_ = listener;
+}
+
+//------------------------------------------------------------------------------
+void Bond::setSchedule(Schedule schedule)
+{
+    schedule_ = schedule;
+}
+
+//------------------------------------------------------------------------------
+Bond::Schedule Bond::parseSchedule(const std::string &name)
+{
+    if(name == "flow")
+    {
+        return SCHEDULE_FLOW;
+    }
+    if(name == "capacity")
+    {
+        return SCHEDULE_CAPACITY;
+    }
+    throw InvalidArgumentException("Unknown bond schedule", name);
+}
+
+//------------------------------------------------------------------------------
+bool Bond::addLink(const std::string &device, uint32_t baudrate, bool low_latency, uint8_t vmin, uint8_t vtime)
+{
+    Serial *serial = new Serial;
+    serial->setLowLatency(low_latency);
+    serial->setReadTiming(vmin, vtime);
+    if(!serial->open(device, baudrate))
+    {
+        delete serial;
+        return false;
+    }
+    baudrate = serial->getBaudrate();
+
+    Link link;
+    link.device = device;
+    link.serial = serial;
+    link.protocol = new Protocol(serial);
+    link.protocol->setListener(this);
+    link.protocol->setLinkRate(baudrate / 10);
+    link.up = true;
+    link.bytes_sent = 0;
+    // 8N1, until the first measurement
+    link.rate = baudrate / 10;
+    links_.push_back(link);
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Bond::getLinkCount() const
+{
+    return links_.size();
+}
+
+//------------------------------------------------------------------------------
+Protocol *Bond::getProtocol(uint32_t index)
+{
+    return links_[index].protocol;
+}
+
+//------------------------------------------------------------------------------
+void Bond::start(Reactor *reactor)
+{
+    reactor_ = reactor;
+    for(uint32_t i = 0; i < links_.size(); i++)
+    {
+        links_[i].protocol->start(reactor_);
+    }
+
+    if(links_.size() > 1)
+    {
+        reactor_->add(timer_.getFd(), EPOLLIN, this);
+        logger_.information("Bonding %?u links", links_.size());
+    }
+}
+
+//------------------------------------------------------------------------------
+void Bond::close()
+{
+    if(reactor_ != nullptr)
+    {
+        reactor_->remove(timer_.getFd());
+        reactor_->remove(watched_fd_);
+        watched_fd_ = -1;
+        reactor_ = nullptr;
+    }
+
+    for(uint32_t i = 0; i < links_.size(); i++)
+    {
+        links_[i].protocol->close();
+    }
+}
+
+//------------------------------------------------------------------------------
+bool Bond::sendData(const uint8_t *data, uint32_t size, uint32_t flow, Classifier::Class cls)
+{
+    int index = selectLink(flow, size);
+    if(index < 0)
+    {
+        logger_.warning("No link up, %?u bytes dropped", size);
+        return true;
+    }
+
+    Link &link = links_[index];
+    if(links_.size() == 1)
+    {
+        if(!link.protocol->sendData(data, size, cls, flow))
+        {
+            blocked_link_ = index;
+            return false;
+        }
+        return true;
+    }
+
+    // The receiver only waits for the previous packet of the same bucket
+    uint32_t bucket = flow % FLOW_BUCKETS;
+    uint16_t distance = tx_seq_ - tx_last_[bucket];
+
+    tx_scratch_.resize(HEADER_SIZE + size);
+    tx_scratch_[0] = tx_seq_ & 0xFF;
+    tx_scratch_[1] = (tx_seq_ >> 8) & 0xFF;
+    tx_scratch_[2] = (tx_used_[bucket] && distance <= MAX_DISTANCE) ? distance : 0;
+    std::copy(data, data + size, tx_scratch_.begin() + HEADER_SIZE);
+
+    if(!link.protocol->sendData(tx_scratch_.data(), tx_scratch_.size(), cls, flow))
+    {
+        blocked_link_ = index;
+        return false;
+    }
+
+    tx_used_[bucket] = true;
+    tx_last_[bucket] = tx_seq_;
+    tx_seq_++;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Bond::getMtu() const
+{
+    uint32_t mtu = 0;
+    for(uint32_t i = 0; i < links_.size(); i++)
+    {
+        uint32_t limit = links_[i].protocol->getPayloadLimit();
+        if(limit > 0 && (mtu == 0 || limit < mtu))
+        {
+            mtu = limit;
+        }
+    }
+
+    // The bond sequence number takes part of every frame
+    if(mtu > HEADER_SIZE && links_.size() > 1)
+    {
+        mtu -= HEADER_SIZE;
+    }
+    return mtu;
+}
+
+//------------------------------------------------------------------------------
+bool Bond::waitTxSpace()
+{
+    uint64_t value;
+    if(read(space_fd_, &value, sizeof(value)) < 0)
+    {
+        // Nothing pending
+    }
+
+    // Retry right away, if the link went down in the meantime
+    if(blocked_link_ < 0 || !links_[blocked_link_].up)
+    {
+        return false;
+    }
+
+    Protocol *protocol = links_[blocked_link_].protocol;
+    if(!protocol->waitTxSpace())
+    {
+        return false;
+    }
+
+    if(watched_fd_ < 0)
+    {
+        watched_fd_ = protocol->getTxSpaceFd();
+        reactor_->add(watched_fd_, EPOLLIN, this);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+int Bond::getTxSpaceFd() const
+{
+    return space_fd_;
+}
+
+//------------------------------------------------------------------------------
+int Bond::selectLink(uint32_t flow, uint32_t size)
+{
+    std::vector<int> up;
+    for(uint32_t i = 0; i < links_.size(); i++)
+    {
+        if(links_[i].up)
+        {
+            up.push_back(i);
+        }
+    }
+
+    if(up.empty())
+    {
+        return -1;
+    }
+
+    if(schedule_ == SCHEDULE_FLOW || up.size() == 1)
+    {
+        return up[flow % up.size()];
+    }
+
+    updateRates();
+
+    // Earliest expected completion of this packet
+    int best = up[0];
+    uint64_t best_time = ~0ULL;
+    for(uint32_t i = 0; i < up.size(); i++)
+    {
+        const Link &link = links_[up[i]];
+        uint64_t time = (uint64_t(link.protocol->getQueued()) + size) * 1000000 / link.rate;
+        if(time < best_time)
+        {
+            best = up[i];
+            best_time = time;
+        }
+    }
+    return best;
+}
+
+//------------------------------------------------------------------------------
+void Bond::updateRates()
+{
+    Timestamp::TimeDiff elapsed = rate_sampled_.elapsed();
+    if(elapsed < Timestamp::TimeDiff(RATE_INTERVAL) * 1000)
+    {
+        return;
+    }
+    rate_sampled_.update();
+
+    for(uint32_t i = 0; i < links_.size(); i++)
+    {
+        Link &link = links_[i];
+        uint64_t sent = link.protocol->getBytesSent();
+
+        // Only a link with a backlog shows its capacity
+        if(link.protocol->getQueued() > 0)
+        {
+            uint64_t measured = (sent - link.bytes_sent) * 1000000 / elapsed;
+            link.rate = (3 * uint64_t(link.rate) + measured) / 4;
+            if(link.rate == 0)
+            {
+                link.rate = 1;
+            }
+        }
+        link.bytes_sent = sent;
+    }
+}
+
+//------------------------------------------------------------------------------
+uint32_t Bond::flowHash(const uint8_t *packet, uint32_t size)
+{
+    uint32_t hash = 2166136261u;
+    uint32_t start;
+    uint32_t end;
+    uint32_t ports;
+    uint8_t protocol;
+
+    if(size >= 20 && (packet[0] >> 4) == 4)
+    {
+        protocol = packet[9];
+        start = 12;
+        end = 20;
+        ports = (packet[0] & 0x0F) * 4;
+    }
+    else if(size >= 40 && (packet[0] >> 4) == 6)
+    {
+        protocol = packet[6];
+        start = 8;
+        end = 40;
+        ports = 40;
+    }
+    else
+    {
+        return 0;
+    }
+
+    // Addresses, protocol and for TCP/UDP the ports
+    if((protocol == 6 || protocol == 17) && ports + 4 <= size)
+    {
+        hash = (hash ^ packet[ports]) * 16777619u;
+        hash = (hash ^ packet[ports + 1]) * 16777619u;
+        hash = (hash ^ packet[ports + 2]) * 16777619u;
+        hash = (hash ^ packet[ports + 3]) * 16777619u;
+    }
+    hash = (hash ^ protocol) * 16777619u;
+    for(uint32_t i = start; i < end; i++)
+    {
+        hash = (hash ^ packet[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+//------------------------------------------------------------------------------
+void Bond::onPacketReceived(const uint8_t *data, uint32_t size)
+{
+    if(links_.size() == 1)
+    {
+        deliver(data, size);
+        return;
+    }
+
+    if(size < HEADER_SIZE)
+    {
+        logger_.warning("Packet without bond header dropped");
+        return;
+    }
+
+    uint16_t seq = data[0] | (data[1] << 8);
+    uint16_t distance = data[2];
+    data += HEADER_SIZE;
+    size -= HEADER_SIZE;
+
+    if(!rx_synced_)
+    {
+        // Nothing sent before the first packet is waited for
+        rx_synced_ = true;
+        rx_base_ = seq;
+        rx_highest_ = seq;
+    }
+
+    int16_t ahead = int16_t(seq - rx_highest_);
+    if(ahead > int16_t(REORDER_WINDOW) || int16_t(seq - rx_base_) < -int16_t(REORDER_WINDOW) ||
+       rx_stale_ >= STALE_LIMIT)
+    {
+        // Far off the window or only duplicates, the peer has been restarted
+        logger_.information("Bond sequence reset from %?u to %?u", rx_highest_, seq);
+        resync(seq);
+    }
+    else if(ahead > 0)
+    {
+        rx_highest_ = seq;
+        advance(seq - (REORDER_WINDOW - 1));
+    }
+
+    if(int16_t(seq - rx_base_) < 0)
+    {
+        // Its successors have been passed on already, late is better than lost
+        logger_.debug("Late packet %?u", seq);
+        deliver(data, size);
+        return;
+    }
+
+    Slot &slot = reorder_[seq % REORDER_WINDOW];
+    if(slot.seq == seq && (slot.state == SLOT_HELD || slot.state == SLOT_DELIVERED))
+    {
+        logger_.debug("Duplicate packet %?u dropped", seq);
+        rx_stale_++;
+        return;
+    }
+    rx_stale_ = 0;
+
+    // A successor may already wait for this packet
+    if(slot.seq != seq || slot.state != SLOT_MISSING)
+    {
+        slot.seq = seq;
+        slot.has_successor = false;
+    }
+
+    uint16_t prev = seq - distance;
+    if(distance > 0 && int16_t(prev - rx_base_) >= 0)
+    {
+        Slot &pred = reorder_[prev % REORDER_WINDOW];
+        if(pred.seq != prev || pred.state == SLOT_EMPTY)
+        {
+            pred.state = SLOT_MISSING;
+            pred.seq = prev;
+        }
+
+        if(pred.state != SLOT_DELIVERED)
+        {
+            pred.has_successor = true;
+            pred.successor = seq;
+
+            slot.state = SLOT_HELD;
+            slot.data.assign(data, data + size);
+            slot.received.update();
+            if(rx_held_++ == 0)
+            {
+                timer_.start(REORDER_TIMEOUT);
+            }
+            return;
+        }
+    }
+
+    slot.state = SLOT_DELIVERED;
+    deliver(data, size);
+    release(seq);
+}
+
+//------------------------------------------------------------------------------
+void Bond::onPortClosed(Protocol *protocol)
+{
+    uint32_t up = 0;
+    for(uint32_t i = 0; i < links_.size(); i++)
+    {
+        if(links_[i].protocol == protocol)
+        {
+            links_[i].up = false;
+            logger_.warning("Link %s is down", links_[i].device);
+
+            // Don't let the tunnel wait for a dead link
+            if(int(i) == blocked_link_)
+            {
+                reactor_->remove(watched_fd_);
+                watched_fd_ = -1;
+                signalSpace();
+            }
+        }
+        up += links_[i].up ? 1 : 0;
+    }
+    logger_.warning("%?u of %?u links up", up, links_.size());
+}
+
+//------------------------------------------------------------------------------
+void Bond::onLinkReady(Protocol *protocol)
+{
+    if(listener_ != nullptr)
+    {
+        listener_->onLinkReady(protocol);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Bond::onEvent(int fd, uint32_t events)
+{
+    if(fd == timer_.getFd())
+    {
+        timer_.clear();
+        skipGap();
+        return;
+    }
+
+    // The blocked link has space again
+    reactor_->remove(watched_fd_);
+    watched_fd_ = -1;
+    signalSpace();
+}
+
+//------------------------------------------------------------------------------
+void Bond::deliver(const uint8_t *data, uint32_t size)
+{
+    if(listener_ != nullptr)
+    {
+        listener_->onPacketReceived(data, size);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Bond::release(uint16_t seq)
+{
+    // Passes on the chain of held packets waiting for seq
+    Slot *slot = &reorder_[seq % REORDER_WINDOW];
+    while(slot->has_successor)
+    {
+        uint16_t next = slot->successor;
+        slot->has_successor = false;
+
+        slot = &reorder_[next % REORDER_WINDOW];
+        if(slot->seq != next || slot->state != SLOT_HELD)
+        {
+            break;
+        }
+
+        deliver(slot->data.data(), slot->data.size());
+        slot->state = SLOT_DELIVERED;
+        rx_held_--;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Bond::advance(uint16_t base)
+{
+    // Packets falling out of the window are passed on, just like the ones
+    // waiting for a predecessor that falls out of it
+    while(int16_t(base - rx_base_) > 0)
+    {
+        Slot &slot = reorder_[rx_base_ % REORDER_WINDOW];
+        if(slot.seq == rx_base_)
+        {
+            if(slot.state == SLOT_HELD)
+            {
+                deliver(slot.data.data(), slot.data.size());
+                rx_held_--;
+            }
+            slot.state = SLOT_DELIVERED;
+            release(rx_base_);
+        }
+        slot.state = SLOT_EMPTY;
+        rx_base_++;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Bond::resync(uint16_t seq)
+{
+    advance(rx_highest_ + 1);
+    rx_base_ = seq;
+    rx_highest_ = seq;
+    rx_stale_ = 0;
+}
+
+//------------------------------------------------------------------------------
+void Bond::skipGap()
+{
+    long next = -1;
+    for(uint16_t seq = rx_base_; rx_held_ > 0 && int16_t(seq - rx_highest_) <= 0; seq++)
+    {
+        Slot &slot = reorder_[seq % REORDER_WINDOW];
+        if(slot.seq != seq || slot.state != SLOT_HELD)
+        {
+            continue;
+        }
+
+        // Give up on the predecessor once the packet waited long enough
+        long remaining = REORDER_TIMEOUT - long(slot.received.elapsed() / 1000);
+        if(remaining > 0)
+        {
+            if(next < 0 || remaining < next)
+            {
+                next = remaining;
+            }
+            continue;
+        }
+
+        logger_.debug("Predecessor of bond packet %?u lost", seq);
+        deliver(slot.data.data(), slot.data.size());
+        slot.state = SLOT_DELIVERED;
+        rx_held_--;
+        release(seq);
+    }
+
+    if(rx_held_ > 0 && next > 0)
+    {
+        timer_.start(next);
+    }
+    else
+    {
+        timer_.stop();
+    }
+}
+
+//------------------------------------------------------------------------------
+void Bond::signalSpace()
+{
+    uint64_t value = 1;
+    if(write(space_fd_, &value, sizeof(value)) < 0)
+    {
+        // Already signalled
+    }
+}
@@ -0,0 +1,522 @@
+/*
+ * bridge.cpp
+ *
+ *  Created on: 12.06.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "bridge.h"
+#include "crc.h"
+
+#include <cstring>
+
+using namespace Poco;
+
+static const uint16_t ETH_IPV4 = 0x0800;
+static const uint16_t ETH_ARP = 0x0806;
+static const uint16_t ETH_IPV6 = 0x86DD;
+
+// Frame offsets of the ARP packet, the IPv6 header and ICMPv6 behind it
+static const uint32_t ARP = 14;
+static const uint32_t ARP_SIZE = 28;
+static const uint32_t IPV6 = 14;
+static const uint32_t ICMPV6 = IPV6 + 40;
+static const uint32_t ND_SIZE = 24;
+
+static const uint8_t NEXT_ICMPV6 = 58;
+static const uint8_t ND_SOLICITATION = 135;
+static const uint8_t ND_ADVERTISEMENT = 136;
+
+//------------------------------------------------------------------------------
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+//------------------------------------------------------------------------------
+static inline void put16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+//------------------------------------------------------------------------------
+static bool isArp(const uint8_t *frame, uint32_t size)
+{
+    // Only Ethernet/IPv4 ARP is proxied
+    const uint8_t *arp = frame + ARP;
+    return size >= ARP + ARP_SIZE && get16(frame + 12) == ETH_ARP && get16(arp) == 1 && get16(arp + 2) == ETH_IPV4 &&
+           arp[4] == 6 && arp[5] == 4;
+}
+
+//------------------------------------------------------------------------------
+static uint8_t ndType(const uint8_t *frame, uint32_t size)
+{
+    // Neighbor discovery is always sent with a hop limit of 255
+    if(size < ICMPV6 + ND_SIZE || get16(frame + 12) != ETH_IPV6 || frame[IPV6 + 6] != NEXT_ICMPV6 ||
+       frame[IPV6 + 7] != 255)
+    {
+        return 0;
+    }
+    return frame[ICMPV6];
+}
+
+//------------------------------------------------------------------------------
+static bool isUnspecified(const uint8_t *ip, uint32_t ip_len)
+{
+    for(uint32_t i = 0; i < ip_len; i++)
+    {
+        if(ip[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static uint16_t icmpv6Checksum(const uint8_t *ip, const uint8_t *icmp, uint32_t size)
+{
+    // Pseudo header: source, destination, length and next header
+    uint32_t sum = size + NEXT_ICMPV6;
+    for(uint32_t i = 8; i < 40; i += 2)
+    {
+        sum += get16(ip + i);
+    }
+    for(uint32_t i = 0; i + 1 < size; i += 2)
+    {
+        sum += get16(icmp + i);
+    }
+    if(size & 1)
+    {
+        sum += icmp[size - 1] << 8;
+    }
+    while(sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum & 0xFFFF;
+}
+
+//------------------------------------------------------------------------------
+Bridge::Bridge() :
+    logger_(Logger::get("Bridge")),
+    clock_(0),
+    answered_(0),
+    suppressed_(0)
+{
+    reset();
+}
+
+//------------------------------------------------------------------------------
+Bridge::~Bridge()
+{
+}
+
+//------------------------------------------------------------------------------
+void Bridge::reset()
+{
+    for(uint32_t i = 0; i < MAX_CONTEXTS; i++)
+    {
+        tx_[i].valid = false;
+        tx_[i].last_used = 0;
+        rx_[i].valid = false;
+        rx_[i].requested = false;
+    }
+    for(uint32_t i = 0; i < MAX_NEIGHBOURS; i++)
+    {
+        neighbours_[i].valid = false;
+    }
+    for(uint32_t i = 0; i < MAX_REQUESTS; i++)
+    {
+        requests_[i].valid = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+uint32_t Bridge::ipOffset(const uint8_t *frame, uint32_t size)
+{
+    if(size <= HEADER_SIZE)
+    {
+        return 0;
+    }
+    uint16_t type = get16(frame + 12);
+    return (type == ETH_IPV4 || type == ETH_IPV6) ? HEADER_SIZE : 0;
+}
+
+//------------------------------------------------------------------------------
+bool Bridge::filter(const uint8_t *frame, uint32_t size, std::vector<uint8_t> &reply)
+{
+    reply.clear();
+
+    const uint8_t *target;
+    uint32_t ip_len;
+    if(isArp(frame, size) && get16(frame + ARP + 6) == 1)
+    {
+        // Gratuitous ARP announces the sender, the far side has to see it
+        target = frame + ARP + 24;
+        ip_len = 4;
+        if(memcmp(frame + ARP + 14, target, ip_len) == 0)
+        {
+            return true;
+        }
+    }
+    else if(ndType(frame, size) == ND_SOLICITATION)
+    {
+        // Duplicate address detection has to reach the far side
+        target = frame + ICMPV6 + 8;
+        ip_len = 16;
+        if(isUnspecified(frame + IPV6 + 8, ip_len))
+        {
+            return true;
+        }
+    }
+    else
+    {
+        return true;
+    }
+
+    const Neighbour *neighbour = findNeighbour(target, ip_len);
+    if(neighbour != nullptr)
+    {
+        if(ip_len == 4)
+        {
+            answerArp(frame, *neighbour, reply);
+        }
+        else
+        {
+            answerNs(frame, *neighbour, reply);
+        }
+        answered_++;
+        logger_.debug("Neighbour request answered locally (%?u answered)", answered_);
+        return false;
+    }
+
+    if(repeated(target, ip_len))
+    {
+        suppressed_++;
+        logger_.debug("Repeated neighbour request dropped (%?u dropped)", suppressed_);
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Bridge::compress(const uint8_t *frame, uint32_t size, uint8_t *out)
+{
+    // Broadcasts and multicasts are rare enough to go out as they are
+    if(size < HEADER_SIZE || (frame[0] & 0x01))
+    {
+        out[0] = TYPE_FULL;
+        memcpy(out + 1, frame, size);
+        return size + 1;
+    }
+
+    uint8_t cid;
+    Context *ctx = lookup(frame, cid);
+    ctx->last_used = ++clock_;
+
+    if(!ctx->valid || ++ctx->packets >= REFRESH_INTERVAL)
+    {
+        ctx->valid = true;
+        ctx->packets = 0;
+        memcpy(ctx->header, frame, HEADER_SIZE);
+
+        out[0] = TYPE_LEARN;
+        out[1] = cid;
+        memcpy(out + 2, frame, size);
+        return size + 2;
+    }
+
+    out[0] = TYPE_ELIDED;
+    out[1] = cid;
+    out[2] = check(frame);
+    memcpy(out + 3, frame + HEADER_SIZE, size - HEADER_SIZE);
+    return size - HEADER_SIZE + 3;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Bridge::decompress(const uint8_t *data, uint32_t size, uint8_t *out, uint32_t max_len,
+                            std::vector<uint8_t> &feedback)
+{
+    feedback.clear();
+
+    if(size < 2)
+    {
+        return 0;
+    }
+
+    uint8_t type = data[0];
+    if(type == TYPE_FULL)
+    {
+        if(size - 1 > max_len)
+        {
+            return 0;
+        }
+        memcpy(out, data + 1, size - 1);
+        learn(out, size - 1);
+        return size - 1;
+    }
+
+    if(data[1] >= MAX_CONTEXTS)
+    {
+        logger_.warning("Invalid bridged frame");
+        return 0;
+    }
+
+    uint8_t cid = data[1];
+
+    if(type == TYPE_FEEDBACK)
+    {
+        logger_.debug("Context %?u refresh requested", cid);
+        tx_[cid].valid = false;
+        return 0;
+    }
+
+    if(type == TYPE_LEARN)
+    {
+        if(size - 2 < HEADER_SIZE || size - 2 > max_len)
+        {
+            logger_.warning("Invalid learn frame for context %?u", cid);
+            return 0;
+        }
+
+        Context &ctx = rx_[cid];
+        ctx.valid = true;
+        ctx.requested = false;
+        memcpy(ctx.header, data + 2, HEADER_SIZE);
+
+        memcpy(out, data + 2, size - 2);
+        learn(out, size - 2);
+        return size - 2;
+    }
+
+    if(type == TYPE_ELIDED && size >= 3)
+    {
+        Context &ctx = rx_[cid];
+        uint32_t length = HEADER_SIZE + size - 3;
+        if(ctx.valid && check(ctx.header) == data[2] && length <= max_len)
+        {
+            memcpy(out, ctx.header, HEADER_SIZE);
+            memcpy(out + HEADER_SIZE, data + 3, size - 3);
+            learn(out, length);
+            return length;
+        }
+        ctx.valid = false;
+
+        // One request until the LEARN frame had time to arrive
+        if(ctx.requested && ctx.requested_at.elapsed() < Timestamp::TimeDiff(FEEDBACK_INTERVAL) * 1000)
+        {
+            logger_.debug("Context %?u unknown, refresh already requested", cid);
+            return 0;
+        }
+
+        logger_.warning("Context %?u unknown, requesting refresh", cid);
+        ctx.requested = true;
+        ctx.requested_at.update();
+        feedback.push_back(TYPE_FEEDBACK);
+        feedback.push_back(cid);
+        return 0;
+    }
+
+    logger_.warning("Unknown packet type %?u", type);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+void Bridge::feedbackDropped(const std::vector<uint8_t> &feedback)
+{
+    if(feedback.size() >= 2 && feedback[0] == TYPE_FEEDBACK && feedback[1] < MAX_CONTEXTS)
+    {
+        rx_[feedback[1]].requested = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+uint8_t Bridge::check(const uint8_t *header)
+{
+    return Crc::crc16(header, HEADER_SIZE) & 0xFF;
+}
+
+//------------------------------------------------------------------------------
+Bridge::Context *Bridge::lookup(const uint8_t *header, uint8_t &cid)
+{
+    uint32_t oldest = 0;
+    for(uint32_t i = 0; i < MAX_CONTEXTS; i++)
+    {
+        Context &ctx = tx_[i];
+        if(ctx.valid && memcmp(ctx.header, header, HEADER_SIZE) == 0)
+        {
+            cid = i;
+            return &ctx;
+        }
+
+        if(!ctx.valid || (tx_[oldest].valid && ctx.last_used < tx_[oldest].last_used))
+        {
+            oldest = i;
+        }
+    }
+
+    // Least recently used context is taken over by the new pair
+    cid = oldest;
+    Context &ctx = tx_[oldest];
+    ctx.valid = false;
+
+    return &ctx;
+}
+
+//------------------------------------------------------------------------------
+void Bridge::learn(const uint8_t *frame, uint32_t size)
+{
+    // Only ARP and ND tell reliably which MAC an address belongs to, the
+    // source of other packets may be a router
+    if(isArp(frame, size))
+    {
+        if(!isUnspecified(frame + ARP + 14, 4))
+        {
+            addNeighbour(frame + ARP + 14, 4, frame + ARP + 8);
+        }
+        return;
+    }
+
+    uint8_t nd = ndType(frame, size);
+    if(nd == ND_SOLICITATION && !isUnspecified(frame + IPV6 + 8, 16))
+    {
+        addNeighbour(frame + IPV6 + 8, 16, frame + 6);
+    }
+    else if(nd == ND_ADVERTISEMENT)
+    {
+        addNeighbour(frame + ICMPV6 + 8, 16, frame + 6);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Bridge::addNeighbour(const uint8_t *ip, uint32_t ip_len, const uint8_t *mac)
+{
+    Neighbour *slot = nullptr;
+    for(uint32_t i = 0; i < MAX_NEIGHBOURS; i++)
+    {
+        Neighbour &n = neighbours_[i];
+        if(n.valid && n.ip_len == ip_len && memcmp(n.ip, ip, ip_len) == 0)
+        {
+            slot = &n;
+            break;
+        }
+
+        // A free entry, otherwise the one not seen for the longest time
+        if(slot == nullptr || (slot->valid && (!n.valid || n.seen < slot->seen)))
+        {
+            slot = &n;
+        }
+    }
+
+    slot->valid = true;
+    memcpy(slot->ip, ip, ip_len);
+    slot->ip_len = ip_len;
+    memcpy(slot->mac, mac, sizeof(slot->mac));
+    slot->seen.update();
+}
+
+//------------------------------------------------------------------------------
+const Bridge::Neighbour *Bridge::findNeighbour(const uint8_t *ip, uint32_t ip_len) const
+{
+    for(uint32_t i = 0; i < MAX_NEIGHBOURS; i++)
+    {
+        const Neighbour &n = neighbours_[i];
+        if(n.valid && n.ip_len == ip_len && memcmp(n.ip, ip, ip_len) == 0)
+        {
+            // Not heard of for a while, the far side has to confirm it again
+            if(n.seen.elapsed() >= Timestamp::TimeDiff(NEIGHBOUR_TIMEOUT) * 1000000)
+            {
+                return nullptr;
+            }
+            return &n;
+        }
+    }
+    return nullptr;
+}
+
+//------------------------------------------------------------------------------
+bool Bridge::repeated(const uint8_t *ip, uint32_t ip_len)
+{
+    Request *slot = nullptr;
+    for(uint32_t i = 0; i < MAX_REQUESTS; i++)
+    {
+        Request &r = requests_[i];
+        if(r.valid && r.ip_len == ip_len && memcmp(r.ip, ip, ip_len) == 0)
+        {
+            if(r.sent.elapsed() < Timestamp::TimeDiff(REQUEST_INTERVAL) * 1000)
+            {
+                return true;
+            }
+            slot = &r;
+            break;
+        }
+
+        if(slot == nullptr || (slot->valid && (!r.valid || r.sent < slot->sent)))
+        {
+            slot = &r;
+        }
+    }
+
+    slot->valid = true;
+    memcpy(slot->ip, ip, ip_len);
+    slot->ip_len = ip_len;
+    slot->sent.update();
+    return false;
+}
+
+//------------------------------------------------------------------------------
+void Bridge::answerArp(const uint8_t *frame, const Neighbour &neighbour, std::vector<uint8_t> &reply) const
+{
+    const uint8_t *request = frame + ARP;
+    reply.resize(ARP + ARP_SIZE);
+    uint8_t *p = reply.data();
+
+    memcpy(p, frame + 6, 6);
+    memcpy(p + 6, neighbour.mac, 6);
+    put16(p + 12, ETH_ARP);
+
+    uint8_t *arp = p + ARP;
+    put16(arp, 1);
+    put16(arp + 2, ETH_IPV4);
+    arp[4] = 6;
+    arp[5] = 4;
+    put16(arp + 6, 2);
+    memcpy(arp + 8, neighbour.mac, 6);
+    memcpy(arp + 14, neighbour.ip, 4);
+    memcpy(arp + 18, request + 8, 6);
+    memcpy(arp + 24, request + 14, 4);
+}
+
+//------------------------------------------------------------------------------
+void Bridge::answerNs(const uint8_t *frame, const Neighbour &neighbour, std::vector<uint8_t> &reply) const
+{
+    // Solicited advertisement with the target link-layer address option
+    const uint32_t icmp_size = ND_SIZE + 8;
+    reply.resize(ICMPV6 + icmp_size);
+    uint8_t *p = reply.data();
+
+    memcpy(p, frame + 6, 6);
+    memcpy(p + 6, neighbour.mac, 6);
+    put16(p + 12, ETH_IPV6);
+
+    uint8_t *ip = p + IPV6;
+    memset(ip, 0, 40);
+    ip[0] = 0x60;
+    put16(ip + 4, icmp_size);
+    ip[6] = NEXT_ICMPV6;
+    ip[7] = 255;
+    memcpy(ip + 8, neighbour.ip, 16);
+    memcpy(ip + 24, frame + IPV6 + 8, 16);
+
+    uint8_t *icmp = p + ICMPV6;
+    memset(icmp, 0, icmp_size);
+    icmp[0] = ND_ADVERTISEMENT;
+    icmp[4] = 0x60;
+    memcpy(icmp + 8, neighbour.ip, 16);
+    icmp[24] = 2;
+    icmp[25] = 1;
+    memcpy(icmp + 26, neighbour.mac, 6);
+    put16(icmp + 2, icmpv6Checksum(ip, icmp, icmp_size));
+}
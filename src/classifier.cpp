@@ -0,0 +1,208 @@
+/*
+ * classifier.cpp
+ *
+ *  Created on: 15.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "classifier.h"
+
+#include <Poco/Exception.h>
+#include <Poco/NumberParser.h>
+
+using namespace Poco;
+
+static const uint8_t PROTO_ICMP = 1;
+static const uint8_t PROTO_TCP = 6;
+static const uint8_t PROTO_UDP = 17;
+static const uint8_t PROTO_ICMPV6 = 58;
+
+//------------------------------------------------------------------------------
+Classifier::Classifier()
+{
+}
+
+//------------------------------------------------------------------------------
+Classifier::~Classifier()
+{
+}
+
+//------------------------------------------------------------------------------
+void Classifier::addRule(const std::string &rule)
+{
+    std::string::size_type eq = rule.find('=');
+    if(eq == std::string::npos)
+    {
+        throw InvalidArgumentException("Priority rule without class", rule);
+    }
+
+    std::string match = rule.substr(0, eq);
+    std::string::size_type colon = match.find(':');
+    std::string key = match.substr(0, colon);
+    unsigned value = (colon != std::string::npos) ? NumberParser::parseUnsigned(match.substr(colon + 1)) : 0;
+
+    Rule r;
+    r.protocol = 0;
+    r.value = value;
+    r.cls = parseClass(rule.substr(eq + 1));
+
+    if(key == "dscp" && colon != std::string::npos && value < 64)
+    {
+        r.match = MATCH_DSCP;
+    }
+    else if((key == "tcp" || key == "udp") && colon != std::string::npos && value <= 0xFFFF)
+    {
+        r.match = MATCH_PORT;
+        r.protocol = (key == "tcp") ? PROTO_TCP : PROTO_UDP;
+    }
+    else if(key == "icmp" && colon == std::string::npos)
+    {
+        r.match = MATCH_PROTOCOL;
+        r.protocol = PROTO_ICMP;
+    }
+    else if(key == "proto" && colon != std::string::npos && value < 256)
+    {
+        r.match = MATCH_PROTOCOL;
+        r.protocol = value;
+    }
+    else
+    {
+        throw InvalidArgumentException("Invalid priority rule", rule);
+    }
+
+    rules_.push_back(r);
+}
+
+//------------------------------------------------------------------------------
+Classifier::Class Classifier::classify(const uint8_t *packet, uint32_t size) const
+{
+    uint8_t dscp;
+    uint8_t protocol;
+    uint32_t ports;
+    bool first_fragment = true;
+
+    if(size >= 20 && (packet[0] >> 4) == 4)
+    {
+        dscp = packet[1] >> 2;
+        protocol = packet[9];
+        ports = (packet[0] & 0x0F) * 4;
+        first_fragment = ((packet[6] & 0x1F) | packet[7]) == 0;
+    }
+    else if(size >= 40 && (packet[0] >> 4) == 6)
+    {
+        dscp = ((packet[0] & 0x0F) << 2) | (packet[1] >> 6);
+        protocol = packet[6];
+        ports = 40;
+    }
+    else
+    {
+        return CLASS_DEFAULT;
+    }
+
+    bool has_ports = (protocol == PROTO_TCP || protocol == PROTO_UDP) && first_fragment && ports + 4 <= size;
+    uint16_t src = has_ports ? (packet[ports] << 8) | packet[ports + 1] : 0;
+    uint16_t dst = has_ports ? (packet[ports + 2] << 8) | packet[ports + 3] : 0;
+
+    for(std::vector<Rule>::const_iterator it = rules_.begin(); it != rules_.end(); it++)
+    {
+        switch(it->match)
+        {
+            case MATCH_DSCP:
+                if(dscp == it->value)
+                {
+                    return it->cls;
+                }
+                break;
+            case MATCH_PROTOCOL:
+                if(protocol == it->protocol || (it->protocol == PROTO_ICMP && protocol == PROTO_ICMPV6))
+                {
+                    return it->cls;
+                }
+                break;
+            case MATCH_PORT:
+                if(has_ports && protocol == it->protocol && (src == it->value || dst == it->value))
+                {
+                    return it->cls;
+                }
+                break;
+        }
+    }
+
+    if(dscp != 0)
+    {
+        return classifyDscp(dscp);
+    }
+
+    // Built-in defaults: ping, SSH, DNS and NTP are latency sensitive
+    if(protocol == PROTO_ICMP || protocol == PROTO_ICMPV6)
+    {
+        return CLASS_INTERACTIVE;
+    }
+    if(has_ports && (src == 22 || dst == 22 || src == 53 || dst == 53 || src == 123 || dst == 123))
+    {
+        return CLASS_INTERACTIVE;
+    }
+    return CLASS_DEFAULT;
+}
+
+//------------------------------------------------------------------------------
+Classifier::Class Classifier::classifyDscp(uint8_t dscp)
+{
+    // Any host behind the tunnel can set the DSCP, so network control gets
+    // no more than the interactive class. The control class is only for the
+    // tunnel's own frames and explicit rules.
+    switch(dscp)
+    {
+        case 48:    // CS6, network control
+        case 56:    // CS7
+        case 46:    // EF
+        case 40:    // CS5
+        case 32:    // CS4
+        case 34:    // AF41
+        case 36:    // AF42
+        case 38:    // AF43
+            return CLASS_INTERACTIVE;
+        case 8:     // CS1, lower effort
+        case 1:     // LE
+        case 10:    // AF11
+        case 12:    // AF12
+        case 14:    // AF13
+            return CLASS_BULK;
+        default:
+            return CLASS_DEFAULT;
+    }
+}
+
+//------------------------------------------------------------------------------
+Classifier::Class Classifier::parseClass(const std::string &name)
+{
+    if(name == "control")
+    {
+        return CLASS_CONTROL;
+    }
+    else if(name == "interactive")
+    {
+        return CLASS_INTERACTIVE;
+    }
+    else if(name == "default")
+    {
+        return CLASS_DEFAULT;
+    }
+    else if(name == "bulk")
+    {
+        return CLASS_BULK;
+    }
+    throw InvalidArgumentException("Unknown priority class", name);
+}
+
+//------------------------------------------------------------------------------
+std::string Classifier::className(Class cls)
+{
+    switch(cls)
+    {
+        case CLASS_CONTROL:     return "control";
+        case CLASS_INTERACTIVE: return "interactive";
+        case CLASS_BULK:        return "bulk";
+        default:                return "default";
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * cobs.cpp
+ *
+ *  Created on: 05.06.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "cobs.h"
+
+#include <cstring>
+
+static const uint32_t MAX_RUN = 254;
+
+//------------------------------------------------------------------------------
+uint32_t Cobs::maxEncodedSize(uint32_t size)
+{
+    return size + size / MAX_RUN + 1;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Cobs::encode(const uint8_t *src, uint32_t size, uint8_t *dst)
+{
+    const uint8_t *end = src + size;
+    uint8_t *out = dst;
+
+    while(true)
+    {
+        // Each block is a code byte and up to 254 non-zero bytes, a code
+        // below 0xFF stands for a zero behind the block
+        uint32_t run = (uint32_t(end - src) < MAX_RUN) ? uint32_t(end - src) : MAX_RUN;
+        const uint8_t *zero = static_cast<const uint8_t *>(memchr(src, DELIMITER, run));
+        uint32_t len = (zero != nullptr) ? uint32_t(zero - src) : run;
+
+        *out++ = uint8_t(len + 1);
+        memcpy(out, src, len);
+        out += len;
+        src += len;
+
+        if(zero != nullptr)
+        {
+            src++;
+        }
+        else if(src == end)
+        {
+            break;
+        }
+    }
+
+    return out - dst;
+}
+
+//------------------------------------------------------------------------------
+int32_t Cobs::decode(const uint8_t *src, uint32_t size, uint8_t *dst)
+{
+    const uint8_t *end = src + size;
+    uint8_t *out = dst;
+
+    while(src < end)
+    {
+        uint32_t code = *src++;
+        if(code == DELIMITER || code - 1 > uint32_t(end - src))
+        {
+            return -1;
+        }
+
+        // The output trails the input, so this works in place
+        memmove(out, src, code - 1);
+        out += code - 1;
+        src += code - 1;
+
+        // The zero behind the last block is the delimiter
+        if(code != MAX_RUN + 1 && src < end)
+        {
+            *out++ = 0;
+        }
+    }
+
+    return out - dst;
+}
@@ -0,0 +1,691 @@
+/*
+ * compression.cpp
+ *
+ *  Created on: 21.03.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "compression.h"
+
+#include <Poco/Timestamp.h>
+#include <Poco/Exception.h>
+
+#include <fstream>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+
+using namespace Poco;
+
+static const uint32_t HASH_BITS = 12;
+static const uint32_t MIN_MATCH = 4;
+static const uint32_t MAX_OFFSET = 0xFFFF;
+static const uint32_t MAX_OUTPUT = 0xFFFF;
+
+static const uint32_t DMER_SIZE = 8;
+static const uint32_t SEGMENT_SIZE = 64;
+
+static const char *CODEC_NAMES[] = { "none", "lz", "deflate" };
+
+//------------------------------------------------------------------------------
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+//------------------------------------------------------------------------------
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+//------------------------------------------------------------------------------
+static inline uint32_t hash(const uint8_t *p)
+{
+    return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+//------------------------------------------------------------------------------
+static inline uint8_t *putLength(uint8_t *op, uint32_t value)
+{
+    while(value >= 255)
+    {
+        *op++ = 255;
+        value -= 255;
+    }
+    *op++ = value;
+    return op;
+}
+
+//------------------------------------------------------------------------------
+static inline bool getLength(const uint8_t *data, uint32_t size, uint32_t &ip, uint32_t &value)
+{
+    uint8_t b;
+    do
+    {
+        if(ip >= size)
+        {
+            return false;
+        }
+        b = data[ip++];
+        value += b;
+    }
+    while(b == 255);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Sum of the frequencies of all dmers in the segment, which are not yet covered
+static uint32_t segmentScore(const uint8_t *p, uint32_t size,
+                             std::unordered_map<uint64_t, uint32_t> &frequency,
+                             const std::unordered_set<uint64_t> &covered)
+{
+    std::unordered_set<uint64_t> seen;
+    uint32_t total = 0;
+    for(uint32_t i = 0; i + DMER_SIZE <= size; i++)
+    {
+        uint64_t dmer = read64(p + i);
+        uint32_t freq = frequency[dmer];
+        if(freq > 1 && covered.count(dmer) == 0 && seen.insert(dmer).second)
+        {
+            total += freq;
+        }
+    }
+    return total;
+}
+
+//------------------------------------------------------------------------------
+Compression::Compression() :
+    logger_(Logger::get("Compression")),
+    codec_(CODEC_NONE),
+    level_(1),
+    dict_id_(0),
+    trainer_("Training"),
+    deflate_init_(false)
+{
+    memset(&deflate_, 0, sizeof(deflate_));
+    memset(&inflate_, 0, sizeof(inflate_));
+    inflateInit2(&inflate_, -15);
+    memset(stats_, 0, sizeof(stats_));
+}
+
+//------------------------------------------------------------------------------
+Compression::~Compression()
+{
+    if(trainer_.isRunning())
+    {
+        trainer_.join();
+    }
+
+    if(deflate_init_)
+    {
+        deflateEnd(&deflate_);
+    }
+    inflateEnd(&inflate_);
+}
+
+//------------------------------------------------------------------------------
+Compression::Codec Compression::parseCodec(const std::string &name)
+{
+    for(uint32_t i = 0; i < sizeof(CODEC_NAMES) / sizeof(CODEC_NAMES[0]); i++)
+    {
+        if(name == CODEC_NAMES[i])
+        {
+            return Codec(i);
+        }
+    }
+    throw InvalidArgumentException("Unknown codec", name);
+}
+
+//------------------------------------------------------------------------------
+void Compression::setCodec(Codec codec, int level)
+{
+    codec_ = codec;
+    level_ = level;
+
+    if(deflate_init_)
+    {
+        deflateEnd(&deflate_);
+        deflate_init_ = false;
+    }
+
+    if(codec_ == CODEC_DEFLATE)
+    {
+        if(level_ < 1 || level_ > 9)
+        {
+            level_ = 6;
+        }
+        deflate_init_ = deflateInit2(&deflate_, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    else if(level_ < 1)
+    {
+        level_ = 1;
+    }
+}
+
+//------------------------------------------------------------------------------
+Compression::Codec Compression::getCodec() const
+{
+    return codec_;
+}
+
+//------------------------------------------------------------------------------
+bool Compression::loadDictionary(const std::string &path)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if(!file)
+    {
+        logger_.error("Cannot open dictionary %s", path);
+        return false;
+    }
+
+    dict_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if(dict_.size() > MAX_DICT_SIZE)
+    {
+        dict_.erase(dict_.begin(), dict_.end() - MAX_DICT_SIZE);
+    }
+
+    // FNV-1a folded to one byte, so both sides can tell if they use the same one
+    uint32_t h = 2166136261u;
+    for(std::vector<uint8_t>::const_iterator it = dict_.begin(); it != dict_.end(); it++)
+    {
+        h = (h ^ *it) * 16777619u;
+    }
+    dict_id_ = (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24)) & 0xFF;
+
+    logger_.information("Dictionary %s loaded: %?u bytes, id %?u", path, dict_.size(), dict_id_);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+void Compression::setTrainingFile(const std::string &path)
+{
+    train_file_ = path;
+    samples_.clear();
+    samples_.reserve(TRAIN_SIZE + MAX_OUTPUT);
+    sample_ends_.clear();
+}
+
+//------------------------------------------------------------------------------
+bool Compression::compress(const uint8_t *data, uint32_t size, std::vector<uint8_t> &out)
+{
+    if(!train_file_.empty())
+    {
+        addSample(data, size);
+    }
+
+    if(codec_ == CODEC_NONE)
+    {
+        return false;
+    }
+
+    bool use_dict = !dict_.empty();
+    uint32_t header = use_dict ? 2 : 1;
+    if(size <= header + 1)
+    {
+        return false;
+    }
+
+    Timestamp start;
+
+    out.resize(size);
+    out[0] = codec_ | (use_dict ? DICT_FLAG : 0);
+    out[1] = dict_id_;
+
+    uint32_t len = 0;
+    if(codec_ == CODEC_LZ)
+    {
+        len = lzCompress(data, size, use_dict, out.data() + header, size - header - 1);
+    }
+    else if(codec_ == CODEC_DEFLATE)
+    {
+        len = deflateCompress(data, size, use_dict, out.data() + header, size - header - 1);
+    }
+
+    Stats &stats = stats_[codec_];
+    stats.frames++;
+    stats.bytes_in += size;
+    stats.bytes_out += (len > 0) ? header + len : size;
+    stats.usecs += start.elapsed();
+
+    if(len == 0)
+    {
+        stats.skipped++;
+        return false;
+    }
+
+    out.resize(header + len);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool Compression::decompress(const uint8_t *data, uint32_t size, std::vector<uint8_t> &out)
+{
+    if(size < 1)
+    {
+        return false;
+    }
+
+    Codec codec = Codec(data[0] & ~DICT_FLAG);
+    bool use_dict = (data[0] & DICT_FLAG) != 0;
+    uint32_t header = 1;
+
+    if(use_dict)
+    {
+        if(size < 2 || dict_.empty() || data[1] != dict_id_)
+        {
+            logger_.warning("Frame compressed with unknown dictionary");
+            return false;
+        }
+        header = 2;
+    }
+
+    switch(codec)
+    {
+        case CODEC_LZ:
+            return lzDecompress(data + header, size - header, use_dict, out);
+
+        case CODEC_DEFLATE:
+            return deflateDecompress(data + header, size - header, use_dict, out);
+
+        default:
+            logger_.warning("Unknown codec %?u", uint32_t(codec));
+            return false;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Compression::logStats()
+{
+    for(uint32_t i = CODEC_LZ; i <= CODEC_DEFLATE; i++)
+    {
+        const Stats &stats = stats_[i];
+        if(stats.frames == 0)
+        {
+            continue;
+        }
+
+        logger_.information("%s: %?u frames (%?u sent uncompressed), %?u -> %?u bytes (%?u%%), %?u us/KB",
+                std::string(CODEC_NAMES[i]), stats.frames, stats.skipped, stats.bytes_in, stats.bytes_out,
+                stats.bytes_out * 100 / stats.bytes_in, stats.usecs * 1024 / stats.bytes_in);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Compression::addSample(const uint8_t *data, uint32_t size)
+{
+    samples_.insert(samples_.end(), data, data + size);
+    sample_ends_.push_back(samples_.size());
+    if(samples_.size() < TRAIN_SIZE || trainer_.isRunning())
+    {
+        return;
+    }
+
+    // Training takes about a second, hand the samples over to the thread
+    train_path_.swap(train_file_);
+    train_data_.swap(samples_);
+    train_ends_.swap(sample_ends_);
+    train_file_.clear();
+    samples_.clear();
+    sample_ends_.clear();
+
+    logger_.information("Training dictionary from %?u samples", train_ends_.size());
+    trainer_.start(*this);
+}
+
+//------------------------------------------------------------------------------
+void Compression::run()
+{
+    std::vector<uint8_t> dict = train(train_data_, train_ends_, MAX_DICT_SIZE);
+
+    std::ofstream file(train_path_.c_str(), std::ios::binary);
+    file.write(reinterpret_cast<const char *>(dict.data()), dict.size());
+    if(file)
+    {
+        logger_.information("Dictionary with %?u bytes trained from %?u samples: %s", dict.size(), train_ends_.size(), train_path_);
+    }
+    else
+    {
+        logger_.error("Cannot write dictionary %s", train_path_);
+    }
+
+    std::vector<uint8_t>().swap(train_data_);
+    std::vector<uint32_t>().swap(train_ends_);
+}
+
+//------------------------------------------------------------------------------
+std::vector<uint8_t> Compression::train(const std::vector<uint8_t> &data, const std::vector<uint32_t> &ends,
+                                        uint32_t dict_size)
+{
+    struct Segment
+    {
+        uint32_t score;
+        uint32_t offset;
+        uint32_t size;
+
+        bool operator<(const Segment &other) const
+        {
+            return score < other.score;
+        }
+    };
+
+    // Number of samples each dmer shows up in
+    std::unordered_map<uint64_t, uint32_t> frequency;
+    uint32_t begin = 0;
+    for(uint32_t s = 0; s < ends.size(); s++)
+    {
+        std::unordered_set<uint64_t> seen;
+        for(uint32_t i = begin; i + DMER_SIZE <= ends[s]; i++)
+        {
+            uint64_t dmer = read64(data.data() + i);
+            if(seen.insert(dmer).second)
+            {
+                frequency[dmer]++;
+            }
+        }
+        begin = ends[s];
+    }
+
+    std::unordered_set<uint64_t> covered;
+
+    // Segments never cross the end of their sample
+    std::priority_queue<Segment> candidates;
+    begin = 0;
+    for(uint32_t s = 0; s < ends.size(); s++)
+    {
+        for(uint32_t off = begin; off + DMER_SIZE <= ends[s]; off += SEGMENT_SIZE / 2)
+        {
+            Segment seg = { 0, off, std::min<uint32_t>(SEGMENT_SIZE, ends[s] - off) };
+            seg.score = segmentScore(data.data() + seg.offset, seg.size, frequency, covered);
+            if(seg.score > 0)
+            {
+                candidates.push(seg);
+            }
+        }
+        begin = ends[s];
+    }
+
+    // Lazy greedy selection: a segment is only taken, if it is still the best
+    // one after removing the dmers already in the dictionary
+    std::vector<Segment> selected;
+    uint32_t total = 0;
+    while(!candidates.empty() && total < dict_size)
+    {
+        Segment seg = candidates.top();
+        candidates.pop();
+
+        seg.score = segmentScore(data.data() + seg.offset, seg.size, frequency, covered);
+        if(seg.score == 0)
+        {
+            continue;
+        }
+        if(!candidates.empty() && seg.score < candidates.top().score)
+        {
+            candidates.push(seg);
+            continue;
+        }
+
+        const uint8_t *p = data.data() + seg.offset;
+        for(uint32_t i = 0; i + DMER_SIZE <= seg.size; i++)
+        {
+            covered.insert(read64(p + i));
+        }
+        selected.push_back(seg);
+        total += seg.size;
+    }
+
+    // Most valuable segments go to the end, closest to the compressed data
+    std::vector<uint8_t> dict;
+    for(std::vector<Segment>::reverse_iterator it = selected.rbegin(); it != selected.rend(); it++)
+    {
+        const uint8_t *p = data.data() + it->offset;
+        dict.insert(dict.end(), p, p + it->size);
+    }
+    if(dict.size() > dict_size)
+    {
+        dict.erase(dict.begin(), dict.end() - dict_size);
+    }
+
+    return dict;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Compression::lzCompress(const uint8_t *data, uint32_t size, bool use_dict, uint8_t *out, uint32_t max_len)
+{
+    // The dictionary is used as history in front of the data
+    uint32_t base = use_dict ? dict_.size() : 0;
+    uint32_t end = base + size;
+
+    window_.resize(end);
+    if(use_dict)
+    {
+        memcpy(window_.data(), dict_.data(), base);
+    }
+    memcpy(window_.data() + base, data, size);
+
+    const uint8_t *src = window_.data();
+    head_.assign(1 << HASH_BITS, -1);
+    chain_.resize(end);
+
+    for(uint32_t i = 0; i + MIN_MATCH <= base; i++)
+    {
+        uint32_t h = hash(src + i);
+        chain_[i] = head_[h];
+        head_[h] = i;
+    }
+
+    uint8_t *op = out;
+    uint8_t *op_end = out + max_len;
+    uint32_t anchor = base;
+    uint32_t i = base;
+
+    while(i + MIN_MATCH <= end)
+    {
+        uint32_t h = hash(src + i);
+        uint32_t best_len = 0;
+        uint32_t best_off = 0;
+
+        int32_t cand = head_[h];
+        for(int depth = level_; cand >= 0 && depth > 0 && i - cand <= MAX_OFFSET; depth--)
+        {
+            if(read32(src + cand) == read32(src + i))
+            {
+                uint32_t len = MIN_MATCH;
+                while(i + len < end && src[cand + len] == src[i + len])
+                {
+                    len++;
+                }
+                if(len > best_len)
+                {
+                    best_len = len;
+                    best_off = i - cand;
+                }
+            }
+            cand = chain_[cand];
+        }
+
+        chain_[i] = head_[h];
+        head_[h] = i;
+
+        if(best_len < MIN_MATCH)
+        {
+            i++;
+            continue;
+        }
+
+        uint32_t literals = i - anchor;
+        uint32_t match = best_len - MIN_MATCH;
+        if(op + 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1 > op_end)
+        {
+            return 0;
+        }
+
+        uint8_t *token = op++;
+        *token = ((literals < 15) ? literals : 15) << 4;
+        if(literals >= 15)
+        {
+            op = putLength(op, literals - 15);
+        }
+        memcpy(op, src + anchor, literals);
+        op += literals;
+
+        *op++ = best_off & 0xFF;
+        *op++ = best_off >> 8;
+
+        *token |= (match < 15) ? match : 15;
+        if(match >= 15)
+        {
+            op = putLength(op, match - 15);
+        }
+
+        for(uint32_t j = i + 1; j < i + best_len && j + MIN_MATCH <= end; j++)
+        {
+            uint32_t hj = hash(src + j);
+            chain_[j] = head_[hj];
+            head_[hj] = j;
+        }
+
+        i += best_len;
+        anchor = i;
+    }
+
+    // Last sequence only holds literals
+    uint32_t literals = end - anchor;
+    if(op + 1 + literals / 255 + 1 + literals > op_end)
+    {
+        return 0;
+    }
+
+    *op++ = ((literals < 15) ? literals : 15) << 4;
+    if(literals >= 15)
+    {
+        op = putLength(op, literals - 15);
+    }
+    memcpy(op, src + anchor, literals);
+    op += literals;
+
+    return op - out;
+}
+
+//------------------------------------------------------------------------------
+bool Compression::lzDecompress(const uint8_t *data, uint32_t size, bool use_dict, std::vector<uint8_t> &out)
+{
+    uint32_t base = use_dict ? dict_.size() : 0;
+
+    rx_window_.clear();
+    if(use_dict)
+    {
+        rx_window_.insert(rx_window_.end(), dict_.begin(), dict_.end());
+    }
+
+    uint32_t ip = 0;
+    while(ip < size)
+    {
+        uint8_t token = data[ip++];
+
+        uint32_t literals = token >> 4;
+        if(literals == 15 && !getLength(data, size, ip, literals))
+        {
+            return false;
+        }
+        if(ip + literals > size || rx_window_.size() + literals > base + MAX_OUTPUT)
+        {
+            return false;
+        }
+        rx_window_.insert(rx_window_.end(), data + ip, data + ip + literals);
+        ip += literals;
+
+        if(ip == size)
+        {
+            break;
+        }
+
+        if(ip + 2 > size)
+        {
+            return false;
+        }
+        uint32_t offset = data[ip] | (data[ip + 1] << 8);
+        ip += 2;
+
+        uint32_t match = token & 0x0F;
+        if(match == 15 && !getLength(data, size, ip, match))
+        {
+            return false;
+        }
+        match += MIN_MATCH;
+
+        if(offset == 0 || offset > rx_window_.size() || rx_window_.size() + match > base + MAX_OUTPUT)
+        {
+            return false;
+        }
+
+        // Byte wise copy, the match may overlap with its own output
+        uint32_t from = rx_window_.size() - offset;
+        for(uint32_t j = 0; j < match; j++)
+        {
+            rx_window_.push_back(rx_window_[from + j]);
+        }
+    }
+
+    out.assign(rx_window_.begin() + base, rx_window_.end());
+    return true;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Compression::deflateCompress(const uint8_t *data, uint32_t size, bool use_dict, uint8_t *out, uint32_t max_len)
+{
+    if(!deflate_init_ || deflateReset(&deflate_) != Z_OK)
+    {
+        return 0;
+    }
+
+    if(use_dict && deflateSetDictionary(&deflate_, dict_.data(), dict_.size()) != Z_OK)
+    {
+        return 0;
+    }
+
+    deflate_.next_in = const_cast<uint8_t *>(data);
+    deflate_.avail_in = size;
+    deflate_.next_out = out;
+    deflate_.avail_out = max_len;
+
+    if(deflate(&deflate_, Z_FINISH) != Z_STREAM_END)
+    {
+        return 0;
+    }
+
+    return max_len - deflate_.avail_out;
+}
+
+//------------------------------------------------------------------------------
+bool Compression::deflateDecompress(const uint8_t *data, uint32_t size, bool use_dict, std::vector<uint8_t> &out)
+{
+    if(inflateReset(&inflate_) != Z_OK)
+    {
+        return false;
+    }
+
+    if(use_dict && inflateSetDictionary(&inflate_, dict_.data(), dict_.size()) != Z_OK)
+    {
+        return false;
+    }
+
+    out.resize(MAX_OUTPUT);
+    inflate_.next_in = const_cast<uint8_t *>(data);
+    inflate_.avail_in = size;
+    inflate_.next_out = out.data();
+    inflate_.avail_out = out.size();
+
+    if(inflate(&inflate_, Z_FINISH) != Z_STREAM_END)
+    {
+        return false;
+    }
+
+    out.resize(out.size() - inflate_.avail_out);
+    return true;
+}
@@ -0,0 +1,277 @@
+/*
+ * crc.cpp
+ *
+ *  Created on: 16.04.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "crc.h"
+
+#include <Poco/Exception.h>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+using namespace Poco;
+
+static const uint16_t CRC16_POLY = 0x1021;
+static const uint32_t CRC32C_POLY = 0x82F63B78;
+
+//------------------------------------------------------------------------------
+struct CrcTables
+{
+    uint16_t crc16[8][256];
+    uint32_t crc32c[8][256];
+
+    CrcTables()
+    {
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            uint16_t c16 = i << 8;
+            uint32_t c32 = i;
+            for(int bit = 0; bit < 8; bit++)
+            {
+                c16 = (c16 & 0x8000) ? (c16 << 1) ^ CRC16_POLY : (c16 << 1);
+                c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32C_POLY : (c32 >> 1);
+            }
+            crc16[0][i] = c16;
+            crc32c[0][i] = c32;
+        }
+
+        // Table k holds the contribution of a byte followed by k zero bytes
+        for(uint32_t k = 1; k < 8; k++)
+        {
+            for(uint32_t i = 0; i < 256; i++)
+            {
+                uint16_t c16 = crc16[k - 1][i];
+                crc16[k][i] = (c16 << 8) ^ crc16[0][c16 >> 8];
+
+                uint32_t c32 = crc32c[k - 1][i];
+                crc32c[k][i] = (c32 >> 8) ^ crc32c[0][c32 & 0xFF];
+            }
+        }
+    }
+};
+
+static const CrcTables tables;
+
+//------------------------------------------------------------------------------
+static inline uint32_t load32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//------------------------------------------------------------------------------
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, uint32_t size)
+{
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    for(; size >= 8; size -= 8, data += 8)
+    {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        c = _mm_crc32_u64(c, value);
+    }
+    crc = c;
+#endif
+    for(; size > 0; size--)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+//------------------------------------------------------------------------------
+static bool hasHardwareCrc()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static const char *HARDWARE_KERNEL = "sse4.2";
+
+#elif defined(__aarch64__)
+//------------------------------------------------------------------------------
+__attribute__((target("+crc")))
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, uint32_t size)
+{
+    for(; size >= 8; size -= 8, data += 8)
+    {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        crc = __crc32cd(crc, value);
+    }
+    for(; size > 0; size--)
+    {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+
+//------------------------------------------------------------------------------
+static bool hasHardwareCrc()
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+static const char *HARDWARE_KERNEL = "armv8-crc";
+
+#else
+//------------------------------------------------------------------------------
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, uint32_t size)
+{
+    return Crc::crc32cSlice8(crc, data, size);
+}
+
+//------------------------------------------------------------------------------
+static bool hasHardwareCrc()
+{
+    return false;
+}
+
+static const char *HARDWARE_KERNEL = "";
+#endif
+
+typedef uint32_t (*Crc32Kernel)(uint32_t crc, const uint8_t *data, uint32_t size);
+
+static const bool hardware = hasHardwareCrc();
+static const Crc32Kernel crc32cKernel = hardware ? crc32cHardware : Crc::crc32cSlice8;
+
+//------------------------------------------------------------------------------
+Crc::Type Crc::parseType(const std::string &name)
+{
+    if(name == "xor")
+    {
+        return CRC_XOR8;
+    }
+    else if(name == "crc16")
+    {
+        return CRC_16;
+    }
+    else if(name == "crc32c")
+    {
+        return CRC_32C;
+    }
+    throw InvalidArgumentException("Unknown CRC type", name);
+}
+
+//------------------------------------------------------------------------------
+std::string Crc::typeName(Type type)
+{
+    switch(type)
+    {
+        case CRC_16:  return "crc16";
+        case CRC_32C: return "crc32c";
+        default:      return "xor";
+    }
+}
+
+//------------------------------------------------------------------------------
+uint32_t Crc::trailerSize(Type type)
+{
+    switch(type)
+    {
+        case CRC_16:  return 2;
+        case CRC_32C: return 4;
+        default:      return 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+uint16_t Crc::crc16(const uint8_t *data, uint32_t size)
+{
+    return crc16Slice8(0xFFFF, data, size);
+}
+
+//------------------------------------------------------------------------------
+uint32_t Crc::crc32c(const uint8_t *data, uint32_t size)
+{
+    return ~crc32cKernel(0xFFFFFFFF, data, size);
+}
+
+//------------------------------------------------------------------------------
+uint32_t Crc::compute(Type type, const uint8_t *data, uint32_t size)
+{
+    switch(type)
+    {
+        case CRC_16:
+            return crc16(data, size);
+
+        case CRC_32C:
+            return crc32c(data, size);
+
+        default:
+        {
+            uint8_t crc = 0;
+            for(uint32_t i = 0; i < size; i++)
+            {
+                crc ^= data[i];
+            }
+            return crc;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+const char *Crc::kernel()
+{
+    return hardware ? HARDWARE_KERNEL : "slice-by-8";
+}
+
+//------------------------------------------------------------------------------
+uint16_t Crc::crc16Bytewise(uint16_t crc, const uint8_t *data, uint32_t size)
+{
+    for(uint32_t i = 0; i < size; i++)
+    {
+        crc = (crc << 8) ^ tables.crc16[0][(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+//------------------------------------------------------------------------------
+uint16_t Crc::crc16Slice8(uint16_t crc, const uint8_t *data, uint32_t size)
+{
+    const uint16_t (*t)[256] = tables.crc16;
+
+    // The CRC state folds into the first two bytes of each block
+    for(; size >= 8; size -= 8, data += 8)
+    {
+        crc = t[7][data[0] ^ (crc >> 8)] ^ t[6][data[1] ^ (crc & 0xFF)] ^
+              t[5][data[2]] ^ t[4][data[3]] ^ t[3][data[4]] ^
+              t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    return crc16Bytewise(crc, data, size);
+}
+
+//------------------------------------------------------------------------------
+uint32_t Crc::crc32cBytewise(uint32_t crc, const uint8_t *data, uint32_t size)
+{
+    for(uint32_t i = 0; i < size; i++)
+    {
+        crc = (crc >> 8) ^ tables.crc32c[0][(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Crc::crc32cSlice8(uint32_t crc, const uint8_t *data, uint32_t size)
+{
+    const uint32_t (*t)[256] = tables.crc32c;
+
+    for(; size >= 8; size -= 8, data += 8)
+    {
+        uint32_t lo = crc ^ load32(data);
+        uint32_t hi = load32(data + 4);
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    return crc32cBytewise(crc, data, size);
+}
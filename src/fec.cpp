@@ -0,0 +1,547 @@
+/*
+ * fec.cpp
+ *
+ *  Created on: 29.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "fec.h"
+#include "gf256.h"
+
+#include <Poco/Exception.h>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace Poco;
+
+//------------------------------------------------------------------------------
+Fec::Fec() :
+    logger_(Logger::get("Fec")),
+    type_(FEC_NONE),
+    max_group_(0),
+    max_parity_(0),
+    group_size_(0),
+    parity_count_(0),
+    adaptive_(false),
+    tx_group_(0),
+    tx_count_(0),
+    tx_loss_(-1),
+    rx_frames_(0),
+    rx_lost_(0),
+    rx_lost_total_(0),
+    rx_rebuilt_total_(0)
+{
+    for(uint32_t i = 0; i < RX_GROUPS; i++)
+    {
+        rx_groups_[i].used = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+Fec::~Fec()
+{
+}
+
+//------------------------------------------------------------------------------
+void Fec::setType(Type type, uint32_t group_size, uint32_t parity)
+{
+    if(type != FEC_NONE && (group_size < 2 || group_size > MAX_GROUP))
+    {
+        throw InvalidArgumentException("FEC group size must be between 2 and " + std::to_string(MAX_GROUP));
+    }
+    if(type == FEC_RS && (parity < 1 || parity > MAX_PARITY))
+    {
+        throw InvalidArgumentException("FEC parity frames must be between 1 and " + std::to_string(MAX_PARITY));
+    }
+
+    type_ = type;
+    max_group_ = group_size;
+    max_parity_ = (type == FEC_XOR) ? 1 : parity;
+    group_size_ = max_group_;
+    parity_count_ = max_parity_;
+
+    if(type_ != FEC_NONE)
+    {
+        logger_.information("FEC %s, %?u data + %?u parity frames per group (%s)",
+                typeName(type_), group_size_, parity_count_, std::string(Gf256::kernel()));
+    }
+}
+
+//------------------------------------------------------------------------------
+void Fec::setAdaptive(bool adaptive)
+{
+    adaptive_ = adaptive;
+}
+
+//------------------------------------------------------------------------------
+bool Fec::isEnabled() const
+{
+    return type_ != FEC_NONE;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Fec::getOverhead() const
+{
+    return isEnabled() ? UNIT_HEADER + TRAILER_SIZE : 0;
+}
+
+//------------------------------------------------------------------------------
+Fec::Type Fec::parseType(const std::string &name)
+{
+    if(name == "none")
+    {
+        return FEC_NONE;
+    }
+    if(name == "xor")
+    {
+        return FEC_XOR;
+    }
+    if(name == "rs")
+    {
+        return FEC_RS;
+    }
+    throw InvalidArgumentException("Unknown FEC type " + name);
+}
+
+//------------------------------------------------------------------------------
+std::string Fec::typeName(Type type)
+{
+    switch(type)
+    {
+        case FEC_XOR:
+            return "xor";
+        case FEC_RS:
+            return "rs";
+        default:
+            return "none";
+    }
+}
+
+//------------------------------------------------------------------------------
+void Fec::protect(Frame *f)
+{
+    if(tx_count_ == 0)
+    {
+        tx_started_.update();
+    }
+
+    // The unit carries everything the receiver needs to rebuild the frame
+    std::vector<uint8_t> &unit = tx_units_[tx_count_];
+    uint32_t length = f->getLength();
+    const uint8_t *payload = f->getPayload();
+    unit.resize(UNIT_HEADER + length);
+    unit[0] = length & 0xFF;
+    unit[1] = (length >> 8) & 0xFF;
+    unit[2] = uint8_t(f->getCommand());
+    unit[3] = uint8_t(f->getFlags());
+    unit[4] = f->getSequence();
+    std::copy(payload, payload + length, unit.begin() + UNIT_HEADER);
+
+    uint8_t trailer[TRAILER_SIZE] = { tx_group_, uint8_t(tx_count_), 0 };
+    f->appendData(trailer, TRAILER_SIZE);
+    f->setFlags(Frame::Flags(f->getFlags() | Frame::FLAG_FEC));
+
+    tx_count_++;
+}
+
+//------------------------------------------------------------------------------
+bool Fec::groupFull() const
+{
+    return tx_count_ >= group_size_;
+}
+
+//------------------------------------------------------------------------------
+long Fec::flushDelay() const
+{
+    if(tx_count_ == 0)
+    {
+        return -1;
+    }
+
+    long elapsed = long(tx_started_.elapsed() / 1000);
+    return (elapsed >= long(FLUSH_DELAY)) ? 0 : long(FLUSH_DELAY) - elapsed;
+}
+
+//------------------------------------------------------------------------------
+void Fec::finishGroup(FramePool &pool, std::vector<Frame *> &parity)
+{
+    if(tx_count_ == 0)
+    {
+        return;
+    }
+
+    // Shorter units count as zero padded to the longest one
+    size_t size = 0;
+    for(uint32_t i = 0; i < tx_count_; i++)
+    {
+        size = std::max(size, tx_units_[i].size());
+    }
+
+    std::vector<uint8_t> code(size);
+    for(uint32_t r = 0; r < parity_count_; r++)
+    {
+        std::fill(code.begin(), code.end(), 0);
+        for(uint32_t i = 0; i < tx_count_; i++)
+        {
+            Gf256::mulAdd(code.data(), tx_units_[i].data(), coefficient(r, i), tx_units_[i].size());
+        }
+
+        uint8_t trailer[TRAILER_SIZE] = { tx_group_, uint8_t(PARITY | r), uint8_t(tx_count_) };
+        Frame *f = pool.acquire(Frame::CMD_SEND);
+        f->setFlags(Frame::FLAG_FEC);
+        f->reserve(size + TRAILER_SIZE);
+        f->setData(code.data(), size);
+        f->appendData(trailer, TRAILER_SIZE);
+        parity.push_back(f);
+    }
+
+    tx_group_++;
+    tx_count_ = 0;
+}
+
+//------------------------------------------------------------------------------
+void Fec::handleReport(const Frame::View &view)
+{
+    if(view.length < 4)
+    {
+        return;
+    }
+
+    uint32_t frames = view.payload[0] | (view.payload[1] << 8);
+    uint32_t lost = view.payload[2] | (view.payload[3] << 8);
+    if(frames == 0 || lost > frames)
+    {
+        return;
+    }
+
+    double loss = double(lost) / frames;
+    tx_loss_ = (tx_loss_ < 0) ? loss : 0.75 * tx_loss_ + 0.25 * loss;
+    logger_.debug("Peer lost %?u of %?u frames", lost, frames);
+
+    if(adaptive_)
+    {
+        adapt();
+    }
+}
+
+//------------------------------------------------------------------------------
+void Fec::adapt()
+{
+    uint32_t group_size = group_size_;
+    uint32_t parity = parity_count_;
+
+    if(type_ == FEC_RS)
+    {
+        // Expected losses per group plus two standard deviations
+        double expected = max_group_ * tx_loss_;
+        parity = uint32_t(std::ceil(expected + 2 * std::sqrt(expected)));
+        parity = std::min(std::max(parity, 1u), max_parity_);
+    }
+    else if(type_ == FEC_XOR)
+    {
+        // One parity frame repairs one loss, keep a second loss per group rare
+        group_size = (tx_loss_ > 0) ? uint32_t(0.25 / tx_loss_) : max_group_;
+        group_size = std::min(std::max(group_size, 2u), max_group_);
+    }
+
+    if(group_size != group_size_ || parity != parity_count_)
+    {
+        group_size_ = group_size;
+        parity_count_ = parity;
+        logger_.information("Loss %?u/1000, now %?u data + %?u parity frames per group",
+                uint32_t(tx_loss_ * 1000), group_size_, parity_count_);
+    }
+}
+
+//------------------------------------------------------------------------------
+bool Fec::receive(Frame::View &view)
+{
+    rebuilt_.clear();
+
+    if(view.length < TRAILER_SIZE)
+    {
+        return false;
+    }
+
+    view.length -= TRAILER_SIZE;
+    view.flags = Frame::Flags(view.flags & ~Frame::FLAG_FEC);
+    const uint8_t *trailer = view.payload + view.length;
+    uint8_t id = trailer[0];
+    uint8_t index = trailer[1];
+    uint8_t count = trailer[2];
+
+    Group *group = findGroup(id);
+
+    if(index & PARITY)
+    {
+        uint32_t row = index & ~PARITY;
+        if(group == nullptr || row >= MAX_PARITY || count == 0 || count > MAX_GROUP)
+        {
+            return false;
+        }
+
+        if(!(group->parity & (1 << row)))
+        {
+            group->parity |= 1 << row;
+            group->parities[row].assign(view.payload, view.payload + view.length);
+        }
+        group->count = count;
+        countLoss(*group);
+        decode(*group);
+        return false;
+    }
+
+    // A data frame is processed in any case, a late one may complete a group
+    if(group != nullptr && index < MAX_GROUP && !(group->present & (1u << index)))
+    {
+        std::vector<uint8_t> &unit = group->units[index];
+        unit.resize(UNIT_HEADER + view.length);
+        unit[0] = view.length & 0xFF;
+        unit[1] = (view.length >> 8) & 0xFF;
+        unit[2] = uint8_t(view.command);
+        unit[3] = uint8_t(view.flags);
+        unit[4] = view.sequence;
+        std::copy(view.payload, view.payload + view.length, unit.begin() + UNIT_HEADER);
+        group->present |= 1u << index;
+
+        if(group->count > 0)
+        {
+            decode(*group);
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool Fec::getRebuilt(Frame::View &view)
+{
+    while(!rebuilt_.empty())
+    {
+        uint32_t slot = rebuilt_.front() >> 8;
+        uint32_t index = rebuilt_.front() & 0xFF;
+        rebuilt_.erase(rebuilt_.begin());
+
+        const std::vector<uint8_t> &unit = rx_groups_[slot].units[index];
+        if(unit[2] == Frame::CMD_INVALID || unit[2] >= Frame::CMD_END)
+        {
+            continue;
+        }
+
+        view.command = Frame::Command(unit[2]);
+        view.flags = Frame::Flags(unit[3]);
+        view.length = unit[0] | (unit[1] << 8);
+        view.crc = 0;
+        view.sequence = unit[4];
+        view.payload = unit.data() + UNIT_HEADER;
+        return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+bool Fec::getReport(std::vector<uint8_t> &report)
+{
+    if(rx_frames_ < REPORT_INTERVAL)
+    {
+        return false;
+    }
+
+    uint32_t frames = std::min(rx_frames_, 0xFFFFu);
+    uint32_t lost = std::min(rx_lost_, frames);
+    report.clear();
+    report.push_back(frames & 0xFF);
+    report.push_back((frames >> 8) & 0xFF);
+    report.push_back(lost & 0xFF);
+    report.push_back((lost >> 8) & 0xFF);
+
+    rx_frames_ = 0;
+    rx_lost_ = 0;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Fec::getLost() const
+{
+    return rx_lost_total_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Fec::getRebuiltCount() const
+{
+    return rx_rebuilt_total_;
+}
+
+//------------------------------------------------------------------------------
+uint8_t Fec::coefficient(uint32_t row, uint32_t index) const
+{
+    if(type_ == FEC_XOR)
+    {
+        return 1;
+    }
+
+    // Cauchy matrix 1 / (x_row + y_index), every square submatrix is invertible
+    return Gf256::inv(uint8_t((PARITY | row) ^ index));
+}
+
+//------------------------------------------------------------------------------
+Fec::Group *Fec::findGroup(uint8_t id)
+{
+    Group &group = rx_groups_[id % RX_GROUPS];
+    if(group.used && group.id == id)
+    {
+        return &group;
+    }
+
+    // Frames of a group that has been replaced already are not tracked
+    if(group.used && int8_t(id - group.id) < 0)
+    {
+        return nullptr;
+    }
+
+    group.used = true;
+    group.id = id;
+    group.count = 0;
+    group.present = 0;
+    group.parity = 0;
+    group.counted = false;
+    return &group;
+}
+
+//------------------------------------------------------------------------------
+void Fec::countLoss(Group &group)
+{
+    if(group.counted)
+    {
+        return;
+    }
+
+    // Loss before correction, as seen when the first parity frame arrives
+    uint32_t mask = (group.count < 32) ? (1u << group.count) - 1 : 0xFFFFFFFF;
+    uint32_t lost = group.count - __builtin_popcount(group.present & mask);
+    group.counted = true;
+    rx_frames_ += group.count;
+    rx_lost_ += lost;
+    rx_lost_total_ += lost;
+}
+
+//------------------------------------------------------------------------------
+void Fec::decode(Group &group)
+{
+    std::vector<uint32_t> missing;
+    for(uint32_t i = 0; i < group.count; i++)
+    {
+        if(!(group.present & (1u << i)))
+        {
+            missing.push_back(i);
+        }
+    }
+
+    std::vector<uint32_t> rows;
+    for(uint32_t r = 0; r < MAX_PARITY && rows.size() < missing.size(); r++)
+    {
+        if(group.parity & (1 << r))
+        {
+            rows.push_back(r);
+        }
+    }
+
+    if(missing.empty() || rows.size() < missing.size())
+    {
+        return;
+    }
+
+    size_t size = group.parities[rows[0]].size();
+    uint32_t n = missing.size();
+
+    // Remove the received units from the parity frames, leaving
+    // sum(coefficient * missing unit) in each of them
+    std::vector<std::vector<uint8_t>> code(n);
+    for(uint32_t a = 0; a < n; a++)
+    {
+        if(group.parities[rows[a]].size() != size)
+        {
+            return;
+        }
+        code[a] = group.parities[rows[a]];
+        for(uint32_t i = 0; i < group.count; i++)
+        {
+            if((group.present & (1u << i)) && group.units[i].size() <= size)
+            {
+                Gf256::mulAdd(code[a].data(), group.units[i].data(), coefficient(rows[a], i), group.units[i].size());
+            }
+        }
+    }
+
+    // Invert the n x n coefficient matrix (Gauss-Jordan)
+    uint8_t matrix[MAX_PARITY][MAX_PARITY];
+    uint8_t inverse[MAX_PARITY][MAX_PARITY];
+    for(uint32_t a = 0; a < n; a++)
+    {
+        for(uint32_t b = 0; b < n; b++)
+        {
+            matrix[a][b] = coefficient(rows[a], missing[b]);
+            inverse[a][b] = (a == b) ? 1 : 0;
+        }
+    }
+
+    for(uint32_t col = 0; col < n; col++)
+    {
+        uint32_t pivot = col;
+        while(pivot < n && matrix[pivot][col] == 0)
+        {
+            pivot++;
+        }
+        if(pivot == n)
+        {
+            // Only the XOR code with more than one loss ends up here
+            return;
+        }
+        std::swap(matrix[pivot], matrix[col]);
+        std::swap(inverse[pivot], inverse[col]);
+
+        uint8_t scale = Gf256::inv(matrix[col][col]);
+        for(uint32_t b = 0; b < n; b++)
+        {
+            matrix[col][b] = Gf256::mul(matrix[col][b], scale);
+            inverse[col][b] = Gf256::mul(inverse[col][b], scale);
+        }
+
+        for(uint32_t a = 0; a < n; a++)
+        {
+            uint8_t factor = matrix[a][col];
+            if(a == col || factor == 0)
+            {
+                continue;
+            }
+            for(uint32_t b = 0; b < n; b++)
+            {
+                matrix[a][b] ^= Gf256::mul(factor, matrix[col][b]);
+                inverse[a][b] ^= Gf256::mul(factor, inverse[col][b]);
+            }
+        }
+    }
+
+    uint32_t slot = &group - rx_groups_;
+    for(uint32_t b = 0; b < n; b++)
+    {
+        std::vector<uint8_t> &unit = group.units[missing[b]];
+        unit.assign(size, 0);
+        for(uint32_t a = 0; a < n; a++)
+        {
+            Gf256::mulAdd(unit.data(), code[a].data(), inverse[b][a], size);
+        }
+
+        uint32_t length = unit[0] | (unit[1] << 8);
+        if(UNIT_HEADER + length > size)
+        {
+            logger_.warning("Rebuilt frame %?u of group %?u is invalid", missing[b], uint32_t(group.id));
+            continue;
+        }
+        unit.resize(UNIT_HEADER + length);
+        group.present |= 1u << missing[b];
+        rebuilt_.push_back((slot << 8) | missing[b]);
+        rx_rebuilt_total_++;
+        logger_.debug("Rebuilt frame %?u of group %?u", missing[b], uint32_t(group.id));
+    }
+}
@@ -0,0 +1,133 @@
+/*
+ * frame_pool.cpp
+ *
+ *  Created on: 02.04.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "frame_pool.h"
+
+//------------------------------------------------------------------------------
+FramePool::FramePool(uint32_t count, uint32_t capacity) :
+    capacity_(0),
+    in_use_(0),
+    high_water_(0),
+    exhausted_(0)
+{
+    resize(count, capacity);
+}
+
+//------------------------------------------------------------------------------
+FramePool::~FramePool()
+{
+    for(std::vector<Frame *>::iterator it = free_.begin(); it != free_.end(); it++)
+    {
+        delete *it;
+    }
+}
+
+//------------------------------------------------------------------------------
+void FramePool::resize(uint32_t count, uint32_t capacity)
+{
+    // Frames still in use are freed when they come back
+    for(std::vector<Frame *>::iterator it = frames_.begin(); it != frames_.end(); it++)
+    {
+        (*it)->pooled = false;
+    }
+    for(std::vector<Frame *>::iterator it = free_.begin(); it != free_.end(); it++)
+    {
+        delete *it;
+    }
+    free_.clear();
+    frames_.clear();
+
+    capacity_ = capacity;
+    frames_.reserve(count);
+    free_.reserve(count);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        Frame *f = new Frame(Frame::CMD_INVALID);
+        f->data.reserve(Frame::HEADROOM + capacity);
+        f->pooled = true;
+        frames_.push_back(f);
+        free_.push_back(f);
+    }
+
+    in_use_ = 0;
+}
+
+//------------------------------------------------------------------------------
+Frame *FramePool::acquire(Frame::Command cmd)
+{
+    if(free_.empty())
+    {
+        exhausted_++;
+        return new Frame(cmd);
+    }
+
+    Frame *f = free_.back();
+    free_.pop_back();
+
+    in_use_++;
+    if(in_use_ > high_water_)
+    {
+        high_water_ = in_use_;
+    }
+
+    f->command = cmd;
+    f->flags = Frame::FLAG_NONE;
+    f->length = 0;
+    f->crc = 0;
+    f->sequence = 0;
+    f->data.resize(Frame::HEADROOM);
+
+    return f;
+}
+
+//------------------------------------------------------------------------------
+void FramePool::release(Frame *f)
+{
+    if(f == nullptr)
+    {
+        return;
+    }
+
+    if(!f->pooled)
+    {
+        delete f;
+        return;
+    }
+
+    free_.push_back(f);
+    in_use_--;
+}
+
+//------------------------------------------------------------------------------
+uint32_t FramePool::getSize() const
+{
+    return frames_.size();
+}
+
+//------------------------------------------------------------------------------
+uint32_t FramePool::getCapacity() const
+{
+    return capacity_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t FramePool::getInUse() const
+{
+    return in_use_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t FramePool::getHighWater() const
+{
+    return high_water_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t FramePool::getExhausted() const
+{
+    return exhausted_;
+}
@@ -0,0 +1,199 @@
+/*
+ * gf256.cpp
+ *
+ *  Created on: 29.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "gf256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static const uint32_t POLYNOMIAL = 0x11D;
+
+//------------------------------------------------------------------------------
+struct GfTables
+{
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    // Full product table for the portable kernel
+    uint8_t mul[256][256];
+
+    // Products with the low and the high nibble, for the shuffle kernels
+    uint8_t low[256][16];
+    uint8_t high[256][16];
+
+    GfTables()
+    {
+        uint32_t x = 1;
+        for(uint32_t i = 0; i < 255; i++)
+        {
+            exp[i] = x;
+            exp[i + 255] = x;
+            log[x] = i;
+            x <<= 1;
+            if(x & 0x100)
+            {
+                x ^= POLYNOMIAL;
+            }
+        }
+        exp[510] = exp[0];
+        exp[511] = exp[1];
+        log[0] = 0;
+
+        for(uint32_t a = 0; a < 256; a++)
+        {
+            for(uint32_t b = 0; b < 256; b++)
+            {
+                mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+            }
+            for(uint32_t n = 0; n < 16; n++)
+            {
+                low[a][n] = mul[a][n];
+                high[a][n] = mul[a][n << 4];
+            }
+        }
+    }
+};
+
+static const GfTables tables;
+
+#if defined(__x86_64__) || defined(__i386__)
+//------------------------------------------------------------------------------
+__attribute__((target("ssse3")))
+static void mulAddVector(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t size)
+{
+    // Split table: c*x = c*(x & 0x0F) ^ c*(x & 0xF0), each a 16 entry lookup
+    const __m128i low = _mm_loadu_si128((const __m128i *)tables.low[c]);
+    const __m128i high = _mm_loadu_si128((const __m128i *)tables.high[c]);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    for(; size >= 16; size -= 16, src += 16, dst += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)src);
+        __m128i l = _mm_shuffle_epi8(low, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)dst);
+        _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    Gf256::mulAddTable(dst, src, c, size);
+}
+
+//------------------------------------------------------------------------------
+static bool hasVector()
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+static const char *VECTOR_KERNEL = "ssse3";
+
+#elif defined(__aarch64__)
+//------------------------------------------------------------------------------
+static void mulAddVector(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t size)
+{
+    const uint8x16_t low = vld1q_u8(tables.low[c]);
+    const uint8x16_t high = vld1q_u8(tables.high[c]);
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+
+    for(; size >= 16; size -= 16, src += 16, dst += 16)
+    {
+        uint8x16_t s = vld1q_u8(src);
+        uint8x16_t l = vqtbl1q_u8(low, vandq_u8(s, mask));
+        uint8x16_t h = vqtbl1q_u8(high, vshrq_n_u8(s, 4));
+        vst1q_u8(dst, veorq_u8(vld1q_u8(dst), veorq_u8(l, h)));
+    }
+    Gf256::mulAddTable(dst, src, c, size);
+}
+
+//------------------------------------------------------------------------------
+static bool hasVector()
+{
+    // Advanced SIMD is mandatory on AArch64
+    return true;
+}
+
+static const char *VECTOR_KERNEL = "neon";
+
+#else
+//------------------------------------------------------------------------------
+static void mulAddVector(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t size)
+{
+    Gf256::mulAddTable(dst, src, c, size);
+}
+
+//------------------------------------------------------------------------------
+static bool hasVector()
+{
+    return false;
+}
+
+static const char *VECTOR_KERNEL = "";
+#endif
+
+typedef void (*MulAddKernel)(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t size);
+
+static const bool vector = hasVector();
+static const MulAddKernel mulAddKernel = vector ? mulAddVector : Gf256::mulAddTable;
+
+//------------------------------------------------------------------------------
+uint8_t Gf256::mul(uint8_t a, uint8_t b)
+{
+    return tables.mul[a][b];
+}
+
+//------------------------------------------------------------------------------
+uint8_t Gf256::div(uint8_t a, uint8_t b)
+{
+    if(a == 0 || b == 0)
+    {
+        return 0;
+    }
+    return tables.exp[tables.log[a] + 255 - tables.log[b]];
+}
+
+//------------------------------------------------------------------------------
+uint8_t Gf256::inv(uint8_t a)
+{
+    return div(1, a);
+}
+
+//------------------------------------------------------------------------------
+void Gf256::mulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t size)
+{
+    if(c == 0)
+    {
+        return;
+    }
+
+    if(c == 1)
+    {
+        for(uint32_t i = 0; i < size; i++)
+        {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+
+    mulAddKernel(dst, src, c, size);
+}
+
+//------------------------------------------------------------------------------
+const char *Gf256::kernel()
+{
+    return vector ? VECTOR_KERNEL : "table";
+}
+
+//------------------------------------------------------------------------------
+void Gf256::mulAddTable(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t size)
+{
+    const uint8_t *row = tables.mul[c];
+    for(uint32_t i = 0; i < size; i++)
+    {
+        dst[i] ^= row[src[i]];
+    }
+}
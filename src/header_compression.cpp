@@ -0,0 +1,638 @@
+/*
+ * header_compression.cpp
+ *
+ *  Created on: 14.03.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "header_compression.h"
+
+#include <cstring>
+
+#include <netinet/in.h>
+
+using namespace Poco;
+
+//------------------------------------------------------------------------------
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+//------------------------------------------------------------------------------
+static inline uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+//------------------------------------------------------------------------------
+static inline void put16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+//------------------------------------------------------------------------------
+static inline void put32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = (value >> 16) & 0xFF;
+    p[2] = (value >> 8) & 0xFF;
+    p[3] = value & 0xFF;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t putVarint(uint8_t *p, uint32_t value)
+{
+    uint32_t n = 0;
+    while(value >= 0x80)
+    {
+        p[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+//------------------------------------------------------------------------------
+static int32_t getVarint(const uint8_t *p, uint32_t size, uint32_t &value)
+{
+    value = 0;
+    for(uint32_t n = 0; n < size && n < 5; n++)
+    {
+        value |= uint32_t(p[n] & 0x7F) << (7 * n);
+        if((p[n] & 0x80) == 0)
+        {
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+//------------------------------------------------------------------------------
+static uint8_t crc8(const uint8_t *data, uint32_t size)
+{
+    uint8_t crc = 0xFF;
+    for(uint32_t i = 0; i < size; i++)
+    {
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+//------------------------------------------------------------------------------
+static uint16_t ipChecksum(const uint8_t *header, uint32_t size)
+{
+    uint32_t sum = 0;
+    for(uint32_t i = 0; i + 1 < size; i += 2)
+    {
+        sum += get16(header + i);
+    }
+    while(sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum & 0xFFFF;
+}
+
+//------------------------------------------------------------------------------
+// Bytes of the IP header which are sent together when MASK_TOS_TTL is set
+static const uint8_t TOS_TTL_V4[] = { 1, 8 };
+static const uint8_t TOS_TTL_V6[] = { 0, 1, 7 };
+
+//------------------------------------------------------------------------------
+HeaderCompression::HeaderCompression() :
+    logger_(Logger::get("HeaderCompression")),
+    clock_(0)
+{
+    reset();
+}
+
+//------------------------------------------------------------------------------
+HeaderCompression::~HeaderCompression()
+{
+}
+
+//------------------------------------------------------------------------------
+void HeaderCompression::reset()
+{
+    for(uint32_t i = 0; i < MAX_CONTEXTS; i++)
+    {
+        tx_[i].valid = false;
+        tx_[i].generation = 0;
+        tx_[i].last_used = 0;
+        rx_[i].valid = false;
+        rx_[i].requested = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+uint32_t HeaderCompression::parse(const uint8_t *packet, uint32_t size, uint32_t &ip_len, uint8_t &protocol)
+{
+    if(size < 20)
+    {
+        return 0;
+    }
+
+    switch(packet[0] >> 4)
+    {
+        case 4:
+            // No options, no fragments and the length has to match the packet
+            if((packet[0] & 0x0F) != 5 || ((packet[6] & 0x3F) | packet[7]) != 0 || get16(packet + 2) != size)
+            {
+                return 0;
+            }
+            ip_len = 20;
+            protocol = packet[9];
+            break;
+
+        case 6:
+            if(size < 40 || get16(packet + 4) != size - 40)
+            {
+                return 0;
+            }
+            ip_len = 40;
+            protocol = packet[6];
+            break;
+
+        default:
+            return 0;
+    }
+
+    if(protocol == IPPROTO_UDP && size >= ip_len + 8)
+    {
+        return ip_len + 8;
+    }
+
+    if(protocol == IPPROTO_TCP && size >= ip_len + 20)
+    {
+        uint32_t len = (packet[ip_len + 12] >> 4) * 4;
+        if(len >= 20 && size >= ip_len + len)
+        {
+            return ip_len + len;
+        }
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+uint32_t HeaderCompression::flowKey(const uint8_t *packet, uint32_t ip_len, uint8_t protocol, uint8_t *key)
+{
+    // Addresses, protocol and ports identify the flow
+    uint32_t addr = (ip_len == 20) ? 12 : 8;
+    uint32_t len = ip_len - addr;
+
+    memcpy(key, packet + addr, len);
+    key[len++] = protocol;
+    memcpy(key + len, packet + ip_len, 4);
+
+    return len + 4;
+}
+
+//------------------------------------------------------------------------------
+HeaderCompression::Context *HeaderCompression::lookup(const uint8_t *key, uint32_t key_len, uint8_t &cid)
+{
+    uint32_t oldest = 0;
+    for(uint32_t i = 0; i < MAX_CONTEXTS; i++)
+    {
+        Context &ctx = tx_[i];
+        if(ctx.valid && ctx.key_len == key_len && memcmp(ctx.key, key, key_len) == 0)
+        {
+            cid = i;
+            return &ctx;
+        }
+
+        if(!ctx.valid || (tx_[oldest].valid && ctx.last_used < tx_[oldest].last_used))
+        {
+            oldest = i;
+        }
+    }
+
+    // Least recently used context is taken over by the new flow
+    cid = oldest;
+    Context &ctx = tx_[oldest];
+    ctx.valid = false;
+    memcpy(ctx.key, key, key_len);
+    ctx.key_len = key_len;
+
+    return &ctx;
+}
+
+//------------------------------------------------------------------------------
+void HeaderCompression::update(Context &ctx, const uint8_t *header, uint32_t header_len)
+{
+    memcpy(ctx.header, header, header_len);
+    ctx.header_len = header_len;
+}
+
+//------------------------------------------------------------------------------
+int32_t HeaderCompression::rebuild(const Context &ctx, uint8_t mask, const uint8_t *fields, uint32_t size,
+                                   uint32_t payload, uint8_t *header, uint32_t &header_len)
+{
+    uint32_t pos = 0;
+    uint32_t ip_len = ctx.ip_len;
+    uint32_t value;
+    int32_t n;
+
+    memcpy(header, ctx.header, ctx.header_len);
+    header_len = ctx.header_len;
+    uint16_t ip_id_delta = 0;
+
+    if(mask & MASK_IPID)
+    {
+        if(ip_len != 20 || (n = getVarint(fields + pos, size - pos, value)) < 0)
+        {
+            return -1;
+        }
+        ip_id_delta = value;
+        pos += n;
+    }
+
+    if(mask & MASK_TOS_TTL)
+    {
+        const uint8_t *offsets = (ip_len == 20) ? TOS_TTL_V4 : TOS_TTL_V6;
+        uint32_t count = (ip_len == 20) ? sizeof(TOS_TTL_V4) : sizeof(TOS_TTL_V6);
+        if(pos + count > size)
+        {
+            return -1;
+        }
+        for(uint32_t i = 0; i < count; i++)
+        {
+            header[offsets[i]] = fields[pos++];
+        }
+    }
+
+    uint8_t *l4 = header + ip_len;
+    if(ctx.protocol == IPPROTO_TCP)
+    {
+        if(mask & MASK_SEQ)
+        {
+            if((n = getVarint(fields + pos, size - pos, value)) < 0)
+            {
+                return -1;
+            }
+            put32(l4 + 4, get32(l4 + 4) + value);
+            pos += n;
+        }
+
+        if(mask & MASK_ACK)
+        {
+            if((n = getVarint(fields + pos, size - pos, value)) < 0)
+            {
+                return -1;
+            }
+            put32(l4 + 8, get32(l4 + 8) + value);
+            pos += n;
+        }
+
+        if(mask & MASK_WINDOW)
+        {
+            if(pos + 2 > size)
+            {
+                return -1;
+            }
+            l4[14] = fields[pos++];
+            l4[15] = fields[pos++];
+        }
+
+        if(mask & MASK_FLAGS)
+        {
+            if(pos + 1 > size)
+            {
+                return -1;
+            }
+            l4[13] = fields[pos++];
+        }
+
+        if(mask & MASK_OPTIONS)
+        {
+            if(pos + 1 > size)
+            {
+                return -1;
+            }
+            uint32_t len = (fields[pos] >> 4) * 4;
+            if(len < 20 || ip_len + len > MAX_HEADER || pos + 1 + len - 20 > size)
+            {
+                return -1;
+            }
+            l4[12] = fields[pos++];
+            memcpy(l4 + 20, fields + pos, len - 20);
+            pos += len - 20;
+            header_len = ip_len + len;
+        }
+
+        if(mask & MASK_URGENT)
+        {
+            if(pos + 2 > size)
+            {
+                return -1;
+            }
+            l4[18] = fields[pos++];
+            l4[19] = fields[pos++];
+        }
+
+        if(pos + 2 > size)
+        {
+            return -1;
+        }
+        l4[16] = fields[pos++];
+        l4[17] = fields[pos++];
+    }
+    else
+    {
+        if(mask & ~(MASK_IPID | MASK_TOS_TTL))
+        {
+            return -1;
+        }
+
+        if(pos + 2 > size)
+        {
+            return -1;
+        }
+        put16(l4 + 4, header_len - ip_len + payload);
+        l4[6] = fields[pos++];
+        l4[7] = fields[pos++];
+    }
+
+    // Inferred fields
+    if(ip_len == 20)
+    {
+        put16(header + 2, header_len + payload);
+        put16(header + 4, get16(header + 4) + ip_id_delta);
+        put16(header + 10, 0);
+        put16(header + 10, ipChecksum(header, 20));
+    }
+    else
+    {
+        put16(header + 4, header_len - 40 + payload);
+    }
+
+    return pos;
+}
+
+//------------------------------------------------------------------------------
+uint32_t HeaderCompression::compress(const uint8_t *packet, uint32_t size, uint8_t *out)
+{
+    uint32_t ip_len;
+    uint8_t protocol;
+    uint32_t header_len = parse(packet, size, ip_len, protocol);
+    if(header_len == 0 || header_len > MAX_HEADER)
+    {
+        memcpy(out, packet, size);
+        return size;
+    }
+
+    uint8_t key[KEY_SIZE];
+    uint32_t key_len = flowKey(packet, ip_len, protocol, key);
+
+    uint8_t cid;
+    Context *ctx = lookup(key, key_len, cid);
+    ctx->last_used = ++clock_;
+
+    if(ctx->valid && ctx->packets < REFRESH_INTERVAL)
+    {
+        const uint8_t *h = ctx->header;
+        uint8_t *fields = out + 4;
+        uint32_t pos = 0;
+        uint8_t mask = 0;
+
+        if(ip_len == 20)
+        {
+            uint16_t ip_id_delta = get16(packet + 4) - get16(h + 4);
+            if(ip_id_delta != 0)
+            {
+                mask |= MASK_IPID;
+                pos += putVarint(fields + pos, ip_id_delta);
+            }
+        }
+
+        const uint8_t *offsets = (ip_len == 20) ? TOS_TTL_V4 : TOS_TTL_V6;
+        uint32_t count = (ip_len == 20) ? sizeof(TOS_TTL_V4) : sizeof(TOS_TTL_V6);
+        for(uint32_t i = 0; i < count; i++)
+        {
+            if(packet[offsets[i]] != h[offsets[i]])
+            {
+                mask |= MASK_TOS_TTL;
+            }
+        }
+        if(mask & MASK_TOS_TTL)
+        {
+            for(uint32_t i = 0; i < count; i++)
+            {
+                fields[pos++] = packet[offsets[i]];
+            }
+        }
+
+        const uint8_t *l4 = packet + ip_len;
+        const uint8_t *old = h + ip_len;
+        if(protocol == IPPROTO_TCP)
+        {
+            uint32_t delta = get32(l4 + 4) - get32(old + 4);
+            if(delta != 0)
+            {
+                mask |= MASK_SEQ;
+                pos += putVarint(fields + pos, delta);
+            }
+
+            delta = get32(l4 + 8) - get32(old + 8);
+            if(delta != 0)
+            {
+                mask |= MASK_ACK;
+                pos += putVarint(fields + pos, delta);
+            }
+
+            if(get16(l4 + 14) != get16(old + 14))
+            {
+                mask |= MASK_WINDOW;
+                fields[pos++] = l4[14];
+                fields[pos++] = l4[15];
+            }
+
+            if(l4[13] != old[13])
+            {
+                mask |= MASK_FLAGS;
+                fields[pos++] = l4[13];
+            }
+
+            uint32_t len = header_len - ip_len;
+            if(header_len != ctx->header_len || memcmp(l4 + 20, old + 20, len - 20) != 0)
+            {
+                mask |= MASK_OPTIONS;
+                fields[pos++] = l4[12];
+                memcpy(fields + pos, l4 + 20, len - 20);
+                pos += len - 20;
+            }
+
+            if(get16(l4 + 18) != get16(old + 18))
+            {
+                mask |= MASK_URGENT;
+                fields[pos++] = l4[18];
+                fields[pos++] = l4[19];
+            }
+
+            fields[pos++] = l4[16];
+            fields[pos++] = l4[17];
+        }
+        else
+        {
+            fields[pos++] = l4[6];
+            fields[pos++] = l4[7];
+        }
+
+        // Only fields covered by the change mask may differ, everything else
+        // needs a refresh of the context
+        uint8_t header[MAX_HEADER];
+        uint32_t rebuilt_len;
+        // The deltas grow with the distance to the IR packet, once they
+        // don't save anything any more the context is refreshed
+        if(rebuild(*ctx, mask, fields, pos, size - header_len, header, rebuilt_len) == int32_t(pos) &&
+           rebuilt_len == header_len && memcmp(header, packet, header_len) == 0 && 4 + pos < header_len)
+        {
+            out[0] = TYPE_CO | ctx->generation;
+            out[1] = cid;
+            out[2] = mask;
+            out[3] = crc8(packet, header_len);
+            memcpy(out + 4 + pos, packet + header_len, size - header_len);
+
+            ctx->packets++;
+
+            return 4 + pos + size - header_len;
+        }
+    }
+
+    ctx->valid = true;
+    ctx->ip_len = ip_len;
+    ctx->protocol = protocol;
+    ctx->generation = (ctx->generation + 1) & GENERATION_MASK;
+    ctx->packets = 0;
+    update(*ctx, packet, header_len);
+
+    out[0] = TYPE_IR | ctx->generation;
+    out[1] = cid;
+    memcpy(out + 2, packet, size);
+
+    return size + 2;
+}
+
+//------------------------------------------------------------------------------
+uint32_t HeaderCompression::decompress(const uint8_t *data, uint32_t size, uint8_t *out, uint32_t max_len,
+                                       std::vector<uint8_t> &feedback)
+{
+    feedback.clear();
+
+    if(size == 0)
+    {
+        return 0;
+    }
+
+    uint8_t type = data[0];
+    if((type >> 4) == 4 || (type >> 4) == 6)
+    {
+        if(size > max_len)
+        {
+            return 0;
+        }
+        memcpy(out, data, size);
+        return size;
+    }
+
+    if(size < 2 || data[1] >= MAX_CONTEXTS)
+    {
+        logger_.warning("Invalid compressed packet");
+        return 0;
+    }
+
+    uint8_t cid = data[1];
+
+    if(type == TYPE_FEEDBACK)
+    {
+        logger_.debug("Context %?u refresh requested", cid);
+        tx_[cid].valid = false;
+        return 0;
+    }
+
+    uint8_t generation = type & GENERATION_MASK;
+    type &= ~GENERATION_MASK;
+
+    if(type == TYPE_IR)
+    {
+        uint32_t ip_len;
+        uint8_t protocol;
+        uint32_t header_len = parse(data + 2, size - 2, ip_len, protocol);
+        if(header_len == 0 || header_len > MAX_HEADER || size - 2 > max_len)
+        {
+            logger_.warning("Invalid IR packet for context %?u", cid);
+            return 0;
+        }
+
+        Context &ctx = rx_[cid];
+        ctx.valid = true;
+        ctx.ip_len = ip_len;
+        ctx.protocol = protocol;
+        ctx.generation = generation;
+        ctx.requested = false;
+        update(ctx, data + 2, header_len);
+
+        memcpy(out, data + 2, size - 2);
+        return size - 2;
+    }
+
+    if(type == TYPE_CO && size >= 4)
+    {
+        Context &ctx = rx_[cid];
+        if(ctx.valid && ctx.generation == generation)
+        {
+            uint8_t header[MAX_HEADER];
+            uint32_t header_len;
+
+            // The payload size is only known after the fields are parsed, so the
+            // lengths are patched once the header is complete
+            int32_t pos = rebuild(ctx, data[2], data + 4, size - 4, 0, header, header_len);
+            if(pos >= 0)
+            {
+                uint32_t payload = size - 4 - pos;
+                rebuild(ctx, data[2], data + 4, size - 4, payload, header, header_len);
+
+                if(crc8(header, header_len) == data[3] && header_len + payload <= max_len)
+                {
+                    memcpy(out, header, header_len);
+                    memcpy(out + header_len, data + 4 + pos, payload);
+                    return header_len + payload;
+                }
+            }
+            ctx.valid = false;
+        }
+
+        // Every packet in flight would ask again, once is enough until the
+        // IR packet had time to arrive
+        if(ctx.requested && ctx.requested_at.elapsed() < Timestamp::TimeDiff(FEEDBACK_INTERVAL) * 1000)
+        {
+            logger_.debug("Context %?u damaged, refresh already requested", cid);
+            return 0;
+        }
+
+        logger_.warning("Context %?u damaged, requesting refresh", cid);
+        ctx.requested = true;
+        ctx.requested_at.update();
+        feedback.push_back(TYPE_FEEDBACK);
+        feedback.push_back(cid);
+        return 0;
+    }
+
+    logger_.warning("Unknown packet type %?u", type);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+void HeaderCompression::feedbackDropped(const std::vector<uint8_t> &feedback)
+{
+    if(feedback.size() >= 2 && feedback[0] == TYPE_FEEDBACK && feedback[1] < MAX_CONTEXTS)
+    {
+        rx_[feedback[1]].requested = false;
+    }
+}
@@ -6,18 +6,80 @@
  */
 
 #include "protocol.h"
+#include "version.h"
 
-#include <Poco/ThreadPool.h>
+#include <algorithm>
+#include <cstring>
 
 using namespace Poco;
 
 //------------------------------------------------------------------------------
 Protocol::Protocol(Serial *serial) :
     logger_(Logger::get("Protocol")),
-    thread_(nullptr),
     serial_(serial),
-    listener_(nullptr)
+    reactor_(nullptr),
+    tx_queue_(pool_, TX_QUEUE_SIZE),
+    tx_bytes_(0),
+    tx_acked_bytes_(0),
+    tx_blocked_(false),
+    listener_(nullptr),
+    ack_pending_(false),
+    ack_frame_(nullptr),
+    ack_retries_(0),
+    ack_resent_(false),
+    ack_inflight_(0),
+    tx_fast_retransmits_(0),
+    srtt_(-1),
+    rttvar_(0),
+    rto_(RETRANSMIT_TIMEOUT),
+    max_retries_(MAX_RETRIES),
+    window_size_(0),
+    tx_base_(0),
+    tx_next_(0),
+    rx_next_(0),
+    rx_mask_(0),
+    aggregate_size_(0),
+    aggregate_delay_(0),
+    pending_(nullptr),
+    holding_(false),
+    compression_(nullptr),
+    mtu_(0),
+    tx_fragment_id_(0),
+    rx_incomplete_(0),
+    pool_(POOL_SIZE, MAX_PAYLOAD),
+    rx_buffer_(RX_BUFFER_SIZE),
+    rx_need_(0),
+    rx_crc_errors_(0),
+    rx_naks_(0),
+    crc_(Crc::CRC_XOR8),
+    compact_(false),
+    tx_compact_(false),
+    handshake_enabled_(false),
+    handshake_(HS_DONE),
+    handshake_retries_(0),
+    address_set_(false),
+    address_(0),
+    peer_max_frame_(0),
+    peer_max_baud_(0),
+    crc_config_(Crc::CRC_XOR8),
+    cobs_config_(false),
+    cobs_(false),
+    rx_scanned_(0)
 {
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        tx_window_[i].frame = nullptr;
+        tx_window_[i].retries = 0;
+        tx_window_[i].resent = false;
+        tx_window_[i].bytes = 0;
+        tx_window_[i].inflight = 0;
+    }
+
+    for(uint32_t i = 0; i < REASSEMBLY_SLOTS; i++)
+    {
+        rx_reassembly_[i].used = false;
+    }
+
     serial->setListener(this);
 }
 
@@ -32,124 +94,1634 @@ void Protocol::setListener(Protocol::Listener *listener)
     listener_ = listener;
 }
 
+//------------------------------------------------------------------------------
+void Protocol::setWindowSize(uint32_t size)
+{
+    window_size_ = (size > MAX_WINDOW) ? MAX_WINDOW : size;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setAggregation(uint32_t size, uint32_t delay)
+{
+    aggregate_size_ = (size > MAX_AGGREGATE) ? MAX_AGGREGATE : size;
+    aggregate_delay_ = delay;
+
+    if(aggregate_size_ > pool_.getCapacity())
+    {
+        pool_.resize(pool_.getSize(), aggregate_size_);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setPoolSize(uint32_t count)
+{
+    pool_.resize(count, pool_.getCapacity());
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setCrc(Crc::Type type)
+{
+    crc_ = type;
+    crc_config_ = type;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setCobs(bool enable)
+{
+    cobs_ = enable;
+    cobs_config_ = enable;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setCompactHeader(bool enable)
+{
+    compact_ = enable;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setHandshake(bool enable)
+{
+    handshake_enabled_ = enable;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setAddress(uint16_t address)
+{
+    address_ = address;
+    address_set_ = true;
+}
+
+//------------------------------------------------------------------------------
+bool Protocol::isReady() const
+{
+    return handshake_ == HS_DONE;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setMtu(uint32_t mtu)
+{
+    mtu_ = mtu;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Protocol::getMtu() const
+{
+    uint32_t mtu = mtu_;
+    if(peer_max_frame_ > 0 && (mtu == 0 || peer_max_frame_ < mtu))
+    {
+        mtu = peer_max_frame_;
+    }
+
+    // Below that the fragments would be mostly header
+    return (mtu > 0 && mtu < MIN_MTU) ? MIN_MTU : mtu;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Protocol::getPeerMaxFrame() const
+{
+    return peer_max_frame_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Protocol::getPeerMaxBaud() const
+{
+    return peer_max_baud_;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setFec(Fec::Type type, uint32_t group_size, uint32_t parity, bool adaptive)
+{
+    fec_.setType(type, group_size, parity);
+    fec_.setAdaptive(adaptive);
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setClassWeight(Classifier::Class cls, uint32_t weight)
+{
+    tx_queue_.setWeight(cls, weight);
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setLinkRate(uint32_t bytes_per_second)
+{
+    tx_queue_.setLinkRate(bytes_per_second);
+    logger_.information("CoDel target %?u ms, interval %?u ms", tx_queue_.getTarget(), tx_queue_.getInterval());
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setMaxRetries(uint32_t retries)
+{
+    max_retries_ = retries;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setRfRate(uint32_t bytes_per_second)
+{
+    shaper_.setRate(bytes_per_second);
+}
+
+//------------------------------------------------------------------------------
+void Protocol::setCompression(Compression *compression)
+{
+    compression_ = compression;
+}
+
 //------------------------------------------------------------------------------
 void Protocol::reset()
 {
-    buffer_.clear();
+    rx_buffer_.clear();
+    rx_need_ = 0;
+    rx_scanned_ = 0;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::start(Reactor *reactor)
+{
+    reactor_ = reactor;
+    serial_->attach(reactor_);
+    reactor_->add(timer_.getFd(), EPOLLIN, this);
+
+    crc_ = crc_config_;
+    cobs_ = cobs_config_;
+    tx_compact_ = false;
+
+    if(handshake_enabled_)
+    {
+        handshake_ = HS_RESET;
+        handshake_retries_ = 0;
+        sendHandshake();
+        serial_->flush();
+        timer_.start(HANDSHAKE_TIMEOUT);
+    }
+    else if(compact_)
+    {
+        // Old firmware does not answer, frames stay in the legacy layout then
+        Frame *request = pool_.acquire(Frame::CMD_GET_VERSION);
+        transmit(request);
+        pool_.release(request);
+        serial_->flush();
+    }
 }
 
 //------------------------------------------------------------------------------
 void Protocol::close()
 {
-    if(thread_ != nullptr)
+    if(reactor_ != nullptr)
     {
-        tx_buffer_.put(nullptr);
-        thread_ = nullptr;
+        reactor_->remove(timer_.getFd());
+        reactor_ = nullptr;
     }
+    timer_.stop();
     serial_->close();
+
+    pool_.release(pending_);
+    pending_ = nullptr;
+    for(uint32_t i = 0; i < tx_fragments_.size(); i++)
+    {
+        pool_.release(tx_fragments_[i]);
+    }
+    tx_fragments_.clear();
+    pool_.release(ack_frame_);
+    ack_frame_ = nullptr;
+    ack_pending_ = false;
+
+    tx_queue_.clear();
+
+    for(; tx_base_ != tx_next_; tx_base_++)
+    {
+        pool_.release(tx_window_[tx_base_].frame);
+        tx_window_[tx_base_].frame = nullptr;
+    }
+
+    for(uint32_t i = 0; i < Classifier::CLASS_COUNT; i++)
+    {
+        Classifier::Class cls = Classifier::Class(i);
+        logger_.information("Class %s: %?u frames queued at most, %?u pushed out, %?u dropped by CoDel",
+                Classifier::className(cls), tx_queue_.getHighWater(cls), tx_queue_.getDrops(cls),
+                tx_queue_.getCodelDrops(cls));
+    }
+    if(srtt_ >= 0)
+    {
+        logger_.information("RTT %?u ms, RTO %?u ms", uint32_t(srtt_ / 1000), uint32_t(rto_));
+    }
+    logger_.information("%?u NAKs sent, %?u frames retransmitted on NAK", rx_naks_, tx_fast_retransmits_);
+    if(fec_.isEnabled())
+    {
+        logger_.information("FEC: %?u frames lost, %?u rebuilt", fec_.getLost(), fec_.getRebuiltCount());
+    }
+    if(shaper_.isEnabled())
+    {
+        logger_.information("Shaper: %?u RF failures, %?u ACK timeouts, rate %?u bytes/s", shaper_.getFailures(),
+                shaper_.getTimeouts(), shaper_.getRate());
+    }
+    logger_.information("Frame pool: %?u of %?u frames used at most, exhausted %?u times",
+            pool_.getHighWater(), pool_.getSize(), pool_.getExhausted());
+    if(crc_ != Crc::CRC_XOR8)
+    {
+        logger_.information("%s: %?u frames dropped with CRC errors", Crc::typeName(crc_), rx_crc_errors_);
+    }
     logger_.information("closed");
 }
 
 //------------------------------------------------------------------------------
-void Protocol::sendData(const uint8_t *data, uint32_t size)
+bool Protocol::sendData(const uint8_t *data, uint32_t size, Classifier::Class cls, uint32_t flow)
 {
-    Frame *f = new Frame(Frame::CMD_SEND);
+    Frame *f = pool_.acquire(Frame::CMD_SEND);
     f->setData(data, size);
-    tx_buffer_.put(f);
+    if(!tx_queue_.put(f, cls, flow))
+    {
+        pool_.release(f);
+        return false;
+    }
+
+    pump();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool Protocol::waitTxSpace()
+{
+    return tx_queue_.waitSpace();
+}
+
+//------------------------------------------------------------------------------
+int Protocol::getTxSpaceFd() const
+{
+    return tx_queue_.spaceFd();
+}
+
+//------------------------------------------------------------------------------
+uint32_t Protocol::getQueued() const
+{
+    return tx_queue_.getBytes();
+}
+
+//------------------------------------------------------------------------------
+uint64_t Protocol::getBytesSent() const
+{
+    return tx_bytes_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Protocol::getQueueDepth(Classifier::Class cls) const
+{
+    return tx_queue_.getDepth(cls);
+}
+
+//------------------------------------------------------------------------------
+uint32_t Protocol::getQueueDrops(Classifier::Class cls) const
+{
+    return tx_queue_.getDrops(cls) + tx_queue_.getCodelDrops(cls);
 }
 
 //------------------------------------------------------------------------------
 void Protocol::addData(const uint8_t* data, uint32_t size)
 {
-    buffer_.insert(buffer_.end(), data, data+size);
+    if(!rx_buffer_.write(data, size))
+    {
+        logger_.warning("RX buffer overflow, %?u bytes dropped", size);
+    }
 }
 
 //------------------------------------------------------------------------------
-Frame* Protocol::getFrame()
+bool Protocol::getFrame(Frame::View &view)
 {
-    Frame *f = Frame::deserialize(buffer_.data(), buffer_.size());
-    if(f != nullptr)
+    if(cobs_)
+    {
+        return getCobsFrame(view);
+    }
+
+    while(true)
     {
-        if((f->getLength()+5) > buffer_.size())
+        // Header of an incomplete frame was already seen, wait for the rest
+        if(rx_buffer_.size() < rx_need_)
         {
-            logger_.warning("Frame size: %?d, Buffer size: %?d", f->getLength(), buffer_.size());
-            logger_.warning(f->toString());
-            buffer_.clear();
+            return false;
         }
-        else
+
+        const uint8_t *data = rx_buffer_.readPtr();
+        uint32_t size = Frame::parse(data, rx_buffer_.size(), view, crc_);
+        if(size == 0)
         {
-            buffer_.erase(buffer_.begin(), buffer_.begin() + f->getLength() + 5);
+            return false;
         }
-    }
 
-    return f;
+        // Noise looking like a compact header with an endless length
+        if(size == Frame::INVALID)
+        {
+            logger_.warning("Invalid frame length, skipping byte");
+            rx_buffer_.consume(1);
+            rx_need_ = 0;
+            continue;
+        }
+
+        if(view.command <= Frame::CMD_INVALID || view.command >= Frame::CMD_END || !Frame::checkHeader(data, crc_))
+        {
+            logger_.warning("Invalid header (command %?u), skipping byte", uint32_t(view.command));
+            rx_buffer_.consume(1);
+            rx_need_ = 0;
+            continue;
+        }
+
+        if(size > rx_buffer_.size())
+        {
+            rx_need_ = size;
+            return false;
+        }
+
+        if(!Frame::checkCrc(data, size, crc_))
+        {
+            rx_crc_errors_++;
+            logger_.warning("CRC error, frame with %?u bytes dropped (%?u errors)", size, rx_crc_errors_);
+            rx_buffer_.consume(size);
+            rx_need_ = 0;
+            corrupted(view);
+            continue;
+        }
+
+        // The view stays valid until the next addData
+        rx_buffer_.consume(size);
+        rx_need_ = 0;
+        return true;
+    }
 }
 
 //------------------------------------------------------------------------------
-void Protocol::dataReceived(uint8_t *buffer, uint32_t length)
+bool Protocol::getCobsFrame(Frame::View &view)
 {
-    addData(buffer, length);
-
     while(true)
     {
-        Frame *f = getFrame();
-        if(f == nullptr)
+        uint8_t *data = rx_buffer_.readPtr();
+        uint32_t size = rx_buffer_.size();
+        const uint8_t *end = static_cast<const uint8_t *>(
+                memchr(data + rx_scanned_, Cobs::DELIMITER, size - rx_scanned_));
+        if(end == nullptr)
         {
-            break;
+            rx_scanned_ = size;
+            if(rx_buffer_.available() == 0)
+            {
+                logger_.warning("No frame delimiter in %?u bytes, dropped", size);
+                rx_buffer_.clear();
+                rx_scanned_ = 0;
+            }
+            return false;
         }
 
-        if(f->getFlags() & Frame::FLAG_ACK)
+        uint32_t encoded = end - data;
+        int32_t length = Cobs::decode(data, encoded, data);
+        rx_buffer_.consume(encoded + 1);
+        rx_scanned_ = 0;
+
+        // Back to back delimiters are idle fill
+        if(encoded == 0)
         {
-            cond_.broadcast();
-            logger_.information("Serial ACK");
+            continue;
         }
-        else
+
+        // Anything not exactly one frame is dropped, the next one starts
+        // behind the delimiter in any case
+        uint32_t frame = (length > 0) ? Frame::parse(data, length, view, crc_) : 0;
+        if(frame == 0 || frame != uint32_t(length) || view.command <= Frame::CMD_INVALID ||
+           view.command >= Frame::CMD_END || !Frame::checkHeader(data, crc_))
         {
-            if(listener_)
-            {
-                listener_->onFrameReceived(f);
-            }
+            logger_.warning("Invalid frame, %?u bytes dropped", encoded);
+            continue;
+        }
+
+        if(!Frame::checkCrc(data, frame, crc_))
+        {
+            rx_crc_errors_++;
+            logger_.warning("CRC error, frame with %?u bytes dropped (%?u errors)", frame, rx_crc_errors_);
+            corrupted(view);
+            continue;
         }
 
-        delete f;
+        // The view stays valid until the next addData
+        return true;
     }
 }
 
 //------------------------------------------------------------------------------
-void Protocol::portClosed()
+uint8_t *Protocol::getReceiveBuffer(uint32_t &size)
 {
-
+    size = rx_buffer_.available();
+    return rx_buffer_.writePtr();
 }
 
 //------------------------------------------------------------------------------
-void Protocol::run()
+void Protocol::dataReceived(uint8_t *buffer, uint32_t length)
 {
-    thread_ = Thread::current();
+    // Read into the ring buffer directly unless it was full
+    if(buffer == rx_buffer_.writePtr())
+    {
+        rx_buffer_.commit(length);
+    }
+    else
+    {
+        addData(buffer, length);
+    }
+
+    Frame::View view;
+    while(getFrame(view))
+    {
+        if(view.flags & Frame::FLAG_FEC)
+        {
+            receiveFec(view);
+        }
+        else
+        {
+            handleFrame(view);
+        }
+    }
 
-    ThreadPool::defaultPool().start(*serial_);
+    // ACKs may have opened the window
+    pump();
+}
 
-    while(true)
+//------------------------------------------------------------------------------
+void Protocol::handleFrame(const Frame::View &view)
+{
+    if(view.command == Frame::CMD_GET_VERSION)
     {
-        Frame *f = tx_buffer_.take(0);
-        if(f == nullptr)
+        handleVersion(view);
+    }
+    else if(view.command == Frame::CMD_RESET || view.command == Frame::CMD_SET_ADDRESS)
+    {
+        handleHandshake(view);
+    }
+    else if(view.command == Frame::CMD_RF_FAILURE)
+    {
+        // The dongle could not get a frame over the air
+        logger_.warning("RF failure reported");
+        shaper_.onFailure();
+    }
+    else if((view.flags & (Frame::FLAG_NAK | Frame::FLAG_ACK | Frame::FLAG_SEQ)) == Frame::FLAG_NAK)
+    {
+        // Stop-and-wait: the dongle got the frame damaged, resend it now. The
+        // NAK proves the link is alive, it does not count as a retry.
+        if(ack_pending_)
         {
-            break;
+            logger_.debug("Serial NAK, retransmitting");
+            ack_resent_ = true;
+            ack_sent_.update();
+            transmit(ack_frame_);
+            tx_fast_retransmits_++;
+        }
+    }
+    else if(view.flags & Frame::FLAG_ACK)
+    {
+        if(view.flags & Frame::FLAG_SEQ)
+        {
+            handleAck(view);
+        }
+        else
+        {
+            if(ack_pending_)
+            {
+                // Karn: the ACK of a retransmitted frame could belong to any copy
+                if(ack_retries_ == 0 && !ack_resent_)
+                {
+                    sampleRtt(ack_sent_.elapsed(), ack_inflight_);
+                }
+                tx_acked_bytes_ = tx_bytes_;
+                pool_.release(ack_frame_);
+                ack_frame_ = nullptr;
+                ack_pending_ = false;
+            }
+            logger_.information("Serial ACK");
+        }
+    }
+    else if((view.flags & Frame::FLAG_SEQ) && !handleSequenced(view))
+    {
+        logger_.debug("Duplicate frame %?u dropped", view.sequence);
+    }
+    else
+    {
+        deliver(view);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::handleVersion(const Frame::View &view)
+{
+    if((view.flags & Frame::FLAG_ACK) == 0)
+    {
+        // Answer like the dongle, both header layouts are always parsed
+        uint8_t version[VERSION_SIZE];
+        capabilities(version);
+        Frame *reply = pool_.acquire(Frame::CMD_GET_VERSION);
+        reply->setFlags(Frame::FLAG_ACK);
+        reply->setData(version, sizeof(version));
+        transmit(reply);
+        pool_.release(reply);
+
+        // A host negotiating the link sends its capabilities, both sides
+        // switch once the reply is out
+        if(view.length >= VERSION_SIZE)
+        {
+            negotiate(view.payload, view.length);
         }
+        return;
+    }
 
-        try
+    if(view.length < 2)
+    {
+        return;
+    }
+
+    if(handshake_ == HS_VERSION)
+    {
+        negotiate(view.payload, view.length);
+        handshake_ = address_set_ ? HS_ADDRESS : HS_DONE;
+        handshake_retries_ = 0;
+        if(handshake_ == HS_DONE)
         {
-            Mutex::ScopedLock lock(mutex_);
+            linkReady();
+        }
+        else
+        {
+            sendHandshake();
+        }
+        return;
+    }
 
-            std::vector<uint8_t> buf;
-            f->serialize(buf);
-            serial_->send(buf.data(), buf.size());
+    uint8_t capabilities = (view.length >= 3) ? view.payload[2] : 0;
+    tx_compact_ = compact_ && (capabilities & CAP_COMPACT_HEADER);
+    logger_.information("Peer version %?u.%?u, %s frame header", uint32_t(view.payload[0]), uint32_t(view.payload[1]),
+            std::string(tx_compact_ ? "compact" : "legacy"));
+}
 
-            cond_.wait(mutex_, 1000);
+//------------------------------------------------------------------------------
+void Protocol::handleHandshake(const Frame::View &view)
+{
+    if((view.flags & Frame::FLAG_ACK) == 0)
+    {
+        // Requests of a host, answered like the dongle. The reset takes the
+        // link back to the configured settings, the reply already uses them.
+        if(view.command == Frame::CMD_RESET)
+        {
+            logger_.information("Reset by peer");
+            crc_ = crc_config_;
+            cobs_ = cobs_config_;
+            tx_compact_ = false;
+            rx_next_ = 0;
+            rx_mask_ = 0;
         }
-        catch(TimeoutException &te)
+        else if(view.length >= 2)
         {
-            logger_.warning(te.message());
+            address_ = view.payload[0] | (view.payload[1] << 8);
+            logger_.information("Address set to %?u by peer", uint32_t(address_));
         }
+
+        Frame *reply = pool_.acquire(view.command);
+        reply->setFlags(Frame::FLAG_ACK);
+        transmit(reply);
+        pool_.release(reply);
+        return;
+    }
+
+    if(view.command == Frame::CMD_RESET && handshake_ == HS_RESET)
+    {
+        handshake_ = HS_VERSION;
+        handshake_retries_ = 0;
+        sendHandshake();
+    }
+    else if(view.command == Frame::CMD_SET_ADDRESS && handshake_ == HS_ADDRESS)
+    {
+        handshake_ = HS_DONE;
+        linkReady();
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::sendHandshake()
+{
+    Frame *f = nullptr;
+    switch(handshake_)
+    {
+        case HS_RESET:
+            f = pool_.acquire(Frame::CMD_RESET);
+            break;
+        case HS_VERSION:
+        {
+            uint8_t version[VERSION_SIZE];
+            capabilities(version);
+            f = pool_.acquire(Frame::CMD_GET_VERSION);
+            f->setData(version, sizeof(version));
+            break;
+        }
+        case HS_ADDRESS:
+        {
+            uint8_t address[2] = { uint8_t(address_), uint8_t(address_ >> 8) };
+            f = pool_.acquire(Frame::CMD_SET_ADDRESS);
+            f->setData(address, sizeof(address));
+            break;
+        }
+        default:
+            return;
+    }
+
+    transmit(f);
+    pool_.release(f);
+    handshake_sent_.update();
+}
+
+//------------------------------------------------------------------------------
+long Protocol::handshakeExpired()
+{
+    if(handshake_ == HS_DONE)
+    {
+        return -1;
+    }
+
+    long remaining = long(HANDSHAKE_TIMEOUT) - long(handshake_sent_.elapsed() / 1000);
+    if(remaining > 0)
+    {
+        return remaining;
+    }
+
+    if(handshake_retries_ < HANDSHAKE_RETRIES)
+    {
+        handshake_retries_++;
+        sendHandshake();
+        return HANDSHAKE_TIMEOUT;
+    }
+
+    // Old firmware may not know the command, go on without it
+    handshake_retries_ = 0;
+    switch(handshake_)
+    {
+        case HS_RESET:
+            logger_.warning("No reply to reset, continuing");
+            handshake_ = HS_VERSION;
+            break;
+        case HS_VERSION:
+            logger_.warning("No reply to version request, using the configured settings");
+            handshake_ = address_set_ ? HS_ADDRESS : HS_DONE;
+            break;
+        default:
+            logger_.warning("No reply to set address, continuing");
+            handshake_ = HS_DONE;
+            break;
+    }
+
+    if(handshake_ == HS_DONE)
+    {
+        linkReady();
+        return -1;
+    }
+    sendHandshake();
+    return HANDSHAKE_TIMEOUT;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::capabilities(uint8_t *version) const
+{
+    // The receive path takes any frame the length field can describe
+    version[0] = MAJOR_VERSION;
+    version[1] = MINOR_VERSION;
+    version[2] = CAP_COMPACT_HEADER | CAP_COBS | CAP_CRC16 | CAP_CRC32C;
+    version[3] = 0xFF;
+    version[4] = 0xFF;
+    version[5] = MAX_WINDOW;
+    version[6] = 0;
+    version[7] = 0;
+    version[8] = 0;
+    version[9] = 0;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::negotiate(const uint8_t *version, uint32_t size)
+{
+    // Firmware without a capability list keeps the configured settings
+    if(size < VERSION_SIZE)
+    {
+        logger_.information("Peer version %?u.%?u, no capabilities", uint32_t(version[0]), uint32_t(version[1]));
+        return;
+    }
+
+    uint8_t caps = version[2];
+    crc_ = (caps & CAP_CRC32C) ? Crc::CRC_32C : (caps & CAP_CRC16) ? Crc::CRC_16 : Crc::CRC_XOR8;
+    cobs_ = caps & CAP_COBS;
+    tx_compact_ = caps & CAP_COMPACT_HEADER;
+    peer_max_frame_ = version[3] | (version[4] << 8);
+    peer_max_baud_ = version[6] | (version[7] << 8) | (version[8] << 16) | (uint32_t(version[9]) << 24);
+
+    logger_.information("Peer version %?u.%?u, max frame %?u bytes, window %?u, max baud %?u",
+            uint32_t(version[0]), uint32_t(version[1]), peer_max_frame_, uint32_t(version[5]), peer_max_baud_);
+
+    // Sending limits only apply to our side of the handshake
+    if(handshake_ != HS_VERSION)
+    {
+        return;
+    }
+
+    if(peer_max_baud_ > 0 && serial_->getBaudrate() > peer_max_baud_)
+    {
+        logger_.warning("Serial port runs at %?u baud, the dongle supports %?u at most", serial_->getBaudrate(),
+                peer_max_baud_);
+    }
+
+    uint32_t window = (version[5] < MAX_WINDOW) ? version[5] : MAX_WINDOW;
+    if(window > 0 && (window_size_ == 0 || window < window_size_))
+    {
+        window_size_ = window;
+    }
+    if(peer_max_frame_ > 0 && aggregate_size_ > peer_max_frame_)
+    {
+        aggregate_size_ = peer_max_frame_;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::linkReady()
+{
+    logger_.information("Link ready: %s, %s framing, %s header, window %?u, MTU %?u", Crc::typeName(crc_),
+            std::string(cobs_ ? "COBS" : "length"), std::string(tx_compact_ ? "compact" : "legacy"), window_size_,
+            getMtu());
+    if(listener_ != nullptr)
+    {
+        listener_->onLinkReady(this);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::receiveFec(Frame::View &view)
+{
+    if(!fec_.isEnabled())
+    {
+        logger_.warning("FEC frame dropped, FEC is not enabled");
+        return;
+    }
+
+    if(view.flags & Frame::FLAG_ACK)
+    {
+        fec_.handleReport(view);
+        return;
+    }
+
+    if(fec_.receive(view))
+    {
+        handleFrame(view);
+    }
+
+    Frame::View rebuilt;
+    while(fec_.getRebuilt(rebuilt))
+    {
+        handleFrame(rebuilt);
+    }
+
+    if(fec_.getReport(scratch_))
+    {
+        Frame *report = pool_.acquire(Frame::CMD_SEND);
+        report->setFlags(Frame::Flags(Frame::FLAG_ACK | Frame::FLAG_FEC));
+        report->setData(scratch_.data(), scratch_.size());
+        transmit(report);
+        pool_.release(report);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::portClosed()
+{
+    if(listener_ != nullptr)
+    {
+        listener_->onPortClosed(this);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::writeReady()
+{
+    if(tx_blocked_)
+    {
+        tx_blocked_ = false;
+        pump();
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::onEvent(int fd, uint32_t events)
+{
+    timer_.clear();
+    pump();
+}
+
+//------------------------------------------------------------------------------
+Frame *Protocol::takeFrame()
+{
+    if(!tx_fragments_.empty())
+    {
+        Frame *f = tx_fragments_.front();
+        tx_fragments_.pop_front();
+        return f;
+    }
+
+    Frame *f = pending_;
+    pending_ = nullptr;
+
+    if(f == nullptr)
+    {
+        if(tx_queue_.size() == 0)
+        {
+            return nullptr;
+        }
+
+        // Wait up to aggregate_delay_ for more packets, unless there are
+        // enough queued already to fill a frame
+        if(aggregate_size_ > 0 && tx_queue_.getBytes() < aggregate_size_)
+        {
+            if(!holding_)
+            {
+                holding_ = true;
+                hold_start_.update();
+            }
+            if(hold_start_.elapsed() < Timestamp::TimeDiff(aggregate_delay_) * 1000)
+            {
+                return nullptr;
+            }
+        }
+        holding_ = false;
+
+        // CoDel may have dropped everything that was queued
+        f = tx_queue_.take();
+        if(f == nullptr)
+        {
+            return nullptr;
+        }
+    }
+
+    if(aggregate_size_ > 0)
+    {
+        f = aggregate(f);
+    }
+
+    if(compression_ != nullptr)
+    {
+        compress(f);
+    }
+
+    uint32_t limit = getPayloadLimit();
+    if(limit > 0 && f->getLength() > limit)
+    {
+        fragment(f);
+        return takeFrame();
+    }
+    return f;
+}
+
+//------------------------------------------------------------------------------
+static void appendPacket(Frame *super, const Frame *packet)
+{
+    uint8_t len[2] = { uint8_t(packet->getLength() & 0xFF), uint8_t((packet->getLength() >> 8) & 0xFF) };
+    super->appendData(len, sizeof(len));
+    super->appendData(packet->getPayload(), packet->getLength());
+}
+
+//------------------------------------------------------------------------------
+Frame *Protocol::aggregate(Frame *f)
+{
+    // Aggregates are not made larger than a frame the RF link carries
+    uint32_t limit = getPayloadLimit();
+    limit = (limit > 0 && limit < aggregate_size_) ? limit : aggregate_size_;
+    if(f->getLength() + 2 > limit)
+    {
+        return f;
+    }
+
+    Frame *super = nullptr;
+    Frame *next = nullptr;
+    uint32_t size = f->getLength() + 2;
+    uint32_t count = 1;
+    while((next = tx_queue_.take()) != nullptr)
+    {
+        if(size + next->getLength() + 2 > limit)
+        {
+            pending_ = next;
+            break;
+        }
+
+        if(super == nullptr)
+        {
+            super = pool_.acquire(f->getCommand());
+            super->setFlags(Frame::Flags(f->getFlags() | Frame::FLAG_AGGREGATE));
+            appendPacket(super, f);
+        }
+
+        appendPacket(super, next);
+        size += next->getLength() + 2;
+        count++;
+        pool_.release(next);
+    }
+
+    if(super == nullptr)
+    {
+        return f;
+    }
+
+    logger_.debug("%?u packets aggregated into %?u bytes", count, size);
+    pool_.release(f);
+
+    return super;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::compress(Frame *f)
+{
+    if(compression_->compress(f->getPayload(), f->getLength(), scratch_))
+    {
+        f->setData(scratch_.data(), scratch_.size());
+        f->setFlags(Frame::Flags(f->getFlags() | Frame::FLAG_COMPRESSED));
+    }
+}
+
+//------------------------------------------------------------------------------
+uint32_t Protocol::getPayloadLimit() const
+{
+    // FEC adds to the data frames and more to their parity frames
+    uint32_t mtu = getMtu();
+    return (mtu > 0) ? mtu - fec_.getOverhead() : 0;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::fragment(Frame *f)
+{
+    uint32_t chunk = getPayloadLimit() - FRAGMENT_HEADER;
+    uint32_t length = f->getLength();
+    uint32_t count = (length + chunk - 1) / chunk;
+    if(count > MAX_FRAGMENTS)
+    {
+        logger_.warning("Frame with %?u bytes needs more than %?u fragments, dropped", length,
+                uint32_t(MAX_FRAGMENTS));
+        pool_.release(f);
+        return;
+    }
+
+    // Fragments keep the flags, the receiver applies them to the whole frame
+    uint8_t id = tx_fragment_id_++;
+    for(uint32_t index = 0, offset = 0; index < count; index++, offset += chunk)
+    {
+        uint8_t header[FRAGMENT_HEADER] = { id, uint8_t(index | ((index + 1 == count) ? LAST_FRAGMENT : 0)),
+                                            uint8_t(offset & 0xFF), uint8_t((offset >> 8) & 0xFF) };
+        Frame *part = pool_.acquire(f->getCommand());
+        part->setFlags(Frame::Flags(f->getFlags() | Frame::FLAG_FRAGMENT));
+        part->setData(header, sizeof(header));
+        part->appendData(f->getPayload() + offset, std::min(chunk, length - offset));
+        tx_fragments_.push_back(part);
+    }
+
+    logger_.debug("Frame with %?u bytes sent in %?u fragments", length, count);
+    pool_.release(f);
+}
+
+//------------------------------------------------------------------------------
+Protocol::Reassembly *Protocol::findReassembly(uint8_t id)
+{
+    Reassembly *slot = nullptr;
+    for(uint32_t i = 0; i < REASSEMBLY_SLOTS; i++)
+    {
+        Reassembly &r = rx_reassembly_[i];
+        if(r.used && r.id == id)
+        {
+            return &r;
+        }
+
+        // A free slot, otherwise the oldest one
+        if(slot == nullptr || (slot->used && (!r.used || r.started < slot->started)))
+        {
+            slot = &r;
+        }
+    }
+
+    if(slot->used)
+    {
+        rx_incomplete_++;
+        logger_.warning("Incomplete frame %?u dropped (%?u incomplete)", uint32_t(slot->id), rx_incomplete_);
+    }
+
+    slot->used = true;
+    slot->id = id;
+    slot->received = 0;
+    slot->count = 0;
+    slot->size = 0;
+    slot->started.update();
+    return slot;
+}
+
+//------------------------------------------------------------------------------
+long Protocol::reassemblyExpired()
+{
+    long next = -1;
+    for(uint32_t i = 0; i < REASSEMBLY_SLOTS; i++)
+    {
+        Reassembly &r = rx_reassembly_[i];
+        if(!r.used)
+        {
+            continue;
+        }
+
+        long remaining = long(REASSEMBLY_TIMEOUT) - long(r.started.elapsed() / 1000);
+        if(remaining > 0)
+        {
+            next = (next < 0 || remaining < next) ? remaining : next;
+            continue;
+        }
+
+        // Up to 64 KB, don't keep it for a frame that never completes
+        rx_incomplete_++;
+        logger_.warning("Incomplete frame %?u timed out (%?u incomplete)", uint32_t(r.id), rx_incomplete_);
+        r.used = false;
+        std::vector<uint8_t>().swap(r.data);
+    }
+    return next;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::reassemble(const Frame::View &view)
+{
+    if(view.length < FRAGMENT_HEADER)
+    {
+        logger_.warning("Fragment without header dropped");
+        return;
+    }
+
+    const uint8_t *header = view.payload;
+    uint32_t index = header[1] & ~LAST_FRAGMENT;
+    uint32_t offset = header[2] | (header[3] << 8);
+    uint32_t length = view.length - FRAGMENT_HEADER;
+    if(index >= MAX_FRAGMENTS || offset + length > 0xFFFF)
+    {
+        logger_.warning("Invalid fragment %?u at %?u dropped", index, offset);
+        return;
+    }
+
+    Reassembly *slot = findReassembly(header[0]);
+    uint64_t bit = uint64_t(1) << index;
+    if(slot->received & bit)
+    {
+        return;
+    }
+
+    if(slot->data.size() < offset + length)
+    {
+        slot->data.resize(offset + length);
+    }
+    memcpy(slot->data.data() + offset, view.payload + FRAGMENT_HEADER, length);
+    slot->received |= bit;
+    if(header[1] & LAST_FRAGMENT)
+    {
+        slot->count = index + 1;
+        slot->size = offset + length;
+    }
+
+    uint64_t all = (slot->count == 64) ? ~uint64_t(0) : (uint64_t(1) << slot->count) - 1;
+    if(slot->count == 0 || slot->received != all)
+    {
+        return;
+    }
+
+    Frame::View whole = view;
+    whole.flags = Frame::Flags(view.flags & ~Frame::FLAG_FRAGMENT);
+    whole.length = slot->size;
+    whole.payload = slot->data.data();
+    slot->used = false;
+    deliver(whole);
+}
+
+//------------------------------------------------------------------------------
+void Protocol::deliver(const Frame::View &view)
+{
+    if(listener_ == nullptr)
+    {
+        return;
+    }
+
+    if(view.flags & Frame::FLAG_FRAGMENT)
+    {
+        reassemble(view);
+        return;
+    }
+
+    const uint8_t *data = view.payload;
+    uint32_t size = view.length;
+
+    if(view.flags & Frame::FLAG_COMPRESSED)
+    {
+        if(compression_ == nullptr || !compression_->decompress(data, size, rx_scratch_))
+        {
+            logger_.warning("Cannot decompress frame, %?u bytes dropped", size);
+            return;
+        }
+        data = rx_scratch_.data();
+        size = rx_scratch_.size();
+    }
+
+    if((view.flags & Frame::FLAG_AGGREGATE) == 0)
+    {
+        listener_->onPacketReceived(data, size);
+        return;
+    }
+
+    uint32_t pos = 0;
+    while(pos + 2 <= size)
+    {
+        uint32_t len = data[pos] | (data[pos + 1] << 8);
+        pos += 2;
+        if(pos + len > size)
+        {
+            logger_.warning("Truncated aggregate frame: %?u bytes missing", pos + len - size);
+            break;
+        }
+
+        listener_->onPacketReceived(data + pos, len);
+        pos += len;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::transmit(Frame *f)
+{
+    uint32_t size;
+    const uint8_t *buf = f->serialize(size, crc_, tx_compact_);
+    if(cobs_)
+    {
+        tx_encoded_.resize(Cobs::maxEncodedSize(size) + 1);
+        uint32_t encoded = Cobs::encode(buf, size, tx_encoded_.data());
+        tx_encoded_[encoded++] = Cobs::DELIMITER;
+        buf = tx_encoded_.data();
+        size = encoded;
+    }
+    serial_->send(buf, size);
+    tx_bytes_ += size;
+    shaper_.consume(size);
+}
+
+//------------------------------------------------------------------------------
+void Protocol::pump()
+{
+    if(reactor_ == nullptr)
+    {
+        return;
+    }
+
+    // Data waits until the link parameters are settled
+    if(handshake_ != HS_DONE)
+    {
+        long wait = handshakeExpired();
+        if(handshake_ != HS_DONE)
+        {
+            serial_->flush();
+            timer_.start(wait);
+            return;
+        }
+    }
+
+    long next = (window_size_ == 0) ? ackExpired() : retransmitExpired();
+
+    long expire = reassemblyExpired();
+    if(expire >= 0 && (next < 0 || expire < next))
+    {
+        next = expire;
+    }
+
+    bool open;
+    while((open = (window_size_ == 0) ? !ack_pending_ : inFlight() < window_size_))
+    {
+        // The port is behind, continue when its writes are done
+        if(serial_->getQueued() >= Serial::MAX_QUEUED)
+        {
+            tx_blocked_ = true;
+            open = false;
+            break;
+        }
+
+        // Paced to the RF rate, continue when the bucket has been refilled
+        long wait = shaper_.delay();
+        if(wait > 0)
+        {
+            if(tx_queue_.size() > 0 || pending_ != nullptr || !tx_fragments_.empty())
+            {
+                next = (next < 0 || wait < next) ? wait : next;
+            }
+            open = false;
+            break;
+        }
+
+        Frame *f = takeFrame();
+        if(f == nullptr)
+        {
+            break;
+        }
+
+        if(window_size_ == 0)
+        {
+            if(fec_.isEnabled())
+            {
+                fec_.protect(f);
+            }
+            transmit(f);
+            ack_frame_ = f;
+            ack_retries_ = 0;
+            ack_resent_ = false;
+            ack_pending_ = true;
+            ack_sent_.update();
+            ack_inflight_ = uint32_t(tx_bytes_ - tx_acked_bytes_);
+        }
+        else
+        {
+            f->setFlags(Frame::Flags(f->getFlags() | Frame::FLAG_SEQ));
+            f->setSequence(tx_next_);
+
+            TxSlot &slot = tx_window_[tx_next_];
+            slot.frame = f;
+            slot.retries = 0;
+            slot.resent = false;
+            slot.sent.update();
+            tx_next_++;
+
+            // Retransmissions keep the trailer, they still belong to the group
+            if(fec_.isEnabled())
+            {
+                fec_.protect(f);
+            }
+            transmit(f);
+            slot.bytes = tx_bytes_;
+            slot.inflight = uint32_t(tx_bytes_ - tx_acked_bytes_);
+        }
+
+        if(fec_.groupFull())
+        {
+            sendParity();
+        }
+
+        if(next < 0)
+        {
+            next = rto_;
+        }
+    }
+
+    // Close a group that does not fill up, its frames are unprotected until then
+    long flush = fec_.flushDelay();
+    if(flush == 0)
+    {
+        sendParity();
+    }
+    else if(flush > 0 && (next < 0 || flush < next))
+    {
+        next = flush;
+    }
+
+    // Held packets are only due once they could be sent
+    if(open && holding_)
+    {
+        long remaining = long(aggregate_delay_) - long(hold_start_.elapsed() / 1000);
+        if(remaining < 0)
+        {
+            remaining = 0;
+        }
+        if(next < 0 || remaining < next)
+        {
+            next = remaining;
+        }
+    }
+
+    // One write for the whole batch
+    serial_->flush();
+    timer_.start(next);
+}
+
+//------------------------------------------------------------------------------
+void Protocol::sendParity()
+{
+    // Parity frames are not sequenced, FEC is their only use
+    fec_.finishGroup(pool_, fec_parity_);
+    for(Frame *f : fec_parity_)
+    {
+        transmit(f);
+        pool_.release(f);
+    }
+    fec_parity_.clear();
+}
+
+//------------------------------------------------------------------------------
+long Protocol::ackExpired()
+{
+    if(!ack_pending_)
+    {
+        return -1;
+    }
+
+    long remaining = rto_ - long(ack_sent_.elapsed() / 1000);
+    if(remaining <= 0)
+    {
+        logger_.debug("No ACK within %?u ms", uint32_t(rto_));
+        backoff();
+        shaper_.onTimeout();
+
+        if(ack_retries_ >= max_retries_)
+        {
+            logger_.warning("No ACK after %?u retries, frame dropped", ack_retries_);
+            pool_.release(ack_frame_);
+            ack_frame_ = nullptr;
+            ack_pending_ = false;
+            return -1;
+        }
+
+        ack_retries_++;
+        ack_sent_.update();
+        transmit(ack_frame_);
+        remaining = rto_;
+    }
+    return remaining;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Protocol::inFlight() const
+{
+    return uint8_t(tx_next_ - tx_base_);
+}
+
+//------------------------------------------------------------------------------
+long Protocol::retransmitExpired()
+{
+    long next = -1;
+    bool expired = false;
+
+    for(uint8_t seq = tx_base_; seq != tx_next_; seq++)
+    {
+        TxSlot &slot = tx_window_[seq];
+        if(slot.frame == nullptr)
+        {
+            continue;
+        }
+
+        long remaining = rto_ - long(slot.sent.elapsed() / 1000);
+        if(remaining <= 0)
+        {
+            // One loss event, however many frames of the window it hit
+            if(!expired)
+            {
+                expired = true;
+                backoff();
+                shaper_.onTimeout();
+            }
+
+            if(slot.retries >= max_retries_)
+            {
+                logger_.warning("Frame %?u dropped after %?u retries", seq, slot.retries);
+                pool_.release(slot.frame);
+                slot.frame = nullptr;
+                continue;
+            }
+
+            logger_.debug("Retransmit frame %?u", seq);
+            slot.retries++;
+            slot.sent.update();
+            transmit(slot.frame);
+            remaining = rto_;
+        }
+
+        if(next < 0 || remaining < next)
+        {
+            next = remaining;
+        }
+    }
+
+    while(tx_base_ != tx_next_ && tx_window_[tx_base_].frame == nullptr)
+    {
+        tx_base_++;
+    }
+
+    return next;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::sampleRtt(Timestamp::TimeDiff rtt, uint32_t inflight)
+{
+    if(srtt_ < 0)
+    {
+        srtt_ = rtt;
+        rttvar_ = rtt / 2;
+    }
+    else
+    {
+        Timestamp::TimeDiff error = (srtt_ > rtt) ? srtt_ - rtt : rtt - srtt_;
+        rttvar_ = (3 * rttvar_ + error) / 4;
+        srtt_ = (7 * srtt_ + rtt) / 8;
+    }
+
+    // At least one timer tick of variance
+    long rto = long((srtt_ + std::max(Timestamp::TimeDiff(1000), 4 * rttvar_)) / 1000);
+    rto_ = std::min(std::max(rto, long(MIN_RTO)), long(MAX_RTO));
+
+    shaper_.onAck(rtt, inflight);
+}
+
+//------------------------------------------------------------------------------
+void Protocol::backoff()
+{
+    rto_ = std::min(rto_ * 2, long(MAX_RTO));
+    logger_.debug("RTO backed off to %?u ms", uint32_t(rto_));
+}
+
+//------------------------------------------------------------------------------
+void Protocol::handleAck(const Frame::View &view)
+{
+    uint8_t ack = view.sequence;
+    uint32_t pending = inFlight();
+
+    // Round trip of the newest frame acknowledged, retransmitted frames are
+    // ambiguous and not sampled
+    Timestamp::TimeDiff rtt = -1;
+    uint32_t inflight = 0;
+
+    // Cumulative part: everything before ack has been received
+    if(uint8_t(ack - tx_base_) <= pending)
+    {
+        for(uint8_t seq = tx_base_; seq != ack; seq++)
+        {
+            TxSlot &slot = tx_window_[seq];
+            if(slot.frame != nullptr && slot.retries == 0 && !slot.resent)
+            {
+                rtt = slot.sent.elapsed();
+                inflight = slot.inflight;
+                tx_acked_bytes_ = std::max(tx_acked_bytes_, slot.bytes);
+            }
+            pool_.release(slot.frame);
+            slot.frame = nullptr;
+        }
+    }
+
+    // Selective part: bit i acknowledges frame ack+1+i
+    const uint8_t *data = view.payload;
+    if(view.length >= 4)
+    {
+        uint32_t mask = data[0] | (data[1] << 8) | (data[2] << 16) | (uint32_t(data[3]) << 24);
+        for(uint32_t i = 0; mask != 0; i++, mask >>= 1)
+        {
+            uint8_t seq = ack + 1 + i;
+            if((mask & 1) && uint8_t(seq - tx_base_) < pending)
+            {
+                TxSlot &slot = tx_window_[seq];
+                if(slot.frame != nullptr && slot.retries == 0 && !slot.resent)
+                {
+                    rtt = slot.sent.elapsed();
+                    inflight = slot.inflight;
+                    tx_acked_bytes_ = std::max(tx_acked_bytes_, slot.bytes);
+                }
+                pool_.release(slot.frame);
+                slot.frame = nullptr;
+            }
+        }
+    }
+
+    while(tx_base_ != tx_next_ && tx_window_[tx_base_].frame == nullptr)
+    {
+        tx_base_++;
+    }
+
+    if(rtt >= 0)
+    {
+        sampleRtt(rtt, inflight);
+    }
+
+    // Bit i of the NAK mask asks for frame ack+i again
+    if((view.flags & Frame::FLAG_NAK) && view.length >= 8)
+    {
+        uint32_t nak = data[4] | (data[5] << 8) | (data[6] << 16) | (uint32_t(data[7]) << 24);
+        for(uint32_t i = 0; nak != 0; i++, nak >>= 1)
+        {
+            uint8_t seq = ack + i;
+            if((nak & 1) && uint8_t(seq - tx_base_) < inFlight())
+            {
+                fastRetransmit(seq);
+            }
+        }
+    }
+
+    logger_.debug("Serial ACK %?u, %?u in flight", ack, inFlight());
+}
+
+//------------------------------------------------------------------------------
+void Protocol::fastRetransmit(uint8_t seq)
+{
+    TxSlot &slot = tx_window_[seq];
+    if(slot.frame == nullptr)
+    {
+        return;
+    }
+
+    // Several NAKs may report the same loss, resend at most once per round
+    // trip. Without a sample yet the RTO is the only estimate.
+    Timestamp::TimeDiff interval = srtt_ >= 0 ? srtt_ : Timestamp::TimeDiff(rto_) * 1000;
+    if(slot.sent.elapsed() < interval)
+    {
+        return;
+    }
+
+    // The peer answered, so this is no timeout and does not use up a retry
+    logger_.debug("NAK, retransmit frame %?u", seq);
+    slot.resent = true;
+    slot.sent.update();
+    transmit(slot.frame);
+    tx_fast_retransmits_++;
+}
+
+//------------------------------------------------------------------------------
+bool Protocol::handleSequenced(const Frame::View &view)
+{
+    uint8_t offset = view.sequence - rx_next_;
+    bool deliver = false;
+
+    if(offset < 128)
+    {
+        // Sender moved past frames we never got, slide the window forward
+        bool received = false;
+        while(offset >= MAX_WINDOW || (offset > 0 && received))
+        {
+            received = rx_mask_ & 1;
+            rx_mask_ >>= 1;
+            rx_next_++;
+            offset--;
+        }
+
+        if(offset == 0)
+        {
+            deliver = !received;
+            received = true;
+            while(received)
+            {
+                received = rx_mask_ & 1;
+                rx_mask_ >>= 1;
+                rx_next_++;
+            }
+        }
+        else if((rx_mask_ & (1u << (offset - 1))) == 0)
+        {
+            rx_mask_ |= 1u << (offset - 1);
+            deliver = true;
+        }
+    }
+
+    // A new highest frame reveals the frames missing before it, ask for
+    // them right away instead of waiting for the sender's timeout
+    uint32_t nak = 0;
+    offset = view.sequence - rx_next_;
+    if(deliver && !fec_.isEnabled() && offset > 0 && offset < MAX_WINDOW && (rx_mask_ >> offset) == 0)
+    {
+        nak = 1;
+        for(uint32_t i = 1; i < offset; i++)
+        {
+            if((rx_mask_ & (1u << (i - 1))) == 0)
+            {
+                nak |= 1u << i;
+            }
+        }
+    }
+
+    sendAck(nak);
+    return deliver;
+}
+
+//------------------------------------------------------------------------------
+void Protocol::corrupted(const Frame::View &view)
+{
+    // The header has its own check, so the sequence number can be trusted.
+    // With FEC the frame is likely rebuilt from the parity of its group.
+    if((view.flags & Frame::FLAG_SEQ) == 0 || (view.flags & Frame::FLAG_ACK) || window_size_ == 0 ||
+       fec_.isEnabled())
+    {
+        return;
+    }
+
+    uint8_t offset = view.sequence - rx_next_;
+    if(offset < MAX_WINDOW && (offset == 0 || (rx_mask_ & (1u << (offset - 1))) == 0))
+    {
+        sendAck(1u << offset);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Protocol::sendAck(uint32_t nak)
+{
+    Frame *ack = pool_.acquire(Frame::CMD_SEND);
+    uint8_t mask[8] = { uint8_t(rx_mask_), uint8_t(rx_mask_ >> 8), uint8_t(rx_mask_ >> 16), uint8_t(rx_mask_ >> 24),
+                        uint8_t(nak), uint8_t(nak >> 8), uint8_t(nak >> 16), uint8_t(nak >> 24) };
+
+    // A NAK is an ACK with a second mask, peers without NAK support read
+    // it as a plain ACK
+    if(nak != 0)
+    {
+        ack->setFlags(Frame::Flags(Frame::FLAG_ACK | Frame::FLAG_NAK | Frame::FLAG_SEQ));
+        ack->setData(mask, sizeof(mask));
+        rx_naks_++;
+    }
+    else
+    {
+        ack->setFlags(Frame::Flags(Frame::FLAG_ACK | Frame::FLAG_SEQ));
+        ack->setData(mask, 4);
     }
-    logger_.error("Protocol closed");
+    ack->setSequence(rx_next_);
+    transmit(ack);
+    pool_.release(ack);
 }
@@ -0,0 +1,254 @@
+/*
+ * reactor.cpp
+ *
+ *  Created on: 24.04.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "reactor.h"
+
+#include <Poco/Exception.h>
+
+#include <string>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using namespace Poco;
+
+//------------------------------------------------------------------------------
+Reactor::Timer::Timer() :
+    fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+{
+    if(fd_ < 0)
+    {
+        throw SystemException("Cannot create timerfd");
+    }
+}
+
+//------------------------------------------------------------------------------
+Reactor::Timer::~Timer()
+{
+    ::close(fd_);
+}
+
+//------------------------------------------------------------------------------
+int Reactor::Timer::getFd() const
+{
+    return fd_;
+}
+
+//------------------------------------------------------------------------------
+void Reactor::Timer::start(long timeout)
+{
+    if(timeout < 0)
+    {
+        stop();
+        return;
+    }
+
+    struct itimerspec spec = {};
+    // A zero it_value would disarm the timer
+    spec.it_value.tv_sec = timeout / 1000;
+    spec.it_value.tv_nsec = (timeout % 1000) * 1000000 + 1;
+    timerfd_settime(fd_, 0, &spec, nullptr);
+}
+
+//------------------------------------------------------------------------------
+void Reactor::Timer::stop()
+{
+    struct itimerspec spec = {};
+    timerfd_settime(fd_, 0, &spec, nullptr);
+}
+
+//------------------------------------------------------------------------------
+void Reactor::Timer::clear()
+{
+    uint64_t expirations;
+    if(read(fd_, &expirations, sizeof(expirations)) < 0)
+    {
+        // Not expired or already cleared
+    }
+}
+
+//------------------------------------------------------------------------------
+Reactor::Reactor() :
+    logger_(Logger::get("Reactor")),
+    epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+    stop_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    running_(false),
+    uring_(nullptr)
+{
+    if(epoll_fd_ < 0 || stop_fd_ < 0)
+    {
+        throw SystemException("Cannot create event loop");
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = stop_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &event);
+}
+
+//------------------------------------------------------------------------------
+Reactor::~Reactor()
+{
+    delete uring_;
+    ::close(stop_fd_);
+    ::close(epoll_fd_);
+}
+
+//------------------------------------------------------------------------------
+bool Reactor::enableUring(uint32_t entries)
+{
+    if(uring_ != nullptr)
+    {
+        return true;
+    }
+
+    try
+    {
+        uring_ = new Uring(entries);
+    }
+    catch(SystemException &e)
+    {
+        logger_.warning("%s, using epoll", e.displayText());
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+Uring *Reactor::getUring() const
+{
+    return uring_;
+}
+
+//------------------------------------------------------------------------------
+void Reactor::add(int fd, uint32_t events, Handler *handler)
+{
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    if(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        throw SystemException("Cannot watch fd", errno);
+    }
+
+    if(uint32_t(fd) >= handlers_.size())
+    {
+        handlers_.resize(fd + 1, nullptr);
+    }
+    handlers_[fd] = handler;
+}
+
+//------------------------------------------------------------------------------
+void Reactor::modify(int fd, uint32_t events)
+{
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event);
+}
+
+//------------------------------------------------------------------------------
+void Reactor::remove(int fd)
+{
+    if(fd < 0 || uint32_t(fd) >= handlers_.size())
+    {
+        return;
+    }
+
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    handlers_[fd] = nullptr;
+}
+
+//------------------------------------------------------------------------------
+void Reactor::run()
+{
+    running_ = true;
+
+    if(uring_ == nullptr)
+    {
+        while(running_ && dispatch(-1))
+        {
+        }
+        return;
+    }
+
+    uring_->poll(epoll_fd_, POLLIN, this, 0);
+    while(running_ && uring_->submit(1))
+    {
+        uring_->complete();
+    }
+}
+
+//------------------------------------------------------------------------------
+void Reactor::onComplete(int32_t result, uint32_t tag)
+{
+    // The epoll set became readable
+    if(!dispatch(0))
+    {
+        running_ = false;
+    }
+    else if(running_)
+    {
+        uring_->poll(epoll_fd_, POLLIN, this, 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+bool Reactor::dispatch(int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    int count = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+    if(count < 0)
+    {
+        if(errno == EINTR)
+        {
+            return true;
+        }
+        logger_.error("epoll_wait failed: %d", errno);
+        return false;
+    }
+
+    for(int i = 0; i < count && running_; i++)
+    {
+        int fd = events[i].data.fd;
+        if(fd == stop_fd_)
+        {
+            running_ = false;
+            break;
+        }
+
+        // The handler may have been removed by an earlier event
+        if(uint32_t(fd) >= handlers_.size() || handlers_[fd] == nullptr)
+        {
+            continue;
+        }
+
+        try
+        {
+            handlers_[fd]->onEvent(fd, events[i].events);
+        }
+        catch(std::exception &e)
+        {
+            logger_.error("Event handler for fd %d failed: %s", fd, std::string(e.what()));
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+void Reactor::stop()
+{
+    uint64_t value = 1;
+    if(write(stop_fd_, &value, sizeof(value)) < 0)
+    {
+        // Already stopping
+    }
+}
@@ -0,0 +1,129 @@
+/*
+ * ring_buffer.cpp
+ *
+ *  Created on: 09.04.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "ring_buffer.h"
+
+#include <Poco/Exception.h>
+
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace Poco;
+
+//------------------------------------------------------------------------------
+RingBuffer::RingBuffer(uint32_t capacity) :
+    buffer_(nullptr),
+    capacity_(sysconf(_SC_PAGESIZE)),
+    head_(0),
+    tail_(0)
+{
+    while(capacity_ < capacity)
+    {
+        capacity_ <<= 1;
+    }
+
+    int fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+    if(fd < 0 || ftruncate(fd, capacity_) < 0)
+    {
+        if(fd >= 0)
+        {
+            ::close(fd);
+        }
+        throw SystemException("Cannot create ring buffer memory");
+    }
+
+    void *addr = mmap(nullptr, 2 * capacity_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED ||
+       mmap(addr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+       mmap((uint8_t *)addr + capacity_, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        if(addr != MAP_FAILED)
+        {
+            munmap(addr, 2 * capacity_);
+        }
+        ::close(fd);
+        throw SystemException("Cannot map ring buffer");
+    }
+
+    ::close(fd);
+    buffer_ = (uint8_t *)addr;
+}
+
+//------------------------------------------------------------------------------
+RingBuffer::~RingBuffer()
+{
+    munmap(buffer_, 2 * capacity_);
+}
+
+//------------------------------------------------------------------------------
+void RingBuffer::clear()
+{
+    head_ = tail_ = 0;
+}
+
+//------------------------------------------------------------------------------
+uint32_t RingBuffer::capacity() const
+{
+    return capacity_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t RingBuffer::size() const
+{
+    return head_ - tail_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t RingBuffer::available() const
+{
+    return capacity_ - size();
+}
+
+//------------------------------------------------------------------------------
+const uint8_t *RingBuffer::readPtr() const
+{
+    return buffer_ + (tail_ & (capacity_ - 1));
+}
+
+//------------------------------------------------------------------------------
+uint8_t *RingBuffer::readPtr()
+{
+    return buffer_ + (tail_ & (capacity_ - 1));
+}
+
+//------------------------------------------------------------------------------
+void RingBuffer::consume(uint32_t size)
+{
+    tail_ += (size < this->size()) ? size : this->size();
+}
+
+//------------------------------------------------------------------------------
+uint8_t *RingBuffer::writePtr()
+{
+    return buffer_ + (head_ & (capacity_ - 1));
+}
+
+//------------------------------------------------------------------------------
+void RingBuffer::commit(uint32_t size)
+{
+    head_ += (size < available()) ? size : available();
+}
+
+//------------------------------------------------------------------------------
+bool RingBuffer::write(const uint8_t *data, uint32_t size)
+{
+    if(size > available())
+    {
+        return false;
+    }
+
+    memcpy(writePtr(), data, size);
+    head_ += size;
+    return true;
+}
@@ -7,13 +7,17 @@
 
 #include "serial.h"
 
-#include <Poco/NumberFormatter.h>
-
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
-#include <termios.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/ioctl.h>
+
+// termios2 for arbitrary rates, <termios.h> must not be included with it
+#include <asm/termbits.h>
+#include <linux/serial.h>
 
 using namespace Poco;
 
@@ -21,9 +25,18 @@ using namespace Poco;
 Serial::Serial() :
     logger_(Logger::get("Serial")),
     fd_(-1),
-    running_(false),
-    thread_(nullptr),
-    listener_(nullptr)
+    reactor_(nullptr),
+    listener_(nullptr),
+    uring_(nullptr),
+    rx_target_(rx_),
+    tx_offset_(0),
+    tx_waiting_(false),
+    tx_writes_(0),
+    tx_bytes_(0),
+    baudrate_(0),
+    low_latency_(true),
+    vmin_(0),
+    vtime_(0)
 {
 
 }
@@ -47,11 +60,27 @@ int Serial::getFd() const
 }
 
 //------------------------------------------------------------------------------
-bool Serial::open(const std::string &device, int baudrate)
+void Serial::setLowLatency(bool enable)
+{
+    low_latency_ = enable;
+}
+
+//------------------------------------------------------------------------------
+void Serial::setReadTiming(uint8_t vmin, uint8_t vtime)
+{
+    vmin_ = vmin;
+    vtime_ = vtime;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Serial::getBaudrate() const
 {
-    struct termios tty;
-    int baud = B115200;
+    return baudrate_;
+}
 
+//------------------------------------------------------------------------------
+bool Serial::open(const std::string &device, uint32_t baudrate)
+{
     fd_ = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_NDELAY);
     if(fd_ == -1)
     {
@@ -59,30 +88,66 @@ bool Serial::open(const std::string &device, int baudrate)
         return false;
     }
 
-    tcgetattr(fd_, &tty);
-    tty.c_cflag = CS8 | CREAD | CLOCAL;
+    // BOTHER takes the rate as a number, so any rate the driver can divide
+    // down to works, not only the Bxxx constants
+    struct termios2 tty;
+    if(ioctl(fd_, TCGETS2, &tty) < 0)
+    {
+        logger_.error("Cannot read the settings of %s: %s", device, std::string(strerror(errno)));
+        close();
+        return false;
+    }
+
+    tty.c_cflag = CS8 | CREAD | CLOCAL | BOTHER | (BOTHER << IBSHIFT);
     tty.c_iflag = 0;
     tty.c_oflag = 0;
     tty.c_lflag = 0;
-    tty.c_cc[VMIN] = 3;
-    tty.c_cc[VTIME] = 5;
+    tty.c_ispeed = baudrate;
+    tty.c_ospeed = baudrate;
+
+    // Reads return what has arrived, VMIN/VTIME > 0 only delays the reactor
+    tty.c_cc[VMIN] = vmin_;
+    tty.c_cc[VTIME] = vtime_;
 
-    switch(baudrate)
+    if(ioctl(fd_, TCSETSF2, &tty) < 0 || ioctl(fd_, TCGETS2, &tty) < 0)
     {
-        case 9600:   baud = B9600;   break;
-        case 19200:  baud = B19200;  break;
-        case 38400:  baud = B38400;  break;
-        case 57600:  baud = B57600;  break;
-        case 115200: baud = B115200; break;
-        default:
-            baud = B38400;
+        logger_.error("Cannot set %?u baud on %s: %s", baudrate, device, std::string(strerror(errno)));
+        close();
+        return false;
     }
 
-    cfsetospeed(&tty, baud);
-    cfsetispeed(&tty, baud);
+    // The driver picks the closest rate it can generate, UARTs tolerate a
+    // few percent
+    baudrate_ = tty.c_ospeed;
+    if(uint32_t(std::abs(int64_t(baudrate_) - int64_t(baudrate))) > baudrate / MAX_BAUD_ERROR)
+    {
+        logger_.error("%s runs at %?u baud instead of %?u", device, baudrate_, baudrate);
+        close();
+        return false;
+    }
+    logger_.information("%s: %?u baud", device, baudrate_);
 
-    tcsetattr(fd_, TCSANOW, &tty);
-    tcsetattr(fd_, TCSAFLUSH, &tty);
+    // Without it, USB serial drivers may hold received bytes for up to 16 ms
+    struct serial_struct serial;
+    if(ioctl(fd_, TIOCGSERIAL, &serial) == 0)
+    {
+        if(low_latency_)
+        {
+            serial.flags |= ASYNC_LOW_LATENCY;
+        }
+        else
+        {
+            serial.flags &= ~ASYNC_LOW_LATENCY;
+        }
+        if(ioctl(fd_, TIOCSSERIAL, &serial) < 0)
+        {
+            logger_.warning("Cannot set low latency mode on %s", device);
+        }
+    }
+    else
+    {
+        logger_.debug("%s has no low latency mode", device);
+    }
 
     return true;
 }
@@ -90,12 +155,27 @@ bool Serial::open(const std::string &device, int baudrate)
 //------------------------------------------------------------------------------
 void Serial::close()
 {
-    if(thread_)
+    if(fd_ >= 0)
     {
-        running_ = false;
-        thread_ = nullptr;
+        if(reactor_)
+        {
+            reactor_->remove(fd_);
+            reactor_ = nullptr;
+        }
+        uring_ = nullptr;
         ::close(fd_);
         fd_ = -1;
+
+        uint32_t queued = getQueued();
+        if(queued > 0)
+        {
+            logger_.warning("%?u queued bytes not written", queued);
+        }
+        tx_pending_.clear();
+        tx_inflight_.clear();
+        tx_offset_ = 0;
+        tx_waiting_ = false;
+        logger_.information("%?u bytes written in %?u writes", tx_bytes_, tx_writes_);
     }
     logger_.information("closed");
 }
@@ -109,7 +189,97 @@ int32_t Serial::send(const std::vector<uint8_t> &data)
 //------------------------------------------------------------------------------
 int32_t Serial::send(const uint8_t *data, uint32_t size)
 {
-    return ::write(fd_, data, size);
+    tx_pending_.insert(tx_pending_.end(), data, data + size);
+    if(tx_pending_.size() >= FLUSH_SIZE)
+    {
+        flush();
+    }
+    return size;
+}
+
+//------------------------------------------------------------------------------
+void Serial::flush()
+{
+    // A write in flight picks up the pending data when it is done
+    if(fd_ < 0 || tx_pending_.empty() || !tx_inflight_.empty())
+    {
+        return;
+    }
+
+    tx_inflight_.swap(tx_pending_);
+    tx_pending_.clear();
+    tx_offset_ = 0;
+
+    if(uring_ != nullptr)
+    {
+        if(uring_->write(fd_, tx_inflight_.data(), tx_inflight_.size(), this, TAG_WRITE))
+        {
+            tx_writes_++;
+            return;
+        }
+        // Ring is full, fall back to a blocking write
+    }
+
+    writeInflight();
+}
+
+//------------------------------------------------------------------------------
+uint32_t Serial::getQueued() const
+{
+    return tx_pending_.size() + tx_inflight_.size() - tx_offset_;
+}
+
+//------------------------------------------------------------------------------
+void Serial::writeInflight()
+{
+    while(tx_offset_ < tx_inflight_.size())
+    {
+        ssize_t len = ::write(fd_, tx_inflight_.data() + tx_offset_, tx_inflight_.size() - tx_offset_);
+        if(len > 0)
+        {
+            tx_offset_ += len;
+            tx_bytes_ += len;
+            tx_writes_++;
+            continue;
+        }
+        if(len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(len < 0 && errno == EAGAIN)
+        {
+            // The driver's buffer is full, continue once the port can take more
+            if(!tx_waiting_ && reactor_ != nullptr)
+            {
+                reactor_->modify(fd_, EPOLLIN | EPOLLOUT);
+                tx_waiting_ = true;
+            }
+            return;
+        }
+
+        logger_.error("Write failed: %s, %?u bytes dropped", std::string(strerror(errno)),
+                uint32_t(tx_inflight_.size() - tx_offset_));
+        break;
+    }
+
+    tx_inflight_.clear();
+    tx_offset_ = 0;
+    if(tx_waiting_)
+    {
+        reactor_->modify(fd_, EPOLLIN);
+        tx_waiting_ = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Serial::written()
+{
+    // Frames queued meanwhile go out in one write
+    flush();
+    if(getQueued() < MAX_QUEUED && listener_)
+    {
+        listener_->writeReady();
+    }
 }
 
 //------------------------------------------------------------------------------
@@ -133,57 +303,143 @@ uint32_t Serial::receive(uint8_t *data, uint32_t max_len)
 }
 
 //------------------------------------------------------------------------------
-void Serial::run()
+void Serial::attach(Reactor *reactor)
 {
-    char buffer[2048];
-    int len = 0;
-    int ret;
-    struct timeval timeout;
-    fd_set read_set;
+    reactor_ = reactor;
+    uring_ = reactor_->getUring();
+    if(uring_ == nullptr)
+    {
+        tx_waiting_ = !tx_inflight_.empty();
+        reactor_->add(fd_, tx_waiting_ ? EPOLLIN | EPOLLOUT : EPOLLIN, this);
+        return;
+    }
 
-    thread_ = Thread::current();
+    // The ring waits for data itself, a non-blocking fd would only return EAGAIN
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_NONBLOCK);
 
-    running_ = true;
-    while(running_)
+    // With VMIN 0 a blocking read returns 0 bytes at once when nothing has
+    // arrived, which can't be told apart from a hangup. Wait for one byte.
+    if(vmin_ == 0)
     {
-        FD_ZERO(&read_set);
-        FD_SET(fd_, &read_set);
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        ret = select(fd_ + 1, &read_set, 0, 0, &timeout);
-        if(ret > 0)
+        struct termios2 tty;
+        bool set = ioctl(fd_, TCGETS2, &tty) == 0;
+        if(set)
         {
-            len = read(fd_, buffer, sizeof(buffer));
-            if(len > 0)
-            {
-                try
-                {
-                    if(listener_)
-                    {
-                        listener_->dataReceived((uint8_t *)buffer, (uint32_t)len);
-                    }
-                }
-                catch(std::exception &e)
-                {
-                    logger_.error("[" + NumberFormatter::format(__LINE__) + "] " + e.what());
-                }
-            }
-            else
-            {
-                logger_.error("Serial port closed");
-                ::close(fd_);
-                fd_ = -1;
-                if(listener_)
-                {
-                    listener_->portClosed();
-                }
-                break;
-            }
+            tty.c_cc[VMIN] = 1;
+            set = ioctl(fd_, TCSETS2, &tty) == 0;
+        }
+        if(!set)
+        {
+            logger_.warning("Cannot set VMIN for io_uring reads: %s", std::string(strerror(errno)));
+        }
+    }
+    uint32_t size;
+    uint8_t *buffer = receiveBuffer(size);
+    uring_->read(fd_, buffer, size, -1, this, TAG_READ);
+}
+
+//------------------------------------------------------------------------------
+void Serial::onEvent(int fd, uint32_t events)
+{
+    if(events & EPOLLOUT)
+    {
+        writeInflight();
+        if(!tx_waiting_)
+        {
+            written();
+        }
+        if((events & ~EPOLLOUT) == 0 || fd_ < 0)
+        {
+            return;
+        }
+    }
+
+    uint32_t size;
+    uint8_t *buffer = receiveBuffer(size);
+    int len = read(fd_, buffer, size);
+    if(len < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return;
+    }
+
+    // With VMIN 0 an empty read is no end of file, only a hangup closes
+    if(len == 0 && (events & (EPOLLHUP | EPOLLERR)) == 0)
+    {
+        return;
+    }
+    received(len);
+}
+
+//------------------------------------------------------------------------------
+void Serial::onComplete(int32_t result, uint32_t tag)
+{
+    if(tag == TAG_READ)
+    {
+        if(result != -EAGAIN && result != -EINTR)
+        {
+            received(result);
         }
-        else if(ret < 0)
+        if(uring_ != nullptr)
         {
-            break;
+            uint32_t size;
+            uint8_t *buffer = receiveBuffer(size);
+            uring_->read(fd_, buffer, size, -1, this, TAG_READ);
         }
+        return;
+    }
+
+    if(result < 0 && result != -EAGAIN && result != -EINTR)
+    {
+        logger_.error("Write failed: %d, %?u bytes dropped", -result, tx_inflight_.size() - tx_offset_);
+        tx_offset_ = tx_inflight_.size();
+    }
+
+    tx_offset_ += (result > 0) ? result : 0;
+    tx_bytes_ += (result > 0) ? result : 0;
+    if(tx_offset_ < tx_inflight_.size() && uring_ != nullptr)
+    {
+        // Short write, the rest goes in the next one
+        tx_writes_++;
+        uring_->write(fd_, tx_inflight_.data() + tx_offset_, tx_inflight_.size() - tx_offset_, this, TAG_WRITE);
+        return;
+    }
+
+    tx_inflight_.clear();
+    tx_offset_ = 0;
+    if(uring_ != nullptr)
+    {
+        written();
+    }
+}
+
+//------------------------------------------------------------------------------
+uint8_t *Serial::receiveBuffer(uint32_t &size)
+{
+    rx_target_ = (listener_ != nullptr) ? listener_->getReceiveBuffer(size) : nullptr;
+    if(rx_target_ == nullptr || size == 0)
+    {
+        rx_target_ = rx_;
+        size = sizeof(rx_);
+    }
+    return rx_target_;
+}
+
+//------------------------------------------------------------------------------
+void Serial::received(int32_t len)
+{
+    if(len > 0)
+    {
+        if(listener_)
+        {
+            listener_->dataReceived(rx_target_, (uint32_t)len);
+        }
+        return;
+    }
+
+    logger_.error("Serial port closed");
+    close();
+    if(listener_)
+    {
+        listener_->portClosed();
     }
-    logger_.error("Serial closed");
 }
@@ -0,0 +1,176 @@
+/*
+ * shaper.cpp
+ *
+ *  Created on: 22.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "shaper.h"
+
+#include <algorithm>
+
+using namespace Poco;
+
+//------------------------------------------------------------------------------
+Shaper::Shaper() :
+    logger_(Logger::get("Shaper")),
+    max_rate_(0),
+    rate_(0),
+    tokens_(0),
+    min_rtt_(-1),
+    failures_(0),
+    timeouts_(0)
+{
+}
+
+//------------------------------------------------------------------------------
+Shaper::~Shaper()
+{
+}
+
+//------------------------------------------------------------------------------
+void Shaper::setRate(uint32_t bytes_per_second)
+{
+    max_rate_ = bytes_per_second;
+    rate_ = bytes_per_second;
+    tokens_ = 0;
+    updated_.update();
+    clean_since_.update();
+}
+
+//------------------------------------------------------------------------------
+bool Shaper::isEnabled() const
+{
+    return max_rate_ > 0;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Shaper::getRate() const
+{
+    return uint32_t(rate_);
+}
+
+//------------------------------------------------------------------------------
+uint32_t Shaper::getFailures() const
+{
+    return failures_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Shaper::getTimeouts() const
+{
+    return timeouts_;
+}
+
+//------------------------------------------------------------------------------
+long Shaper::delay()
+{
+    if(!isEnabled())
+    {
+        return 0;
+    }
+
+    refill();
+    if(tokens_ >= 0)
+    {
+        return 0;
+    }
+
+    // Round up, the timer would fire just before the debt is paid otherwise
+    return long(-tokens_ * 1000 / rate_) + 1;
+}
+
+//------------------------------------------------------------------------------
+void Shaper::consume(uint32_t bytes)
+{
+    if(!isEnabled())
+    {
+        return;
+    }
+
+    refill();
+    tokens_ -= bytes;
+}
+
+//------------------------------------------------------------------------------
+void Shaper::onFailure()
+{
+    failures_++;
+    if(isEnabled())
+    {
+        decrease(DECREASE, "RF failure");
+    }
+}
+
+//------------------------------------------------------------------------------
+void Shaper::onTimeout()
+{
+    timeouts_++;
+    if(isEnabled())
+    {
+        decrease(DECREASE, "ACK timeout");
+    }
+}
+
+//------------------------------------------------------------------------------
+void Shaper::onAck(Timestamp::TimeDiff rtt, uint32_t inflight)
+{
+    if(!isEnabled())
+    {
+        return;
+    }
+
+    // The frame waited for everything ahead of it to go over the air
+    Timestamp::TimeDiff airtime = Timestamp::TimeDiff(inflight) * 1000000 / max_rate_;
+    Timestamp::TimeDiff delay = (rtt > airtime) ? rtt - airtime : 0;
+
+    // Windowed minimum, a route or rate change must not leave a stale one
+    if(min_rtt_ < 0 || delay <= min_rtt_ ||
+       min_rtt_since_.elapsed() >= Timestamp::TimeDiff(MIN_RTT_WINDOW) * 1000)
+    {
+        min_rtt_ = delay;
+        min_rtt_since_.update();
+    }
+
+    if(delay > min_rtt_ * 2 + Timestamp::TimeDiff(DELAY_SLACK) * 1000)
+    {
+        decrease(DELAY_DECREASE, "ACK delay");
+        return;
+    }
+
+    if(clean_since_.elapsed() >= Timestamp::TimeDiff(PROBE_INTERVAL) * 1000 && rate_ < max_rate_)
+    {
+        rate_ = std::min(double(max_rate_), rate_ + double(max_rate_) / PROBE_STEPS);
+        clean_since_.update();
+        logger_.debug("Rate raised to %?u bytes/s", uint32_t(rate_));
+    }
+}
+
+//------------------------------------------------------------------------------
+void Shaper::refill()
+{
+    Timestamp now;
+    tokens_ += rate_ * (now - updated_) / 1000000;
+    updated_ = now;
+
+    double burst = std::max(rate_ * BURST / 1000, double(MIN_BURST));
+    if(tokens_ > burst)
+    {
+        tokens_ = burst;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Shaper::decrease(double factor, const char *reason)
+{
+    if(last_decrease_.elapsed() < Timestamp::TimeDiff(HOLDOFF) * 1000)
+    {
+        return;
+    }
+
+    clean_since_.update();
+    refill();
+    rate_ = std::max(rate_ * factor, double(max_rate_) / MIN_FRACTION);
+    last_decrease_.update();
+    logger_.information("%s, rate reduced to %?u bytes/s", std::string(reason), uint32_t(rate_));
+}
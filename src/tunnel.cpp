@@ -15,13 +15,18 @@
 #include <Poco/Util/HelpFormatter.h>
 #include <Poco/Util/Option.h>
 #include <Poco/NumberFormatter.h>
+#include <Poco/NumberParser.h>
+#include <Poco/Exception.h>
+#include <Poco/StringTokenizer.h>
 
 #include <iostream>
 #include <sstream>
 #include <deque>
 
+#include <errno.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -45,12 +50,36 @@ static void signalHandler(int sig)
 //------------------------------------------------------------------------------
 Tunnel::Tunnel() :
     help_(false),
-    protocol_(nullptr),
-    serial_(nullptr),
-    dev_("/dev/ttyACM0"),
+    bond_(nullptr),
+    schedule_(Bond::SCHEDULE_FLOW),
+    header_compression_(nullptr),
+    bridge_(nullptr),
+    compression_(new Compression),
+    baudrate_(115200),
+    low_latency_(true),
+    vmin_(0),
+    vtime_(0),
+    window_(0),
+    retries_(Protocol::MAX_RETRIES),
+    aggregate_(0),
+    aggregate_delay_(2),
+    pool_size_(Protocol::POOL_SIZE),
+    rf_rate_(0),
+    rf_mtu_(0),
+    crc_(Crc::CRC_XOR8),
+    cobs_(false),
+    compact_(false),
+    handshake_(false),
+    address_(-1),
+    fec_(Fec::FEC_NONE),
+    fec_group_(8),
+    fec_parity_(2),
+    fec_adaptive_(false),
     interface_("tun0"),
     tun_fd_(-1),
-    terminate_(false)
+    uring_(false),
+    fixed_buffers_(false),
+    blocked_(false)
 {
     // Console Channel
     AutoPtr<ColorConsoleChannel> console_channel(new ColorConsoleChannel);
@@ -65,31 +94,81 @@ Tunnel::Tunnel() :
     logger_ = &Logger::get("Tunnel");
 
     signal(SIGINT, &signalHandler);
+
+    for(uint32_t i = 0; i < TUN_WRITES; i++)
+    {
+        tx_[i].resize(Protocol::MAX_PAYLOAD);
+        tx_free_.push_back(i);
+    }
 }
 
 //------------------------------------------------------------------------------
 Tunnel::~Tunnel()
 {
+    delete bond_;
+    delete header_compression_;
+    delete bridge_;
+    delete compression_;
 }
 
 //------------------------------------------------------------------------------
 void Tunnel::terminate()
 {
-    terminate_ = true;
+    reactor_.stop();
 }
 
 //------------------------------------------------------------------------------
-void Tunnel::onFrameReceived(Frame *f)
+void Tunnel::onPacketReceived(const uint8_t *data, uint32_t size)
 {
     if(tun_fd_ != -1)
     {
-        logger_->information("%s", f->toString());
+        logger_->debug("Received packet with %?u bytes", size);
+
+        if(header_compression_ || bridge_)
+        {
+            uint8_t local[Protocol::MAX_PAYLOAD];
+            uint8_t *packet = tunBuffer();
+            if(packet == nullptr)
+            {
+                packet = local;
+            }
 
-        vector<uint8_t> d = f->getData();
-        write(tun_fd_, d.data(), d.size());
+            vector<uint8_t> feedback;
+            uint32_t len = bridge_ ? bridge_->decompress(data, size, packet, Protocol::MAX_PAYLOAD, feedback)
+                                   : header_compression_->decompress(data, size, packet, Protocol::MAX_PAYLOAD, feedback);
+            // With the queue full the request is dropped, the next packet of
+            // the context repeats it
+            if(feedback.size() > 0 && !bond_->sendData(feedback.data(), feedback.size(), 0, Classifier::CLASS_CONTROL))
+            {
+                logger_->debug("Feedback dropped, queue full");
+                if(bridge_)
+                {
+                    bridge_->feedbackDropped(feedback);
+                }
+                else
+                {
+                    header_compression_->feedbackDropped(feedback);
+                }
+            }
+            if(len > 0)
+            {
+                writeTun(packet, len);
+            }
+        }
+        else
+        {
+            writeTun(data, size);
+        }
     }
 }
 
+//------------------------------------------------------------------------------
+void Tunnel::onLinkReady(Protocol *protocol)
+{
+    // The handshake may have brought a lower limit
+    updateMtu();
+}
+
 //------------------------------------------------------------------------------
 void Tunnel::initialize(Poco::Util::Application &app)
 {
@@ -100,22 +179,62 @@ void Tunnel::initialize(Poco::Util::Application &app)
         return;
     }
 
-    tun_fd_ = open(interface_, IFF_TUN | IFF_NO_PI);
+    if(bridge_ && header_compression_)
+    {
+        logger_->warning("Header compression is not available in TAP mode");
+        delete header_compression_;
+        header_compression_ = nullptr;
+    }
+
+    tun_fd_ = open(interface_, (bridge_ ? IFF_TAP : IFF_TUN) | IFF_NO_PI);
     if(tun_fd_ < 0)
     {
         logger_->error("Failed to alloc the tunnel interface: %s", interface_);
         return;
     }
 
-    serial_ = new Serial;
-    protocol_ = new Protocol(serial_);
-    protocol_->setListener(this);
+    if(devices_.empty())
+    {
+        devices_.push_back("/dev/ttyACM0");
+    }
 
-    if(serial_->open(dev_, 115200) == false)
+    bond_ = new Bond;
+    bond_->setListener(this);
+    bond_->setSchedule(schedule_);
+    for(uint32_t i = 0; i < devices_.size(); i++)
     {
-        logger_->error("Cannot open serial device: %s", dev_);
-        return;
+        if(!bond_->addLink(devices_[i], baudrate_, low_latency_, vmin_, vtime_))
+        {
+            logger_->error("Cannot open serial device: %s", devices_[i]);
+        }
     }
+
+    for(uint32_t i = 0; i < bond_->getLinkCount(); i++)
+    {
+        Protocol *protocol = bond_->getProtocol(i);
+        protocol->setPoolSize(pool_size_);
+        protocol->setCrc(crc_);
+        protocol->setCobs(cobs_);
+        protocol->setCompactHeader(compact_);
+        protocol->setHandshake(handshake_);
+        if(address_ >= 0)
+        {
+            protocol->setAddress(address_);
+        }
+        protocol->setWindowSize(window_);
+        protocol->setMaxRetries(retries_);
+        protocol->setAggregation(aggregate_, aggregate_delay_);
+        protocol->setCompression(compression_);
+        protocol->setRfRate(rf_rate_ / 8);
+        protocol->setMtu(rf_mtu_);
+        protocol->setFec(fec_, fec_group_, fec_parity_, fec_adaptive_);
+        for(uint32_t c = 0; c < weights_.size(); c++)
+        {
+            protocol->setClassWeight(Classifier::Class(Classifier::CLASS_INTERACTIVE + c), weights_[c]);
+        }
+    }
+
+    updateMtu();
 }
 
 //------------------------------------------------------------------------------
@@ -124,13 +243,13 @@ void Tunnel::uninitialize()
     logger_->information("uninit");
     ServerApplication::uninitialize();
 
-    protocol_->close();
+    bond_->close();
+    compression_->logStats();
     if(tun_fd_ >= 0)
     {
+        reactor_.remove(tun_fd_);
         close(tun_fd_);
     }
-
-    ThreadPool::defaultPool().joinAll();
 }
 
 //------------------------------------------------------------------------------
@@ -146,8 +265,63 @@ void Tunnel::defineOptions(Poco::Util::OptionSet &options)
             .argument("<Level>", true));
     options.addOption(Option("interface", "i", "Specify the tun interface (default: tun0)")
             .argument("<Interface>", true));
-    options.addOption(Option("serial", "s", "Specify the serial device (default: /dev/ttyACM0)")
-            .argument("<Interface>", true));
+    options.addOption(Option("serial", "s", "Specify the serial device (default: /dev/ttyACM0), more devices are bonded")
+            .argument("<Interface>", true)
+            .repeatable(true));
+    options.addOption(Option("baud", "", "Baud rate of the serial devices, any rate the driver supports (default: 115200)")
+            .argument("<Baud>", true));
+    options.addOption(Option("low-latency", "", "Low latency mode of the serial driver: on or off (default: on)")
+            .argument("<Mode>", true));
+    options.addOption(Option("serial-read", "", "VMIN and VTIME of the serial devices (default: 0,0, VMIN is at "
+                                                "least 1 with io_uring)")
+            .argument("<VMIN>,<VTIME>", true));
+    options.addOption(Option("bond", "b", "Bond scheduling: flow or capacity (default: flow)")
+            .argument("<Schedule>", true));
+    options.addOption(Option("priority", "", "Priority rule <Match>=<Class>, match: dscp:<n>, tcp:<port>, udp:<port>, icmp "
+                                             "or proto:<n>, class: control, interactive, default or bulk")
+            .argument("<Rule>", true)
+            .repeatable(true));
+    options.addOption(Option("weights", "", "Link share of the interactive, default and bulk class (default: 8,4,1)")
+            .argument("<I>,<D>,<B>", true));
+    options.addOption(Option("window", "w", "Number of unacknowledged frames in flight (default: 0 = stop-and-wait)")
+            .argument("<Frames>", true));
+    options.addOption(Option("retries", "", "Retransmissions of an unacknowledged frame before it is dropped (default: 3)")
+            .argument("<Count>", true));
+    options.addOption(Option("header-compression", "c", "Compress IP/UDP/TCP headers (has to be enabled on both sides)"));
+    options.addOption(Option("tap", "", "Bridge Ethernet frames over a TAP interface, with ARP/ND proxy and Ethernet "
+            "header elision (has to be enabled on both sides)"));
+    options.addOption(Option("aggregate", "a", "Pack queued packets into frames of up to this many bytes (default: 0 = off)")
+            .argument("<Bytes>", true));
+    options.addOption(Option("aggregate-delay", "", "Time to wait for more packets to aggregate (default: 2 ms)")
+            .argument("<ms>", true));
+    options.addOption(Option("rf-rate", "r", "RF data rate of the dongle in bit/s, frames are paced to it (default: 0 = off)")
+            .argument("<bit/s>", true));
+    options.addOption(Option("rf-mtu", "", "Largest frame payload the dongle sends over the air, larger packets are "
+            "fragmented (default: 0 = the limit reported in the handshake, if any)")
+            .argument("<Bytes>", true));
+    options.addOption(Option("crc", "", "Frame check: xor, crc16 or crc32c (default: xor, has to match the dongle)")
+            .argument("<Type>", true));
+    options.addOption(Option("framing", "", "Frame delimiting: length or cobs (default: length, has to match the dongle)")
+            .argument("<Type>", true));
+    options.addOption(Option("handshake", "", "Reset the dongle on start and negotiate CRC, framing, header and window "
+            "with it (overrides --crc, --framing and --compact-header)"));
+    options.addOption(Option("address", "", "RF address set in the dongle during the handshake")
+            .argument("<Address>", true));
+    options.addOption(Option("compact-header", "", "Use the compact frame header if the dongle supports it"));
+    options.addOption(Option("fec", "f", "Parity frames with every group, <Type>[:<K>[,<R>]], types: xor, rs "
+            "(default: none, K = 8, R = 2, has to be enabled on both sides)")
+            .argument("<Type>", true));
+    options.addOption(Option("fec-adaptive", "", "Adapt the FEC redundancy to the loss reported by the peer"));
+    options.addOption(Option("io", "", "I/O backend: epoll or uring (default: epoll)")
+            .argument("<Backend>", true));
+    options.addOption(Option("pool", "p", "Number of preallocated TX frames (default: 128)")
+            .argument("<Frames>", true));
+    options.addOption(Option("compress", "z", "Compress frame payloads with <Codec>[:<Level>], codecs: lz, deflate (default: none)")
+            .argument("<Codec>", true));
+    options.addOption(Option("compress-dict", "", "Use the dictionary in <File> for compression (has to be the same on both sides)")
+            .argument("<File>", true));
+    options.addOption(Option("compress-train", "", "Train a dictionary from the sent payloads and store it in <File>")
+            .argument("<File>", true));
 }
 
 //------------------------------------------------------------------------------
@@ -171,7 +345,185 @@ void Tunnel::handleOption(const std::string &name, const std::string &value)
     }
     else if(name == "serial")
     {
-        dev_ = value;
+        // Multiple devices (repeated or comma separated) are bonded
+        StringTokenizer tokens(value, ",", StringTokenizer::TOK_TRIM | StringTokenizer::TOK_IGNORE_EMPTY);
+        devices_.insert(devices_.end(), tokens.begin(), tokens.end());
+    }
+    else if(name == "baud")
+    {
+        baudrate_ = NumberParser::parseUnsigned(value);
+        if(baudrate_ == 0)
+        {
+            throw InvalidArgumentException("Invalid baud rate", value);
+        }
+    }
+    else if(name == "low-latency")
+    {
+        if(value != "on" && value != "off")
+        {
+            throw InvalidArgumentException("Expected on or off", value);
+        }
+        low_latency_ = (value == "on");
+    }
+    else if(name == "serial-read")
+    {
+        StringTokenizer tokens(value, ",", StringTokenizer::TOK_TRIM);
+        if(tokens.count() != 2)
+        {
+            throw InvalidArgumentException("Expected VMIN and VTIME", value);
+        }
+        unsigned vmin = NumberParser::parseUnsigned(tokens[0]);
+        unsigned vtime = NumberParser::parseUnsigned(tokens[1]);
+        if(vmin > 255 || vtime > 255)
+        {
+            throw InvalidArgumentException("VMIN and VTIME must be below 256", value);
+        }
+        vmin_ = vmin;
+        vtime_ = vtime;
+    }
+    else if(name == "bond")
+    {
+        schedule_ = Bond::parseSchedule(value);
+    }
+    else if(name == "priority")
+    {
+        classifier_.addRule(value);
+    }
+    else if(name == "weights")
+    {
+        StringTokenizer tokens(value, ",", StringTokenizer::TOK_TRIM);
+        if(tokens.count() != Classifier::CLASS_COUNT - 1)
+        {
+            throw InvalidArgumentException("Expected three class weights", value);
+        }
+        weights_.clear();
+        for(StringTokenizer::Iterator it = tokens.begin(); it != tokens.end(); it++)
+        {
+            weights_.push_back(NumberParser::parseUnsigned(*it));
+        }
+    }
+    else if(name == "window")
+    {
+        window_ = NumberParser::parseUnsigned(value);
+    }
+    else if(name == "retries")
+    {
+        retries_ = NumberParser::parseUnsigned(value);
+    }
+    else if(name == "tap")
+    {
+        if(bridge_ == nullptr)
+        {
+            bridge_ = new Bridge;
+        }
+    }
+    else if(name == "header-compression")
+    {
+        if(header_compression_ == nullptr)
+        {
+            header_compression_ = new HeaderCompression;
+        }
+    }
+    else if(name == "rf-rate")
+    {
+        rf_rate_ = NumberParser::parseUnsigned(value);
+    }
+    else if(name == "rf-mtu")
+    {
+        rf_mtu_ = NumberParser::parseUnsigned(value);
+        if(rf_mtu_ > 0 && rf_mtu_ < Protocol::MIN_MTU)
+        {
+            throw InvalidArgumentException("RF MTU too small", value);
+        }
+    }
+    else if(name == "crc")
+    {
+        crc_ = Crc::parseType(value);
+        logger_->information("Frame check %s, CRC-32C kernel: %s", Crc::typeName(crc_), string(Crc::kernel()));
+    }
+    else if(name == "framing")
+    {
+        if(value != "length" && value != "cobs")
+        {
+            throw InvalidArgumentException("Unknown framing", value);
+        }
+        cobs_ = (value == "cobs");
+    }
+    else if(name == "handshake")
+    {
+        handshake_ = true;
+    }
+    else if(name == "address")
+    {
+        unsigned address = NumberParser::parseUnsigned(value);
+        if(address > 0xFFFF)
+        {
+            throw InvalidArgumentException("Address out of range", value);
+        }
+        address_ = address;
+    }
+    else if(name == "compact-header")
+    {
+        compact_ = true;
+    }
+    else if(name == "fec")
+    {
+        string::size_type pos = value.find(':');
+        fec_ = Fec::parseType(value.substr(0, pos));
+        if(pos != string::npos)
+        {
+            StringTokenizer tokens(value.substr(pos + 1), ",", StringTokenizer::TOK_TRIM);
+            if(tokens.count() < 1 || tokens.count() > 2)
+            {
+                throw InvalidArgumentException("Invalid FEC parameters", value);
+            }
+            fec_group_ = NumberParser::parseUnsigned(tokens[0]);
+            if(tokens.count() > 1)
+            {
+                fec_parity_ = NumberParser::parseUnsigned(tokens[1]);
+            }
+        }
+    }
+    else if(name == "fec-adaptive")
+    {
+        fec_adaptive_ = true;
+    }
+    else if(name == "io")
+    {
+        if(value != "epoll" && value != "uring")
+        {
+            throw InvalidArgumentException("Unknown I/O backend", value);
+        }
+        uring_ = (value == "uring");
+    }
+    else if(name == "pool")
+    {
+        pool_size_ = NumberParser::parseUnsigned(value);
+    }
+    else if(name == "compress")
+    {
+        string::size_type pos = value.find(':');
+        int level = (pos != string::npos) ? NumberParser::parse(value.substr(pos + 1)) : 1;
+        compression_->setCodec(Compression::parseCodec(value.substr(0, pos)), level);
+    }
+    else if(name == "compress-dict")
+    {
+        if(!compression_->loadDictionary(value))
+        {
+            throw InvalidArgumentException("Cannot load dictionary", value);
+        }
+    }
+    else if(name == "compress-train")
+    {
+        compression_->setTrainingFile(value);
+    }
+    else if(name == "aggregate")
+    {
+        aggregate_ = NumberParser::parseUnsigned(value);
+    }
+    else if(name == "aggregate-delay")
+    {
+        aggregate_delay_ = NumberParser::parseUnsigned(value);
     }
 }
 
@@ -188,41 +540,269 @@ int Tunnel::main(const std::vector<std::string> &args)
         return EXIT_FAILURE;
     }
 
-    fd_set readfds;
-    struct timeval timeout;
-    uint8_t buffer[2048];
+    if(bond_->getLinkCount() == 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if(uring_ && reactor_.enableUring(URING_ENTRIES))
+    {
+        struct iovec buffers[TUN_READS];
+        for(uint32_t i = 0; i < TUN_READS; i++)
+        {
+            buffers[i].iov_base = rx_[i].buffer;
+            buffers[i].iov_len = sizeof(rx_[i].buffer);
+        }
+        fixed_buffers_ = reactor_.getUring()->registerBuffers(buffers, TUN_READS);
+    }
+
+    // Everything runs on this thread: tun and serial reads, the protocol
+    // timers and the shutdown signal
+    bond_->start(&reactor_);
+    if(reactor_.getUring())
+    {
+        for(uint32_t i = 0; i < TUN_READS; i++)
+        {
+            postRead(i);
+        }
+    }
+    else
+    {
+        reactor_.add(tun_fd_, EPOLLIN, this);
+    }
+    reactor_.run();
+
+    return EXIT_SUCCESS;
+}
+
+//------------------------------------------------------------------------------
+void Tunnel::onEvent(int fd, uint32_t events)
+{
+    if(fd == tun_fd_)
+    {
+        readTun();
+    }
+    else
+    {
+        flushPackets();
+    }
+}
+
+//------------------------------------------------------------------------------
+void Tunnel::onComplete(int32_t result, uint32_t tag)
+{
+    if(tag & TAG_WRITE)
+    {
+        if(result < 0)
+        {
+            logger_->warning("Write to tun failed: %d", -result);
+        }
+        tx_free_.push_back(tag & ~TAG_WRITE);
+        return;
+    }
+
+    if(result == -EAGAIN || result == -EINTR)
+    {
+        postRead(tag);
+    }
+    else if(result <= 0)
+    {
+        logger_->error("Interface closed");
+        reactor_.stop();
+    }
+    else
+    {
+        receivePacket(tag, result);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Tunnel::readTun()
+{
+    int len = read(tun_fd_, rx_[0].buffer, sizeof(rx_[0].buffer));
+    if(len <= 0)
+    {
+        logger_->error("Interface closed");
+        reactor_.stop();
+        return;
+    }
+    receivePacket(0, len);
+}
+
+//------------------------------------------------------------------------------
+void Tunnel::postRead(uint32_t index)
+{
+    Packet &packet = rx_[index];
+    if(!reactor_.getUring()->read(tun_fd_, packet.buffer, sizeof(packet.buffer), fixed_buffers_ ? index : -1,
+                                  this, index))
+    {
+        logger_->error("Cannot post tun read");
+    }
+}
+
+//------------------------------------------------------------------------------
+void Tunnel::receivePacket(uint32_t index, uint32_t size)
+{
+    Packet &packet = rx_[index];
+    logger_->information("%?u bytes read from tun", size);
+
+    //logger_->information("%s", Utils::hexDump(deque<uint8_t>(packet.buffer, packet.buffer + 16)));
+    packet.data = packet.buffer;
+    packet.size = size;
 
-    ThreadPool::defaultPool().start(*protocol_);
+    if(bridge_)
+    {
+        // Neighbour requests answered from the cache never reach the link
+        if(!bridge_->filter(packet.buffer, size, tap_reply_))
+        {
+            if(!tap_reply_.empty())
+            {
+                writeTun(tap_reply_.data(), tap_reply_.size());
+            }
+            if(reactor_.getUring())
+            {
+                postRead(index);
+            }
+            return;
+        }
+
+        uint32_t offset = Bridge::ipOffset(packet.buffer, size);
+        packet.flow = Bond::flowHash(packet.buffer + offset, size - offset);
+        packet.cls = classifier_.classify(packet.buffer + offset, size - offset);
+        packet.size = bridge_->compress(packet.buffer, size, packet.compressed);
+        packet.data = packet.compressed;
 
-    while(!terminate_)
+        held_.push_back(index);
+        flushPackets();
+        return;
+    }
+
+    packet.flow = Bond::flowHash(packet.buffer, size);
+    packet.cls = classifier_.classify(packet.buffer, size);
+    if(header_compression_)
     {
-        FD_ZERO(&readfds);
-        FD_SET(tun_fd_, &readfds);
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+        packet.size = header_compression_->compress(packet.buffer, size, packet.compressed);
+        packet.data = packet.compressed;
+    }
 
-        int ret = select(tun_fd_ + 1, &readfds, NULL, NULL, &timeout);
-        if(ret > 0)
+    held_.push_back(index);
+    flushPackets();
+}
+
+//------------------------------------------------------------------------------
+void Tunnel::flushPackets()
+{
+    // Backpressure: while the send queue is full, the tun device is not
+    // read and the kernel queues (or drops) the packets instead of us
+    while(!held_.empty())
+    {
+        uint32_t index = held_.front();
+        if(bond_->sendData(rx_[index].data, rx_[index].size, rx_[index].flow, rx_[index].cls))
+        {
+            held_.pop_front();
+            if(reactor_.getUring())
+            {
+                postRead(index);
+            }
+        }
+        else if(bond_->waitTxSpace())
         {
-            if(FD_ISSET(tun_fd_, &readfds))
+            if(!blocked_)
             {
-                int len = read(tun_fd_, buffer, sizeof(buffer));
-                logger_->information("%?d bytes read from tun", len);
-                if(len > 0)
+                if(!reactor_.getUring())
                 {
-                    //logger_->information("%s", Utils::hexDump(deque<uint8_t>(buffer, buffer + 16)));
-                    protocol_->sendData(buffer, len);
+                    reactor_.modify(tun_fd_, 0);
                 }
+                reactor_.add(bond_->getTxSpaceFd(), EPOLLIN, this);
+                blocked_ = true;
             }
+            return;
         }
-        else if(ret < 0)
+    }
+
+    if(blocked_)
+    {
+        reactor_.remove(bond_->getTxSpaceFd());
+        if(!reactor_.getUring())
         {
-            logger_->error("Interface closed");
-            break;
+            reactor_.modify(tun_fd_, EPOLLIN);
         }
+        blocked_ = false;
     }
+}
 
-    return EXIT_SUCCESS;
+//------------------------------------------------------------------------------
+uint8_t *Tunnel::tunBuffer()
+{
+    if(reactor_.getUring() == nullptr || tx_free_.empty())
+    {
+        return nullptr;
+    }
+    return tx_[tx_free_.back()].data();
+}
+
+//------------------------------------------------------------------------------
+void Tunnel::writeTun(const uint8_t *data, uint32_t size)
+{
+    // tun takes one packet per write, so there is nothing to gain from
+    // writev. The io_uring writes of one serial read go out in one submit.
+    Uring *uring = reactor_.getUring();
+    if(uring != nullptr && !tx_free_.empty() && size <= tx_[tx_free_.back()].size())
+    {
+        uint32_t index = tx_free_.back();
+        if(data != tx_[index].data())
+        {
+            memcpy(tx_[index].data(), data, size);
+        }
+        if(uring->write(tun_fd_, tx_[index].data(), size, this, TAG_WRITE | index))
+        {
+            tx_free_.pop_back();
+            return;
+        }
+    }
+
+    if(write(tun_fd_, data, size) < 0)
+    {
+        logger_->warning("Write to tun failed: %d", errno);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Tunnel::updateMtu()
+{
+    // In TAP mode the Ethernet header is sent in full now and then
+    uint32_t limit = bond_->getMtu();
+    if(bridge_)
+    {
+        limit = (limit > Bridge::HEADER_SIZE + Bridge::MAX_OVERHEAD) ? limit - Bridge::HEADER_SIZE -
+                Bridge::MAX_OVERHEAD : 0;
+    }
+    uint32_t mtu = (limit > MIN_MTU) ? limit : MIN_MTU;
+    if(limit == 0 || mtu >= DEFAULT_MTU)
+    {
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0)
+    {
+        logger_->warning("Cannot set the MTU: %d", errno);
+        return;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface_.c_str(), IFNAMSIZ - 1);
+    ifr.ifr_mtu = mtu;
+    if(ioctl(fd, SIOCSIFMTU, &ifr) < 0)
+    {
+        logger_->warning("Cannot set the MTU of %s to %?u: %d", interface_, mtu, errno);
+    }
+    else
+    {
+        logger_->information("MTU of %s set to %?u, RF limit %?u bytes", interface_, mtu, limit);
+    }
+    ::close(fd);
 }
 
 //------------------------------------------------------------------------------
@@ -0,0 +1,469 @@
+/*
+ * tx_scheduler.cpp
+ *
+ *  Created on: 15.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "tx_scheduler.h"
+
+#include <Poco/Exception.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace Poco;
+
+//------------------------------------------------------------------------------
+static uint32_t frameBytes(const Frame *f)
+{
+    return f->getLength() + 2;
+}
+
+//------------------------------------------------------------------------------
+TxScheduler::TxScheduler(FramePool &pool, uint32_t limit) :
+    pool_(pool),
+    limit_(limit),
+    size_(0),
+    bytes_(0),
+    current_(Classifier::CLASS_INTERACTIVE),
+    target_(Timestamp::TimeVal(TARGET) * 1000),
+    interval_(Timestamp::TimeVal(INTERVAL) * 1000),
+    blocked_(false)
+{
+    static const uint32_t WEIGHTS[Classifier::CLASS_COUNT] = { 1, 8, 4, 1 };
+
+    for(uint32_t i = 0; i < Classifier::CLASS_COUNT; i++)
+    {
+        Queue &queue = queues_[i];
+        queue.size = 0;
+        queue.weight = WEIGHTS[i];
+        queue.deficit = 0;
+        queue.high_water = 0;
+        queue.drops = 0;
+        queue.codel_drops = 0;
+
+        for(uint32_t j = 0; j < FLOWS; j++)
+        {
+            resetFlow(queue.flows[j]);
+        }
+    }
+
+    space_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(space_fd_ < 0)
+    {
+        throw SystemException("Cannot create queue eventfd");
+    }
+}
+
+//------------------------------------------------------------------------------
+TxScheduler::~TxScheduler()
+{
+    ::close(space_fd_);
+}
+
+//------------------------------------------------------------------------------
+void TxScheduler::setWeight(Classifier::Class cls, uint32_t weight)
+{
+    queues_[cls].weight = (weight > 0) ? weight : 1;
+}
+
+//------------------------------------------------------------------------------
+void TxScheduler::setLinkRate(uint32_t bytes_per_second)
+{
+    if(bytes_per_second == 0)
+    {
+        return;
+    }
+
+    Timestamp::TimeVal mtu_time = Timestamp::TimeVal(MTU) * 1000000 / bytes_per_second;
+    target_ = std::max(Timestamp::TimeVal(TARGET) * 1000, mtu_time);
+    interval_ = std::max(Timestamp::TimeVal(INTERVAL) * 1000, target_ * 10);
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::getTarget() const
+{
+    return target_ / 1000;
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::getInterval() const
+{
+    return interval_ / 1000;
+}
+
+//------------------------------------------------------------------------------
+bool TxScheduler::put(Frame *f, Classifier::Class cls, uint32_t flow)
+{
+    Queue &queue = queues_[cls];
+    uint32_t index = flow % FLOWS;
+    Flow &fl = queue.flows[index];
+
+    if(size_ >= limit_)
+    {
+        uint32_t lowest = Classifier::CLASS_COUNT - 1;
+        while(lowest > uint32_t(cls) && queues_[lowest].size == 0)
+        {
+            lowest--;
+        }
+
+        if(lowest > uint32_t(cls))
+        {
+            pushOut(queues_[lowest]);
+        }
+        else if(queue.flows[longestFlow(queue)].bytes > fl.bytes + frameBytes(f))
+        {
+            // Other flows of the class are not stuck behind a bulk flow
+            pushOut(queue);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    Packet packet = { f, Timestamp().epochMicroseconds() };
+    fl.packets.push_back(packet);
+    fl.bytes += frameBytes(f);
+    if(!fl.active)
+    {
+        fl.active = true;
+        fl.deficit = FLOW_QUANTUM;
+        queue.new_flows.push_back(index);
+    }
+
+    queue.size++;
+    if(queue.size > queue.high_water)
+    {
+        queue.high_water = queue.size;
+    }
+    bytes_ += frameBytes(f);
+    size_++;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+Frame *TxScheduler::take()
+{
+    if(size_ == 0)
+    {
+        return nullptr;
+    }
+
+    Frame *f = takeClass(queues_[Classifier::CLASS_CONTROL], false);
+
+    // Deficit round robin between the other classes: a class sends while
+    // its deficit is positive, then it gets its quantum for the next round
+    while(f == nullptr && size_ > 0)
+    {
+        Queue &queue = queues_[current_];
+        if(queue.size > 0 && queue.deficit > 0)
+        {
+            f = takeClass(queue, true);
+            if(f != nullptr)
+            {
+                queue.deficit -= frameBytes(f);
+            }
+            continue;
+        }
+
+        queue.deficit = (queue.size > 0) ? queue.deficit + queue.weight * QUANTUM : 0;
+        current_++;
+        if(current_ == Classifier::CLASS_COUNT)
+        {
+            current_ = Classifier::CLASS_INTERACTIVE;
+        }
+    }
+
+    if(blocked_ && size_ < limit_)
+    {
+        blocked_ = false;
+        uint64_t value = 1;
+        if(write(space_fd_, &value, sizeof(value)) < 0)
+        {
+            // Counter is already non-zero
+        }
+    }
+    return f;
+}
+
+//------------------------------------------------------------------------------
+Frame *TxScheduler::takeClass(Queue &queue, bool codel)
+{
+    while(true)
+    {
+        // New flows first, so sparse flows do not wait behind the backlog
+        std::deque<uint32_t> *list = &queue.new_flows;
+        if(list->empty())
+        {
+            list = &queue.old_flows;
+            if(list->empty())
+            {
+                return nullptr;
+            }
+        }
+
+        uint32_t index = list->front();
+        Flow &flow = queue.flows[index];
+        if(flow.deficit <= 0)
+        {
+            flow.deficit += FLOW_QUANTUM;
+            list->pop_front();
+            queue.old_flows.push_back(index);
+            continue;
+        }
+
+        Frame *f = takeFlow(queue, flow, codel);
+        if(f == nullptr)
+        {
+            // A new flow that ran empty goes behind the old ones once, so
+            // it cannot get ahead again by sending one packet at a time
+            list->pop_front();
+            if(list == &queue.new_flows && !queue.old_flows.empty())
+            {
+                queue.old_flows.push_back(index);
+            }
+            else
+            {
+                flow.active = false;
+            }
+            continue;
+        }
+
+        flow.deficit -= frameBytes(f);
+        return f;
+    }
+}
+
+//------------------------------------------------------------------------------
+Frame *TxScheduler::takeFlow(Queue &queue, Flow &flow, bool codel)
+{
+    if(flow.packets.empty())
+    {
+        flow.dropping = false;
+        return nullptr;
+    }
+
+    Packet packet = pop(queue, flow);
+    if(!codel)
+    {
+        return packet.frame;
+    }
+
+    Timestamp::TimeVal now = Timestamp().epochMicroseconds();
+    bool ok_to_drop = shouldDrop(flow, packet, now);
+
+    if(flow.dropping)
+    {
+        if(!ok_to_drop)
+        {
+            flow.dropping = false;
+        }
+
+        // Drop faster, the longer the queue stays above target
+        while(flow.dropping && now >= flow.drop_next)
+        {
+            drop(queue, packet);
+            flow.count++;
+            if(flow.packets.empty())
+            {
+                flow.dropping = false;
+                return nullptr;
+            }
+
+            packet = pop(queue, flow);
+            if(!shouldDrop(flow, packet, now))
+            {
+                flow.dropping = false;
+            }
+            else
+            {
+                flow.drop_next = controlLaw(flow.drop_next, flow.count);
+            }
+        }
+    }
+    else if(ok_to_drop)
+    {
+        drop(queue, packet);
+
+        // Start with the drop rate of the last dropping state, if that
+        // ended only recently
+        uint32_t delta = flow.count - flow.last_count;
+        flow.dropping = true;
+        flow.count = (delta > 1 && now - flow.drop_next < interval_ * 16) ? delta : 1;
+        flow.drop_next = controlLaw(now, flow.count);
+        flow.last_count = flow.count;
+
+        if(flow.packets.empty())
+        {
+            return nullptr;
+        }
+        packet = pop(queue, flow);
+    }
+
+    return packet.frame;
+}
+
+//------------------------------------------------------------------------------
+bool TxScheduler::shouldDrop(Flow &flow, const Packet &packet, Timestamp::TimeVal now)
+{
+    // Never drop the last packet of a flow, it cannot build a standing queue
+    if(now - packet.enqueued < target_ || flow.bytes <= MTU)
+    {
+        flow.first_above = 0;
+        return false;
+    }
+
+    if(flow.first_above == 0)
+    {
+        flow.first_above = now + interval_;
+        return false;
+    }
+    return now >= flow.first_above;
+}
+
+//------------------------------------------------------------------------------
+Timestamp::TimeVal TxScheduler::controlLaw(Timestamp::TimeVal t, uint32_t count) const
+{
+    return t + Timestamp::TimeVal(interval_ / std::sqrt(double(count)));
+}
+
+//------------------------------------------------------------------------------
+void TxScheduler::clear()
+{
+    for(uint32_t i = 0; i < Classifier::CLASS_COUNT; i++)
+    {
+        Queue &queue = queues_[i];
+        for(uint32_t j = 0; j < FLOWS; j++)
+        {
+            Flow &flow = queue.flows[j];
+            while(!flow.packets.empty())
+            {
+                pool_.release(pop(queue, flow).frame);
+            }
+            resetFlow(flow);
+        }
+        queue.new_flows.clear();
+        queue.old_flows.clear();
+        queue.deficit = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+bool TxScheduler::waitSpace()
+{
+    uint64_t value;
+    if(read(space_fd_, &value, sizeof(value)) < 0)
+    {
+        // Nothing pending
+    }
+
+    blocked_ = full();
+    return blocked_;
+}
+
+//------------------------------------------------------------------------------
+int TxScheduler::spaceFd() const
+{
+    return space_fd_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::size() const
+{
+    return size_;
+}
+
+//------------------------------------------------------------------------------
+bool TxScheduler::full() const
+{
+    return size_ >= limit_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::getBytes() const
+{
+    return bytes_;
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::getDepth(Classifier::Class cls) const
+{
+    return queues_[cls].size;
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::getHighWater(Classifier::Class cls) const
+{
+    return queues_[cls].high_water;
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::getDrops(Classifier::Class cls) const
+{
+    return queues_[cls].drops;
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::getCodelDrops(Classifier::Class cls) const
+{
+    return queues_[cls].codel_drops;
+}
+
+//------------------------------------------------------------------------------
+TxScheduler::Packet TxScheduler::pop(Queue &queue, Flow &flow)
+{
+    Packet packet = flow.packets.front();
+    flow.packets.pop_front();
+    flow.bytes -= frameBytes(packet.frame);
+    queue.size--;
+    bytes_ -= frameBytes(packet.frame);
+    size_--;
+    return packet;
+}
+
+//------------------------------------------------------------------------------
+void TxScheduler::drop(Queue &queue, const Packet &packet)
+{
+    queue.codel_drops++;
+    pool_.release(packet.frame);
+}
+
+//------------------------------------------------------------------------------
+void TxScheduler::pushOut(Queue &queue)
+{
+    // The oldest packet of the longest flow, like fq_codel on overflow
+    queue.drops++;
+    pool_.release(pop(queue, queue.flows[longestFlow(queue)]).frame);
+}
+
+//------------------------------------------------------------------------------
+uint32_t TxScheduler::longestFlow(const Queue &queue) const
+{
+    uint32_t longest = 0;
+    for(uint32_t i = 1; i < FLOWS; i++)
+    {
+        if(queue.flows[i].bytes > queue.flows[longest].bytes)
+        {
+            longest = i;
+        }
+    }
+    return longest;
+}
+
+//------------------------------------------------------------------------------
+void TxScheduler::resetFlow(Flow &flow)
+{
+    flow.bytes = 0;
+    flow.deficit = 0;
+    flow.active = false;
+    flow.dropping = false;
+    flow.count = 0;
+    flow.last_count = 0;
+    flow.first_above = 0;
+    flow.drop_next = 0;
+}
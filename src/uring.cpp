@@ -0,0 +1,292 @@
+/*
+ * uring.cpp
+ *
+ *  Created on: 02.05.2021
+ *      Author: DI Andreas Auer
+ */
+
+#include "uring.h"
+
+#include <Poco/Exception.h>
+
+#include <cstring>
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace Poco;
+
+static const uint32_t NO_OP = 0xFFFFFFFF;
+
+//------------------------------------------------------------------------------
+static int uringSetup(uint32_t entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+//------------------------------------------------------------------------------
+static int uringEnter(int fd, uint32_t submit, uint32_t wait, uint32_t flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+//------------------------------------------------------------------------------
+static int uringRegister(int fd, uint32_t opcode, const void *arg, uint32_t count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+//------------------------------------------------------------------------------
+Uring::Uring(uint32_t entries) :
+    logger_(Logger::get("Uring")),
+    fd_(-1),
+    entries_(0),
+    sq_ring_(MAP_FAILED),
+    sq_ring_size_(0),
+    cq_ring_(MAP_FAILED),
+    cq_ring_size_(0),
+    sqes_((struct io_uring_sqe *)MAP_FAILED),
+    sq_pending_(0),
+    free_op_(NO_OP)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    fd_ = uringSetup(entries, &params);
+    if(fd_ < 0)
+    {
+        throw SystemException("io_uring not available", errno);
+    }
+
+    entries_ = params.sq_entries;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_ring_size_ = cq_ring_size_ = (sq_ring_size_ > cq_ring_size_) ? sq_ring_size_ : cq_ring_size_;
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd_, IORING_OFF_SQ_RING);
+    if(sq_ring_ != MAP_FAILED && (params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq_ring_ = sq_ring_;
+    }
+    else if(sq_ring_ != MAP_FAILED)
+    {
+        cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd_, IORING_OFF_CQ_RING);
+    }
+    if(cq_ring_ != MAP_FAILED)
+    {
+        sqes_ = (struct io_uring_sqe *)mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe),
+                                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            fd_, IORING_OFF_SQES);
+    }
+    if(sqes_ == MAP_FAILED)
+    {
+        unmap();
+        ::close(fd_);
+        throw SystemException("Cannot map io_uring");
+    }
+
+    uint8_t *sq = (uint8_t *)sq_ring_;
+    sq_head_ = (uint32_t *)(sq + params.sq_off.head);
+    sq_tail_ = (uint32_t *)(sq + params.sq_off.tail);
+    sq_mask_ = (uint32_t *)(sq + params.sq_off.ring_mask);
+    sq_array_ = (uint32_t *)(sq + params.sq_off.array);
+
+    uint8_t *cq = (uint8_t *)cq_ring_;
+    cq_head_ = (uint32_t *)(cq + params.cq_off.head);
+    cq_tail_ = (uint32_t *)(cq + params.cq_off.tail);
+    cq_mask_ = (uint32_t *)(cq + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    sq_pending_ = *sq_tail_;
+
+    // Never have more operations in flight than the completion ring holds
+    ops_.resize(params.cq_entries);
+    for(uint32_t i = 0; i < ops_.size(); i++)
+    {
+        ops_[i].completion = nullptr;
+        ops_[i].next_free = (i + 1 < ops_.size()) ? i + 1 : NO_OP;
+    }
+    free_op_ = 0;
+
+    logger_.information("io_uring with %?u entries", entries_);
+}
+
+//------------------------------------------------------------------------------
+Uring::~Uring()
+{
+    unmap();
+    ::close(fd_);
+}
+
+//------------------------------------------------------------------------------
+void Uring::unmap()
+{
+    if(sqes_ != MAP_FAILED)
+    {
+        munmap(sqes_, entries_ * sizeof(struct io_uring_sqe));
+    }
+    if(cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+    {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if(sq_ring_ != MAP_FAILED)
+    {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+}
+
+//------------------------------------------------------------------------------
+bool Uring::registerBuffers(const struct iovec *buffers, uint32_t count)
+{
+    if(uringRegister(fd_, IORING_REGISTER_BUFFERS, buffers, count) < 0)
+    {
+        logger_.warning("Cannot register %?u buffers: %d", count, errno);
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+struct io_uring_sqe *Uring::getSqe(Completion *completion, uint32_t tag)
+{
+    if(free_op_ == NO_OP)
+    {
+        return nullptr;
+    }
+
+    // Make room by handing the queued operations to the kernel
+    if(sq_pending_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= entries_ && !submit(0))
+    {
+        return nullptr;
+    }
+
+    uint32_t index = sq_pending_ & *sq_mask_;
+    struct io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    sq_pending_++;
+
+    uint32_t op = free_op_;
+    free_op_ = ops_[op].next_free;
+    ops_[op].completion = completion;
+    ops_[op].tag = tag;
+    sqe->user_data = op;
+
+    return sqe;
+}
+
+//------------------------------------------------------------------------------
+bool Uring::read(int fd, uint8_t *buffer, uint32_t size, int index, Completion *completion, uint32_t tag)
+{
+    struct io_uring_sqe *sqe = getSqe(completion, tag);
+    if(sqe == nullptr)
+    {
+        return false;
+    }
+
+    sqe->opcode = (index >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buffer;
+    sqe->len = size;
+    // Streams like tun and tty ignore the offset, -1 means current position
+    sqe->off = uint64_t(-1);
+    sqe->buf_index = (index >= 0) ? index : 0;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool Uring::write(int fd, const uint8_t *buffer, uint32_t size, Completion *completion, uint32_t tag)
+{
+    struct io_uring_sqe *sqe = getSqe(completion, tag);
+    if(sqe == nullptr)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buffer;
+    sqe->len = size;
+    sqe->off = uint64_t(-1);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool Uring::poll(int fd, uint32_t events, Completion *completion, uint32_t tag)
+{
+    struct io_uring_sqe *sqe = getSqe(completion, tag);
+    if(sqe == nullptr)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool Uring::submit(uint32_t wait)
+{
+    __atomic_store_n(sq_tail_, sq_pending_, __ATOMIC_RELEASE);
+
+    while(true)
+    {
+        uint32_t count = sq_pending_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if(count == 0 && wait == 0)
+        {
+            return true;
+        }
+
+        if(uringEnter(fd_, count, wait, wait ? IORING_ENTER_GETEVENTS : 0) >= 0)
+        {
+            return true;
+        }
+
+        if(errno != EINTR)
+        {
+            logger_.error("io_uring_enter failed: %d", errno);
+            return false;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+uint32_t Uring::complete()
+{
+    uint32_t count = 0;
+    uint32_t head = *cq_head_;
+
+    while(head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+        uint32_t op = cqe->user_data;
+        int32_t result = cqe->res;
+
+        head++;
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+        // Free the operation first, so the completion can queue the next one
+        Completion *completion = ops_[op].completion;
+        uint32_t tag = ops_[op].tag;
+        ops_[op].completion = nullptr;
+        ops_[op].next_free = free_op_;
+        free_op_ = op;
+
+        if(completion != nullptr)
+        {
+            completion->onComplete(result, tag);
+        }
+        count++;
+    }
+
+    return count;
+}